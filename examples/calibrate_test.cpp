@@ -0,0 +1,79 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  calibrate_test.ccp - Builds master bias and dark frames, saves them to masters.ssa and
+                       captures a light frame calibrated as it downloads. Pass -s to run
+                       against a simulated camera
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/opensspro.h"
+#include "../src/sequence.h"
+#include "../src/calibration.h"
+#include "../src/replaytransport.h"
+
+#define MASTER_FRAMES 10
+#define LIGHT_EXPOSURE 10000
+
+void AddFrame(OpenSSPRO::Frame& frame, const OpenSSPRO::FrameTiming*, void* context)
+{
+    ((OpenSSPRO::MasterBuilder*)context)->Add(frame.Image());
+}
+
+bool BuildMaster(OpenSSPRO::SSPRO* camera, OpenSSPRO::MasterType type, int exposureMs, OpenSSPRO::Calibration* calibration)
+{
+    OpenSSPRO::MasterBuilder builder;
+    builder.Begin(type);
+
+    OpenSSPRO::Sequencer sequencer(camera);
+    sequencer.SetFrameCallback(AddFrame, &builder);
+    std::vector<OpenSSPRO::SequenceStep> steps;
+    OpenSSPRO::SequenceStep frames = { MASTER_FRAMES, exposureMs, OpenSSPRO::READOUT_FASTEST };
+    steps.push_back(frames);
+    sequencer.Run(steps);
+
+    OpenSSPRO::Master master;
+    if (!builder.Finish(&master))
+        return false;
+    printf("Master %d from %d frames of %d ms\n", type, master.frames, exposureMs);
+    calibration->AddMaster(master);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    OpenSSPRO::ReplayTransport simulator;
+    simulator.SetSpeed(100.0);
+    bool simulate = (argc > 1 && strcmp(argv[1], "-s") == 0);
+    if (!(simulate ? camera->Connect(&simulator) : camera->Connect()))
+    {
+        printf("Failed to connect to camera\n");
+        return -1;
+    }
+
+    // Cover the camera before running this
+    OpenSSPRO::Calibration calibration;
+    if (!BuildMaster(camera, OpenSSPRO::MASTER_BIAS, 1, &calibration) ||
+        !BuildMaster(camera, OpenSSPRO::MASTER_DARK, LIGHT_EXPOSURE, &calibration))
+    {
+        printf("Failed to build the masters\n");
+        camera->Disconnect();
+        return -1;
+    }
+    calibration.Save("masters.ssa");
+
+    camera->SetCalibration(&calibration);
+    OpenSSPRO::rawImage* light = camera->Capture(LIGHT_EXPOSURE);
+    if (light != NULL)
+        printf("Light frame calibrated with 0x%x\n", light->calibrated);
+    camera->SetCalibration(NULL);
+
+    camera->Disconnect();
+    delete camera;
+}
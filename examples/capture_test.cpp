@@ -4,12 +4,14 @@
 
   Licensed under MIT License, see LICENSE for full license text
 
-  capture_test.ccp - Performs a simple capture test and exits
+  capture_test.ccp - Performs a simple capture test, adds the frame to the
+                     session archive and exits
 */
 
 #include <stdio.h>
 
 #include "../src/opensspro.h"
+#include "../src/archive.h"
 
 int main()
 {
@@ -23,8 +25,14 @@ int main()
 
     camera->GetStatus();
     OpenSSPRO::rawImage* newImage = camera->Capture(30000);
-    FILE* newFile = fopen("raw10s.image", "w");
-    fwrite(newImage->data, 1, newImage->dataSize, newFile);
-    fclose(newFile);
+    if (newImage != NULL)
+    {
+        // Raw download for the parser, decoded pixels for stacking and calibration
+        OpenSSPRO::ArchiveWriter archive;
+        archive.Create("session.ssa", 0);
+        archive.Append(newImage, OpenSSPRO::ARCHIVE_RAW);
+        archive.Append(newImage, OpenSSPRO::ARCHIVE_PIXELS);
+        archive.Close();
+    }
     camera->Disconnect();
 }
@@ -0,0 +1,169 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  decode_benchmark.ccp - Times the raw frame decoder against the original byte
+                         at a time parser loop, then the demosaic modes
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/rawdecoder.h"
+#include "../src/demosaic.h"
+
+#define MAX_TRANSFER_SIZE 12677612
+#define ITERATIONS        50
+
+static double Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Full 1x1 frame with bias level noise, used when no raw.image is given
+static unsigned int Synthesize(unsigned char* data)
+{
+    unsigned int noise = 1;
+    for (unsigned int r=0; r<RAW_FRAME_ROWS; r++)
+    {
+        unsigned char* row = data + r * RAW_ROW_BYTES;
+        memset(row, 0, RAW_MARKER_BYTES);
+        for (unsigned int i=RAW_MARKER_BYTES; i<RAW_ROW_BYTES; i += 2)
+        {
+            noise = noise * 1103515245 + 12345;
+            unsigned int pixel = 0x0128 + ((noise >> 16) & 0x3F);
+            row[i] = pixel & 0xFF;
+            row[i + 1] = pixel >> 8;
+        }
+    }
+    return RAW_FRAME_ROWS * RAW_ROW_BYTES;
+}
+
+// The pixel loop parseRawImage used before the decoder, kept here as the baseline
+#define LEGACY_WIDTH  3040
+#define LEGACY_HEIGHT 2028
+
+static void DecodeLegacy(const unsigned char* data, const unsigned int* rowStarts, int rowCount, unsigned short* image)
+{
+    unsigned short row[LEGACY_WIDTH];
+    unsigned char lastByte = 0;
+    for (int fitsRows=3; fitsRows<rowCount; fitsRows++)
+    {
+        if (fitsRows <= 1010)
+        {
+            int start = rowStarts[fitsRows] + 60 * 2;
+            for (int pixelBytes=0; pixelBytes<(RAW_ROW_BYTES - 140); pixelBytes++)
+            {
+                if (pixelBytes % 2 != 0)
+                    row[(pixelBytes-1)/2] = ((unsigned short)data[start + pixelBytes] << 8) + lastByte;
+                lastByte = data[start + pixelBytes];
+            }
+            memcpy(image + fitsRows * 2 * LEGACY_WIDTH, row, sizeof(row));
+        }
+        if (fitsRows >= 1021 && fitsRows < 2031)
+        {
+            int start = rowStarts[fitsRows] + 70 * 2;
+            for (int pixelBytes=0; pixelBytes<(RAW_ROW_BYTES - 140); pixelBytes++)
+            {
+                if (pixelBytes % 2 != 0)
+                    row[(pixelBytes-1)/2] = ((unsigned short)data[start + pixelBytes] << 8) + lastByte;
+                lastByte = data[start + pixelBytes];
+            }
+            memcpy(image + ((fitsRows-1016)*2-1) * LEGACY_WIDTH, row, sizeof(row));
+        }
+    }
+}
+
+static void Report(const char* name, double seconds, unsigned int size)
+{
+    double perFrame = seconds / ITERATIONS;
+    printf("%-11s %8.2f ms/frame %8.1f frames/s %8.1f MB/s\n",
+           name, perFrame * 1000.0, 1.0 / perFrame, size / perFrame / 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned char* data = (unsigned char*)malloc(MAX_TRANSFER_SIZE);
+    unsigned short* image = (unsigned short*)malloc(LEGACY_WIDTH * LEGACY_HEIGHT * sizeof(unsigned short));
+    unsigned int size;
+
+    if (argc > 1)
+    {
+        FILE* newFile = fopen(argv[1], "r");
+        if (newFile == NULL)
+        {
+            printf("Failed to open %s\n", argv[1]);
+            return -1;
+        }
+        size = fread(data, 1, MAX_TRANSFER_SIZE, newFile);
+        fclose(newFile);
+    }
+    else
+        size = Synthesize(data);
+
+    OpenSSPRO::RawDecoder decoder;
+    unsigned int rowStarts[RAW_FRAME_ROWS];
+    int rowCount = decoder.FindRows(data, size, rowStarts, RAW_FRAME_ROWS);
+    printf("%u bytes, %d rows, %d iterations\n", size, rowCount, ITERATIONS);
+
+    double start = Now();
+    for (int i=0; i<ITERATIONS; i++)
+        decoder.FindRows(data, size, rowStarts, RAW_FRAME_ROWS);
+    Report("rows", Now() - start, size);
+
+    // Decode finds the rows itself, so the legacy loop is timed with its row search too
+    start = Now();
+    for (int i=0; i<ITERATIONS; i++)
+    {
+        rowCount = decoder.FindRows(data, size, rowStarts, RAW_FRAME_ROWS);
+        DecodeLegacy(data, rowStarts, rowCount, image);
+    }
+    Report("legacy", Now() - start, size);
+
+    // Same output as the legacy loop, then the default layout with the bias removal fused in
+    const OpenSSPRO::FrameLayout interlaced = OpenSSPRO::RawDecoder::Layout(OpenSSPRO::LAYOUT_INTERLACED);
+    const OpenSSPRO::FrameLayout effective = OpenSSPRO::RawDecoder::Layout(OpenSSPRO::LAYOUT_EFFECTIVE);
+    const OpenSSPRO::DecodeKernel kernels[] = { OpenSSPRO::DECODE_SCALAR, OpenSSPRO::DECODE_SSE2,
+                                                OpenSSPRO::DECODE_AVX2, OpenSSPRO::DECODE_NEON };
+    for (unsigned int k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++)
+    {
+        if (!decoder.SetKernel(kernels[k]))
+            continue;
+        char name[32];
+        start = Now();
+        for (int i=0; i<ITERATIONS; i++)
+            decoder.Decode(data, size, image, interlaced);
+        snprintf(name, sizeof(name), "%s", OpenSSPRO::RawDecoder::KernelName(kernels[k]));
+        Report(name, Now() - start, size);
+
+        start = Now();
+        for (int i=0; i<ITERATIONS; i++)
+            decoder.Decode(data, size, image, effective);
+        snprintf(name, sizeof(name), "%s+bias", OpenSSPRO::RawDecoder::KernelName(kernels[k]));
+        Report(name, Now() - start, size);
+    }
+
+    // Colour from the effective frame left in image
+    OpenSSPRO::Demosaic demosaic;
+    unsigned short* rgb = (unsigned short*)malloc(EFFECTIVE_WIDTH * EFFECTIVE_HEIGHT * 3 * sizeof(unsigned short));
+    const OpenSSPRO::DemosaicMode modes[] = { OpenSSPRO::DEMOSAIC_BILINEAR, OpenSSPRO::DEMOSAIC_EDGE };
+    const char* modeNames[] = { "bilinear", "edge" };
+    for (unsigned int m=0; m<sizeof(modes)/sizeof(modes[0]); m++)
+    {
+        demosaic.SetMode(modes[m]);
+        start = Now();
+        for (int i=0; i<ITERATIONS; i++)
+            demosaic.Process(image, EFFECTIVE_WIDTH, EFFECTIVE_HEIGHT, rgb);
+        Report(modeNames[m], Now() - start, size);
+    }
+
+    free(rgb);
+    free(image);
+    free(data);
+}
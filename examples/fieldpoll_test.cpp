@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  fieldpoll_test.ccp - Takes a short exposure on a simulated camera by polling the
+                       status instead of WaitForFrame, then checks the download
+                       holds both fields
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../src/opensspro.h"
+#include "../src/protocol.h"
+#include "../src/replaytransport.h"
+
+#define EXPOSURE_MS   200
+#define POLL_MS       10
+#define TIMEOUT_MS    10000
+
+int main()
+{
+    OpenSSPRO::ReplayTransport simulator;
+    simulator.SetSpeed(100.0);
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    if (!camera->Connect(&simulator))
+    {
+        printf("Failed to connect to the simulator\n");
+        return -1;
+    }
+
+    int failures = 0;
+    if (!camera->StartCapture(EXPOSURE_MS))
+    {
+        printf("FAIL: capture did not start\n");
+        failures++;
+    }
+    if (camera->Download().IsValid())
+    {
+        printf("FAIL: downloaded before the second field was taken\n");
+        failures++;
+    }
+
+    int waited = 0;
+    while (waited < TIMEOUT_MS && camera->GetStatus() && !camera->IsFrameReady())
+    {
+        usleep(POLL_MS * 1000);
+        waited += POLL_MS;
+    }
+    unsigned char capture[CMD_LENGTH];
+    if (!simulator.GetSentCommand(USB_REQ_CAPTURE, capture) || capture[5] != CAPTURE_FIELD_B)
+    {
+        printf("FAIL: the second field was never started\n");
+        failures++;
+    }
+
+    OpenSSPRO::Frame frame = camera->Download();
+    if (!frame.IsValid())
+    {
+        printf("FAIL: download failed after %d ms of polling\n", waited);
+        failures++;
+    }
+    else
+    {
+        OpenSSPRO::rawImage* image = frame.Image();
+        printf("Decoded %ux%u, rows found %u, missing %u\n", image->width, image->height,
+               image->integrity.rowsFound, image->integrity.rowsMissing);
+        if (image->integrity.rowsFound != RAW_FRAME_ROWS || image->integrity.rowsMissing != 0)
+        {
+            printf("FAIL: expected both fields, %d rows\n", RAW_FRAME_ROWS);
+            failures++;
+        }
+    }
+    frame.Release();
+
+    camera->Disconnect();
+    delete camera;
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? -1 : 0;
+}
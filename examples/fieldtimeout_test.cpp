@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  fieldtimeout_test.ccp - Lets the second field of a short exposure time out on a
+                          simulated camera, then checks the first field went back
+                          to the pool and that Disconnect returns
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+
+#include "../src/opensspro.h"
+#include "../src/protocol.h"
+#include "../src/replaytransport.h"
+
+#define EXPOSURE_MS   200
+#define TIMEOUT_MS    500
+#define WATCHDOG_S    30
+
+// The simulated camera, except that the second field never finishes exposing
+class StalledField : public OpenSSPRO::ReplayTransport
+{
+public:
+    int Send(unsigned char* data, int length, int* sent, unsigned int timeout)
+    {
+        unsigned char command[CMD_LENGTH];
+        if (length == CMD_LENGTH && data[1] == USB_REQ_CAPTURE && data[5] == CAPTURE_FIELD_B)
+        {
+            memcpy(command, data, CMD_LENGTH);
+            command[2] |= CAPTURE_TENTHS; // Longest exposure the camera takes
+            command[3] = 0xFF;
+            command[4] = 0xFF;
+            data = command;
+        }
+        return OpenSSPRO::ReplayTransport::Send(data, length, sent, timeout);
+    }
+};
+
+int main()
+{
+    std::atomic<bool> finished(false);
+    std::thread watchdog([&finished]{
+        for (int i=0; i<WATCHDOG_S * 10 && !finished; i++)
+            usleep(100000);
+        if (!finished)
+        {
+            printf("FAILED: hung, a frame buffer was never released\n");
+            _exit(1);
+        }
+    });
+
+    StalledField simulator;
+    simulator.SetSpeed(100.0);
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO(); // Default pool of 2 frame buffers
+    if (!camera->Connect(&simulator))
+    {
+        printf("Failed to connect to the simulator\n");
+        return -1;
+    }
+
+    int failures = 0;
+    if (!camera->StartCapture(EXPOSURE_MS) || camera->WaitForFrame(TIMEOUT_MS))
+    {
+        printf("FAIL: the second field should have timed out\n");
+        failures++;
+    }
+    unsigned char capture[CMD_LENGTH];
+    if (!simulator.GetSentCommand(USB_REQ_CAPTURE, capture) || capture[5] != CAPTURE_FIELD_B)
+    {
+        printf("FAIL: the second field was never started\n");
+        failures++;
+    }
+
+    int free = camera->GetFreeFrameBuffers();
+    if (free != camera->GetFramePoolSize())
+    {
+        printf("FAIL: %d of %d frame buffers free after the timeout\n", free, camera->GetFramePoolSize());
+        failures++;
+    }
+
+    camera->Disconnect();
+    delete camera;
+    finished = true;
+    watchdog.join();
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? -1 : 0;
+}
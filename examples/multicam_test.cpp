@@ -0,0 +1,102 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  multicam_test.ccp - Lists every Starshoot on the bus, then exposes and downloads on all of them
+                      at once. Pass serial numbers or locations to pick cameras, -s adds two
+                      simulated cameras instead
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <future>
+
+#include "../src/opensspro.h"
+#include "../src/replaytransport.h"
+
+#define EXPOSURE_MS 5000
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> serials;
+    bool simulate = false;
+    for (int i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+            simulate = true;
+        else
+            serials.push_back(argv[i]);
+    }
+
+    struct OpenSSPRO::deviceInfo* devices = OpenSSPRO::SSPRO::GetDevices();
+    for (struct OpenSSPRO::deviceInfo* device = devices; device; device = device->next)
+    {
+        printf("Camera at %s, serial %s\n", device->location, device->serialNum[0] ? device->serialNum : "unknown");
+        if (argc == 1)
+            serials.push_back(device->serialNum[0] ? device->serialNum : device->location);
+    }
+    OpenSSPRO::SSPRO::FreeDevices(devices);
+
+    int failures = 0;
+    std::vector<OpenSSPRO::SSPRO*> cameras;
+    std::vector<OpenSSPRO::ReplayTransport*> simulators;
+    for (size_t i=0; i<serials.size(); i++)
+    {
+        OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+        if (camera->Connect(serials[i]))
+            cameras.push_back(camera);
+        else
+        {
+            printf("Failed to connect to %s\n", serials[i].c_str());
+            delete camera;
+        }
+    }
+    for (int i=0; simulate && i<2; i++)
+    {
+        OpenSSPRO::ReplayTransport* simulator = new OpenSSPRO::ReplayTransport();
+        simulator->SetSpeed(100.0);
+        OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+        simulators.push_back(simulator);
+        if (camera->Connect(simulator))
+            cameras.push_back(camera);
+        else
+        {
+            printf("Failed to connect to simulated camera %d\n", i);
+            delete camera;
+            failures++;
+        }
+    }
+    if (cameras.empty())
+    {
+        printf("No cameras\n");
+        return -1;
+    }
+
+    // Every camera exposes and downloads on its own I/O thread, USB events for all of them are
+    // handled on one shared thread
+    std::vector<std::future<bool> > captures;
+    for (size_t i=0; i<cameras.size(); i++)
+        captures.push_back(std::async(std::launch::async, [&cameras, i]{ return cameras[i]->Capture(EXPOSURE_MS) != NULL; }));
+    for (size_t i=0; i<cameras.size(); i++)
+    {
+        if (captures[i].get())
+            printf("Camera %zu downloaded at %.2f MB/s\n", i, cameras[i]->GetDownloadRate());
+        else
+        {
+            printf("Camera %zu failed to capture\n", i);
+            failures++;
+        }
+    }
+
+    for (size_t i=0; i<cameras.size(); i++)
+    {
+        cameras[i]->Disconnect();
+        delete cameras[i];
+    }
+    for (size_t i=0; i<simulators.size(); i++)
+        delete simulators[i];
+    return failures ? -1 : 0;
+}
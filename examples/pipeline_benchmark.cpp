@@ -0,0 +1,297 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  pipeline_benchmark.ccp - Times every stage between the USB bulk endpoint and the FITS file on
+                           a full frame and two subframes: the download loop against a simulated
+                           camera, row sync, decode, streaming decode, demosaic and FITS write.
+                           Each stage reports ns per output pixel and MB/s of its input, with the
+                           spread across repeats.
+
+                           With no arguments the fixtures are synthesized. Raw dumps, such as the
+                           replay.image that replay writes from a USB log, replace them:
+                               pipeline -f full.image -s subframe.image x y width height binning
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../src/opensspro.h"
+#include "../src/protocol.h"
+#include "../src/rawdecoder.h"
+#include "../src/demosaic.h"
+#include "../src/fitswriter.h"
+#include "../src/replaytransport.h"
+
+#define DEFAULT_REPEATS 20
+#define DOWNLOAD_FRAMES 10
+#define STREAM_CHUNK    (256*1024) // Same as the default URB size
+#define FITS_FILE       "pipeline_benchmark.fit"
+
+using namespace OpenSSPRO;
+
+struct Fixture {
+    std::string name;
+    std::vector<unsigned char> data;
+    struct Subframe subframe;
+    struct FrameLayout layout;
+};
+
+static double Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// One untimed run to warm the caches, then repeats timed runs
+template <typename Body>
+static std::vector<double> Time(int repeats, Body body)
+{
+    std::vector<double> seconds;
+    body();
+    for (int i=0; i<repeats; i++)
+    {
+        double start = Now();
+        body();
+        seconds.push_back(Now() - start);
+    }
+    return seconds;
+}
+
+static void Report(const char* stage, const std::vector<double>& seconds, double pixels, double bytes)
+{
+    if (seconds.empty())
+        return;
+    double mean = 0.0;
+    for (size_t i=0; i<seconds.size(); i++)
+        mean += seconds[i];
+    mean /= seconds.size();
+    double variance = 0.0;
+    for (size_t i=0; i<seconds.size(); i++)
+        variance += (seconds[i] - mean) * (seconds[i] - mean);
+    double deviation = (seconds.size() > 1) ? sqrt(variance / (seconds.size() - 1)) : 0.0;
+
+    printf("  %-18s %9.3f ms %8.2f ns/px %9.1f MB/s  +/- %5.1f%%\n", stage, mean * 1000.0,
+           mean * 1e9 / pixels, bytes / mean / 1e6, (mean > 0.0) ? deviation / mean * 100.0 : 0.0);
+}
+
+// Rows as the camera sends them for this layout, with bias level noise like the simulator
+static void Synthesize(struct Fixture& fixture)
+{
+    fixture.data.resize((size_t)fixture.layout.rawRows * RAW_ROW_BYTES);
+    unsigned int noise = 1;
+    for (int r=0; r<fixture.layout.rawRows; r++)
+    {
+        unsigned char* row = &fixture.data[(size_t)r * RAW_ROW_BYTES];
+        memset(row, 0, RAW_MARKER_BYTES);
+        for (unsigned int i=RAW_MARKER_BYTES; i<RAW_ROW_BYTES; i += 2)
+        {
+            noise = noise * 1103515245 + 12345;
+            unsigned int pixel = 0x0128 + ((noise >> 16) & 0x3F);
+            row[i] = pixel & 0xFF;
+            row[i + 1] = pixel >> 8;
+        }
+    }
+}
+
+static bool Load(struct Fixture& fixture, const char* fileName)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL)
+    {
+        printf("Failed to open %s\n", fileName);
+        return false;
+    }
+    fixture.data.resize((size_t)RAW_FRAME_ROWS * RAW_ROW_BYTES + BUFFER_SIZE);
+    fixture.data.resize(fread(&fixture.data[0], 1, fixture.data.size(), file));
+    fclose(file);
+    fixture.name += " (";
+    fixture.name += fileName;
+    fixture.name += ")";
+    return !fixture.data.empty();
+}
+
+static struct Fixture MakeFixture(const char* name, int x, int y, int width, int height, int binning)
+{
+    struct Fixture fixture;
+    fixture.name = name;
+    struct Subframe subframe = { x, y, width, height, binning };
+    fixture.subframe = RawDecoder::Fit(subframe);
+    fixture.layout = RawDecoder::Layout(LAYOUT_EFFECTIVE, fixture.subframe);
+    return fixture;
+}
+
+// Downloads from the simulated camera, one sample per download command. The simulator hands
+// data over in URB sized pieces, so this times the download loop and streaming decode without USB
+static void Download(const struct Fixture& fixture, bool decode)
+{
+    ReplayTransport simulator;
+    simulator.SetSpeed(1e6);
+    SSPRO camera;
+    camera.SetDecodeOnDownload(decode);
+    camera.SetMeasureOnDownload(false);
+    if (!camera.Connect(&simulator))
+    {
+        printf("  Failed to connect to the simulator\n");
+        return;
+    }
+    camera.SetBinning(fixture.subframe.binning);
+    camera.SetSubframe(fixture.subframe.x, fixture.subframe.y, fixture.subframe.width, fixture.subframe.height);
+
+    Tracer* tracer = camera.GetTracer();
+    for (int i=0; i<DOWNLOAD_FRAMES + 1; i++)
+    {
+        if (i == 1)
+            tracer->Reset(); // The first frame warms up
+        if (camera.Capture(1) == NULL)
+        {
+            printf("  Capture failed\n");
+            break;
+        }
+    }
+
+    std::vector<TraceRecord> records;
+    tracer->Snapshot(records);
+    std::vector<double> seconds;
+    double bytes = 0.0;
+    for (size_t i=0; i<records.size(); i++)
+    {
+        if (records[i].event != TRACE_DOWNLOAD)
+            continue;
+        seconds.push_back(records[i].duration / 1e9);
+        bytes += records[i].value;
+    }
+    camera.Disconnect();
+
+    if (!seconds.empty())
+    {
+        bytes /= seconds.size();
+        double frameBytes = (double)fixture.layout.rawRows * RAW_ROW_BYTES; // Short 1x1 exposures come a field at a time
+        double pixels = (double)fixture.layout.width * fixture.layout.height * bytes / frameBytes;
+        Report(decode ? "download+decode" : "download", seconds, pixels, bytes);
+    }
+}
+
+static void Run(const struct Fixture& fixture, int repeats)
+{
+    const unsigned char* data = &fixture.data[0];
+    unsigned int size = fixture.data.size();
+    const struct FrameLayout& layout = fixture.layout;
+    double pixels = (double)layout.width * layout.height;
+    std::vector<uint16_t> image((size_t)layout.width * layout.height);
+
+    RawDecoder decoder;
+    std::vector<unsigned int> rowStarts(RAW_FRAME_ROWS);
+    int rows = decoder.FindRows(data, size, &rowStarts[0], RAW_FRAME_ROWS);
+    printf("%s: %dx%d binning %d, %u bytes, %d of %d rows\n", fixture.name.c_str(), layout.width, layout.height,
+           fixture.subframe.binning, size, rows, layout.rawRows);
+
+    Download(fixture, false);
+    Download(fixture, true);
+
+    Report("row sync", Time(repeats, [&]{ decoder.FindRows(data, size, &rowStarts[0], RAW_FRAME_ROWS); }), pixels, size);
+
+    // Sync, de-interlace, bias and crop are one pass in the decoder, so they are timed together
+    const DecodeKernel kernels[] = { DECODE_SCALAR, DECODE_SSE2, DECODE_AVX2, DECODE_NEON };
+    for (unsigned int k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++)
+    {
+        if (!decoder.SetKernel(kernels[k]))
+            continue;
+        char name[32];
+        snprintf(name, sizeof(name), "decode %s", RawDecoder::KernelName(kernels[k]));
+        Report(name, Time(repeats, [&]{ decoder.Decode(data, size, &image[0], layout); }), pixels, size);
+    }
+    decoder.SetKernel(RawDecoder::BestKernel());
+
+    // As the download path decodes, a URB at a time
+    RowDecoder rowDecoder(&decoder);
+    Report("stream decode", Time(repeats, [&]{
+        rowDecoder.Begin(data, &image[0], &layout);
+        for (unsigned int fed = STREAM_CHUNK; fed < size; fed += STREAM_CHUNK)
+            rowDecoder.Feed(fed);
+        rowDecoder.Finish(size);
+    }), pixels, size);
+
+    if (fixture.subframe.binning == 1)
+    {
+        Demosaic demosaic;
+        std::vector<uint16_t> rgb(image.size() * 3);
+        demosaic.SetMode(DEMOSAIC_BILINEAR);
+        Report("demosaic bilinear", Time(repeats, [&]{ demosaic.Process(&image[0], layout.width, layout.height, &rgb[0]); }),
+               pixels, pixels * 2);
+        demosaic.SetMode(DEMOSAIC_EDGE);
+        Report("demosaic edge", Time(repeats, [&]{ demosaic.Process(&image[0], layout.width, layout.height, &rgb[0]); }),
+               pixels, pixels * 2);
+    }
+
+    // Page cache writes, the card or disk under it is a separate question
+    FitsWriter fits;
+    const FitsCompression compressions[] = { FITS_UNCOMPRESSED, FITS_RICE };
+    const char* compressionNames[] = { "fits", "fits rice" };
+    for (int c=0; c<2; c++)
+    {
+        fits.SetCompression(compressions[c]);
+        Report(compressionNames[c], Time(repeats, [&]{
+            fits.Open(FITS_FILE, layout.width, layout.height);
+            fits.WriteRows(&image[0], layout.height);
+            fits.Close();
+        }), pixels, pixels * 2);
+    }
+    unlink(FITS_FILE);
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int repeats = DEFAULT_REPEATS;
+    struct Fixture full = MakeFixture("full frame", 0, 0, 0, 0, 1);
+    std::vector<struct Fixture> subframes;
+    subframes.push_back(MakeFixture("subframe 1x1", 100, 200, 640, 480, 1));
+    subframes.push_back(MakeFixture("subframe 2x2", 95, 338, 611, 106, 2)); // As in usb-logs/08
+    for (size_t i=0; i<subframes.size(); i++)
+        Synthesize(subframes[i]);
+    Synthesize(full);
+
+    for (int i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            if (!Load(full, argv[++i]))
+                return -1;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 6 < argc)
+        {
+            struct Fixture subframe = MakeFixture("subframe", atoi(argv[i + 2]), atoi(argv[i + 3]), atoi(argv[i + 4]),
+                                                  atoi(argv[i + 5]), atoi(argv[i + 6]));
+            if (!Load(subframe, argv[i + 1]))
+                return -1;
+            subframes.clear();
+            subframes.push_back(subframe);
+            i += 6;
+        }
+        else
+        {
+            printf("Usage: %s [-n repeats] [-f full.image] [-s subframe.image x y width height binning]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (repeats < 2)
+        repeats = 2;
+
+    printf("%d repeats per stage, %d downloads\n\n", repeats, DOWNLOAD_FRAMES);
+    Run(full, repeats);
+    for (size_t i=0; i<subframes.size(); i++)
+        Run(subframes[i], repeats);
+    return 0;
+}
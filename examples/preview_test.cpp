@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  preview_test.ccp - Captures a frame and saves a 4x4 binned, auto stretched colour preview
+                     as preview.ppm. Pass -s to run against a simulated camera
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/opensspro.h"
+#include "../src/preview.h"
+#include "../src/replaytransport.h"
+
+int main(int argc, char* argv[])
+{
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    OpenSSPRO::ReplayTransport simulator;
+    simulator.SetSpeed(100.0);
+    bool simulate = (argc > 1 && strcmp(argv[1], "-s") == 0);
+    if (!(simulate ? camera->Connect(&simulator) : camera->Connect()))
+    {
+        printf("Failed to connect to camera\n");
+        return -1;
+    }
+
+    OpenSSPRO::Frame frame = camera->CaptureFrame(5000);
+    if (!frame.IsValid() || frame.Pixels() == NULL)
+    {
+        printf("Capture failed\n");
+        camera->Disconnect();
+        delete camera;
+        return -1;
+    }
+
+    OpenSSPRO::Preview preview;
+    preview.SetBinning(4);
+    const struct OpenSSPRO::rawImage* image = frame.Image();
+    int width = preview.GetWidth(image->width);
+    int height = preview.GetHeight(image->height);
+    std::vector<uint8_t> pixels((size_t)width * height * preview.GetChannels());
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    preview.Process(image, NULL, &pixels[0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%dx%d preview in %.1f ms, background %.1f, noise %.1f\n", width, height,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+           image->stats.frame.median, image->stats.noise);
+
+    FILE* file = fopen("preview.ppm", "wb");
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(&pixels[0], 1, pixels.size(), file);
+    fclose(file);
+
+    frame.Release(); // Disconnect waits for every frame to come back
+    camera->Disconnect();
+    delete camera;
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  replay_test.ccp - Runs a capture against a recorded USB log, or a simulated
+                    camera when no log is given, no hardware needed
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/opensspro.h"
+#include "../src/protocol.h"
+#include "../src/replaytransport.h"
+
+// Set the camera up as the recorded capture was, so the commands it sends match the recording
+void ConfigureFromCapture(OpenSSPRO::ReplayTransport& replay, OpenSSPRO::SSPRO* camera, int* exposure)
+{
+    unsigned char capture[CMD_LENGTH];
+    if (!replay.GetRecordedCommand(USB_REQ_CAPTURE, capture))
+        return;
+    int binning = (capture[5] == CAPTURE_BINNED) ? 2 : 1;
+    unsigned int value = (capture[3] << 8) | capture[4];
+    *exposure = (capture[2] & CAPTURE_TENTHS) ? value * 100 : value;
+    camera->SetReadoutSpeed((OpenSSPRO::ReadOutSpeed)((capture[2] >> 1) & 0x07));
+    camera->SetBinning(binning);
+
+    unsigned char frame[CMD_LENGTH];
+    if (!replay.GetRecordedCommand(USB_REQ_SET_FRAME, frame))
+        return;
+    int pair = (binning == 1) ? 2 : 1;
+    int start = (frame[2] << 8) | frame[3];
+    int rows = ((frame[4] << 8) | frame[5]) - OpenSSPRO::RawDecoder::BlankingRows(binning);
+    // Columns are not part of the command, read the whole width
+    camera->SetSubframe(0, start * pair, EFFECTIVE_WIDTH / binning, rows * pair);
+}
+
+int main(int argc, char* argv[])
+{
+    OpenSSPRO::ReplayTransport replay;
+    if (argc > 1 && !replay.Load(argv[1]))
+    {
+        printf("Failed to load %s\n", argv[1]);
+        return -1;
+    }
+
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    int exposure = 1000;
+    ConfigureFromCapture(replay, camera, &exposure);
+    if (argc > 2)
+        exposure = atoi(argv[2]);
+
+    if (!camera->Connect(&replay))
+    {
+        printf("Failed to connect to replay\n");
+        return -1;
+    }
+
+    camera->GetStatus();
+    OpenSSPRO::rawImage* newImage = camera->Capture(exposure);
+    if (newImage == NULL)
+    {
+        printf("Capture failed\n");
+        camera->Disconnect();
+        return -1;
+    }
+    printf("Received %u bytes at %.2f MB/s\n", newImage->dataSize, camera->GetDownloadRate());
+    printf("Rows found %u, repaired %u, missing %u, bytes dropped %u\n", newImage->integrity.rowsFound,
+           newImage->integrity.rowsRepaired, newImage->integrity.rowsMissing, newImage->integrity.bytesDropped);
+    const OpenSSPRO::FrameStats& stats = newImage->stats;
+    printf("Min %u, max %u, mean %.1f, median %.1f, stddev %.1f, %u saturated\n", stats.frame.minimum, stats.frame.maximum,
+           stats.frame.mean, stats.frame.median, stats.frame.stddev, stats.frame.saturated);
+    for (int i=0; i<stats.fieldCount; i++)
+        printf("Field %d mean %.1f, median %.1f\n", i, stats.fields[i].mean, stats.fields[i].median);
+    if (stats.stars > 0)
+        printf("%d stars, HFR %.2f, FWHM %.2f, elongation %.2f\n", stats.stars, stats.hfr, stats.fwhm, stats.elongation);
+
+    FILE* newFile = fopen("replay.image", "w");
+    fwrite(newImage->data, 1, newImage->dataSize, newFile);
+    fclose(newFile);
+    camera->Disconnect();
+    delete camera;
+}
@@ -0,0 +1,64 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  sequence_test.ccp - Captures a short sequence, saving each frame as Rice
+                      compressed FITS in the background while the next one is exposing.
+                      The pipeline timing is written to sequence_trace.json for chrome://tracing
+*/
+
+#include <stdio.h>
+
+#include "../src/opensspro.h"
+#include "../src/sequence.h"
+#include "../src/framewriter.h"
+
+void SaveFrame(OpenSSPRO::Frame& frame, const OpenSSPRO::FrameTiming* timing, void* context)
+{
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "light%03d.fit", timing->index);
+
+    OpenSSPRO::FrameWriter* writer = (OpenSSPRO::FrameWriter*)context;
+    writer->Submit(std::move(frame), fileName); // Waits only if the writer is a whole frame behind
+}
+
+int main()
+{
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    camera->SetFramePoolSize(5); // Downloading, sequence queue, writer queue, being written, spare
+
+    if (!camera->Connect())
+    {
+        printf("Failed to connect to camera\n");
+        return -1;
+    }
+
+    OpenSSPRO::Sequencer sequencer(camera);
+    OpenSSPRO::FrameWriter writer;
+    writer.SetCompression(OpenSSPRO::FITS_RICE);
+    writer.SetDirectIO(true); // SD cards gain nothing from caching frames that are never read back
+    writer.SetTracer(camera->GetTracer());
+    sequencer.SetFrameCallback(SaveFrame, &writer);
+
+    std::vector<OpenSSPRO::SequenceStep> steps;
+    OpenSSPRO::SequenceStep lights = { 5, 10000, OpenSSPRO::READOUT_FASTEST };
+    steps.push_back(lights);
+
+    sequencer.Run(steps);
+    printf("Duty cycle: %.1f%%\n", sequencer.GetDutyCycle() * 100.0);
+    if (camera->GetReconnectCount() > 0)
+        printf("Camera reconnected %d times, last took %.0f ms\n", camera->GetReconnectCount(), camera->GetReconnectTime());
+
+    writer.Flush();
+    printf("Saved %d frames, %.1fx smaller, %.0f ms each\n", writer.GetFramesWritten(),
+           writer.GetCompressionRatio(), writer.GetWriteTime() * 1000.0);
+
+    camera->GetTracer()->PrintSummary();
+    if (!camera->GetTracer()->WriteChromeTrace("sequence_trace.json"))
+        printf("Failed to write sequence_trace.json\n");
+
+    camera->Disconnect();
+    delete camera;
+}
@@ -0,0 +1,66 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  stack_test.ccp - Live stacks a sequence, each frame is aligned and added while the
+                   next one is exposing, and saves the stack as stack.fit
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/opensspro.h"
+#include "../src/sequence.h"
+#include "../src/livestack.h"
+#include "../src/fitswriter.h"
+
+void StackFrame(OpenSSPRO::Frame& frame, const OpenSSPRO::FrameTiming* timing, void* context)
+{
+    OpenSSPRO::LiveStack* stack = (OpenSSPRO::LiveStack*)context;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool added = stack->Add(frame.Image());
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    OpenSSPRO::StackTransform transform = stack->GetLastTransform();
+    printf("Frame %d %s, %d stars, %d matched, shift %.1f,%.1f, rotation %.3f deg, %.0f ms\n", timing->index,
+           added ? "stacked" : "skipped", transform.stars, transform.matches, transform.dx, transform.dy,
+           transform.angle * 180.0 / 3.14159265, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+int main()
+{
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    if (!camera->Connect())
+    {
+        printf("Failed to connect to camera\n");
+        return -1;
+    }
+
+    OpenSSPRO::LiveStack stack;
+    stack.SetMode(OpenSSPRO::STACK_KAPPA_SIGMA);
+    stack.Reset();
+
+    OpenSSPRO::Sequencer sequencer(camera);
+    sequencer.SetFrameCallback(StackFrame, &stack);
+    std::vector<OpenSSPRO::SequenceStep> steps;
+    OpenSSPRO::SequenceStep lights = { 10, 15000, OpenSSPRO::READOUT_FASTEST };
+    steps.push_back(lights);
+    sequencer.Run(steps);
+    camera->Disconnect();
+    delete camera;
+
+    printf("Stacked %d frames, skipped %d\n", stack.GetFrameCount(), stack.GetRejectedCount());
+    std::vector<uint16_t> image((size_t)stack.GetWidth() * stack.GetHeight());
+    if (!stack.GetImage(&image[0]))
+        return -1;
+
+    OpenSSPRO::FitsWriter fits;
+    fits.AddKey("NCOMBINE", (long)stack.GetFrameCount(), "Frames in the stack");
+    if (!fits.Open("stack.fit", stack.GetWidth(), stack.GetHeight()))
+        return -1;
+    fits.WriteRows(&image[0], stack.GetHeight());
+    return fits.Close() ? 0 : -1;
+}
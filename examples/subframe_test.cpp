@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full license text
+
+  subframe_test.ccp - Replays the 2x2 subframe capture in usb-log 08 and checks the
+                      frame command and the decoded rows against the recording
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/opensspro.h"
+#include "../src/protocol.h"
+#include "../src/replaytransport.h"
+
+#define TRACE_08 "../usb-logs/08 - LightMono2x2At5sExp1sSubframe95,338-706,444Res611x106.pcapng"
+
+int main(int argc, char* argv[])
+{
+    // First row pair 338, 106 light rows plus 6 blanking rows
+    const unsigned char expected[CMD_LENGTH] = { 0xA5, 0x0B, 0x01, 0x52, 0x00, 0x70 };
+    const char* fileName = (argc > 1) ? argv[1] : TRACE_08;
+
+    OpenSSPRO::ReplayTransport replay;
+    unsigned char recorded[CMD_LENGTH];
+    if (!replay.Load(fileName) || !replay.GetRecordedCommand(USB_REQ_SET_FRAME, recorded))
+    {
+        printf("Failed to load %s\n", fileName);
+        return -1;
+    }
+    if (memcmp(recorded, expected, CMD_LENGTH) != 0)
+    {
+        printf("%s is not the 95,338 611x106 2x2 capture\n", fileName);
+        return -1;
+    }
+
+    OpenSSPRO::SSPRO* camera = new OpenSSPRO::SSPRO();
+    camera->SetBinning(2);
+    camera->SetSubframe(95, 338, 611, 106);
+    if (!camera->Connect(&replay))
+    {
+        printf("Failed to connect to replay\n");
+        return -1;
+    }
+
+    int failures = 0;
+    OpenSSPRO::rawImage* image = camera->Capture(1000);
+    unsigned char sent[CMD_LENGTH];
+    if (!replay.GetSentCommand(USB_REQ_SET_FRAME, sent) || memcmp(sent, recorded, CMD_LENGTH) != 0)
+    {
+        printf("FAIL: frame command %02x %02x %02x %02x differs from the recording\n", sent[2], sent[3], sent[4], sent[5]);
+        failures++;
+    }
+    if (image == NULL)
+    {
+        printf("FAIL: capture failed\n");
+        failures++;
+    }
+    else
+    {
+        printf("Decoded %ux%u, rows found %u, missing %u\n", image->width, image->height,
+               image->integrity.rowsFound, image->integrity.rowsMissing);
+        if (image->width != 611 || image->height != 106 || image->integrity.rowsFound != 112 ||
+            image->integrity.rowsMissing != 0)
+        {
+            printf("FAIL: expected 611x106 from 112 rows\n");
+            failures++;
+        }
+    }
+
+    camera->Disconnect();
+    delete camera;
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? -1 : 0;
+}
@@ -0,0 +1,336 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  archive.cpp - Many frames in one memory mapped file with an index at the end
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "opensspro.h"
+#include "archive.h"
+
+#define ARCHIVE_MAGIC   "SSPROARC"
+#define FRAME_MAGIC     "SSPROFRM"
+#define INDEX_MAGIC     "SSPROIDX"
+#define ARCHIVE_GROWTH  (64 * 1024 * 1024) // File is extended in steps of this once preallocation runs out
+
+using namespace OpenSSPRO;
+
+static_assert(sizeof(ArchiveEntry) == 128, "ArchiveEntry is part of the file format");
+static_assert(sizeof(ArchiveTrailer) == 32, "ArchiveTrailer is part of the file format");
+
+static inline size_t PageAlign(size_t bytes)
+{
+    return (bytes + ARCHIVE_PAGE_SIZE - 1) & ~(size_t)(ARCHIVE_PAGE_SIZE - 1);
+}
+
+// An entry from a damaged or hostile file must not point readers past the end of the mapping
+static inline bool InMap(const ArchiveEntry& entry, size_t mapSize)
+{
+    if (entry.offset > mapSize || entry.size > mapSize - entry.offset)
+        return false;
+    return entry.content == ARCHIVE_RAW || (uint64_t)entry.width * entry.height * sizeof(uint16_t) <= entry.size;
+}
+
+ArchiveWriter::ArchiveWriter()
+{
+    file = -1;
+    map = NULL;
+    mapSize = 0;
+    cursor = 0;
+    growth = ARCHIVE_GROWTH;
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if (file >= 0)
+        this->Close();
+}
+
+bool ArchiveWriter::Create(const char* fileName, size_t preallocate)
+{
+    if (file >= 0)
+        this->Close();
+
+    file = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+    {
+        ERROR("Failed to create %s: %s\n", fileName, strerror(errno));
+        return false;
+    }
+
+    index.clear();
+    cursor = 0;
+    if (!this->Reserve(PageAlign(preallocate > ARCHIVE_PAGE_SIZE ? preallocate : ARCHIVE_PAGE_SIZE)))
+    {
+        close(file);
+        file = -1;
+        return false;
+    }
+
+    memcpy(map, ARCHIVE_MAGIC, 8);
+    uint32_t version = ARCHIVE_VERSION;
+    uint32_t entrySize = sizeof(ArchiveEntry);
+    memcpy(map + 8, &version, sizeof(version));
+    memcpy(map + 12, &entrySize, sizeof(entrySize));
+    cursor = ARCHIVE_PAGE_SIZE;
+    return true;
+}
+
+bool ArchiveWriter::Reserve(size_t bytes)
+{
+    if (bytes <= mapSize)
+        return true;
+
+    // Allocated on disk up front so a full card fails here rather than as SIGBUS in a memcpy
+    size_t size = (mapSize == 0) ? bytes : PageAlign(std::max(bytes, mapSize + growth));
+    int result = posix_fallocate(file, 0, size);
+    if (result != 0)
+    {
+        ERROR("Failed to extend archive to %lu bytes: %s\n", (unsigned long)size, strerror(result));
+        return false;
+    }
+
+    if (map != NULL)
+        munmap(map, mapSize);
+    map = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED)
+    {
+        ERROR("Failed to map archive: %s\n", strerror(errno));
+        map = NULL;
+        mapSize = 0;
+        return false;
+    }
+    mapSize = size;
+    return true;
+}
+
+bool ArchiveWriter::Append(const struct rawImage* image, ArchiveContent content)
+{
+    if (file < 0)
+        return false;
+
+    bool pixels = (content != ARCHIVE_RAW);
+    const unsigned char* data = pixels ? (const unsigned char*)image->pixels : image->data;
+    size_t size = pixels ? (size_t)image->width * image->height * sizeof(uint16_t) : image->dataSize;
+    if (data == NULL)
+    {
+        ERROR("Frame has no %s data\n", pixels ? "decoded" : "raw");
+        return false;
+    }
+
+    // Room for the trailer too, so Close never has to grow the file for it
+    size_t end = cursor + ARCHIVE_PAGE_SIZE + PageAlign(size);
+    size_t indexSize = (index.size() + 1) * sizeof(ArchiveEntry) + sizeof(ArchiveTrailer);
+    if (!this->Reserve(end + indexSize))
+        return false;
+
+    ArchiveEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = cursor + ARCHIVE_PAGE_SIZE;
+    entry.size = size;
+    entry.content = content;
+    entry.width = image->width;
+    entry.height = image->height;
+    entry.exposureMs = image->capture.exposureMs;
+    entry.readoutSpeed = image->capture.readoutSpeed;
+    entry.dio = (image->capture.coolerOn ? 0x01 : 0x00) | (image->capture.fanHigh ? 0x02 : 0x00);
+    entry.startSeconds = image->capture.exposureStart.tv_sec;
+    entry.startNanoseconds = image->capture.exposureStart.tv_nsec;
+    entry.writtenSeconds = time(NULL);
+    entry.rowsFound = image->integrity.rowsFound;
+    entry.rowsRepaired = image->integrity.rowsRepaired;
+    entry.rowsMissing = image->integrity.rowsMissing;
+    entry.bytesDropped = image->integrity.bytesDropped;
+    entry.subframeX = image->capture.subframe.x;
+    entry.subframeY = image->capture.subframe.y;
+    entry.binning = image->capture.subframe.binning;
+
+    unsigned char* page = map + cursor;
+    memcpy(page, FRAME_MAGIC, 8);
+    memcpy(page + 8, &entry, sizeof(entry));
+    memcpy(map + entry.offset, data, size);
+
+    // Start writeback now instead of leaving a whole night of dirty pages for Close
+    msync(page, end - cursor, MS_ASYNC);
+    index.push_back(entry);
+    cursor = end;
+    return true;
+}
+
+bool ArchiveWriter::Close()
+{
+    if (file < 0)
+        return false;
+
+    bool result = true;
+    if (map != NULL)
+    {
+        ArchiveTrailer trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, INDEX_MAGIC, 8);
+        trailer.indexOffset = cursor;
+        trailer.count = index.size();
+        trailer.entrySize = sizeof(ArchiveEntry);
+
+        size_t indexSize = index.size() * sizeof(ArchiveEntry);
+        if (indexSize > 0)
+            memcpy(map + cursor, &index[0], indexSize);
+        memcpy(map + cursor + indexSize, &trailer, sizeof(trailer));
+        cursor += indexSize + sizeof(trailer);
+
+        if (msync(map, mapSize, MS_SYNC) != 0)
+            result = false;
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+    }
+
+    if (ftruncate(file, cursor) != 0 || close(file) != 0)
+        result = false;
+    if (!result)
+        ERROR("Failed to finish archive: %s\n", strerror(errno));
+    file = -1;
+    return result;
+}
+
+int ArchiveWriter::GetFrameCount()
+{
+    return index.size();
+}
+
+ArchiveReader::ArchiveReader()
+{
+    file = -1;
+    map = NULL;
+    mapSize = 0;
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    this->Close();
+}
+
+bool ArchiveReader::Open(const char* fileName)
+{
+    this->Close();
+
+    file = open(fileName, O_RDONLY);
+    struct stat info;
+    if (file < 0 || fstat(file, &info) != 0)
+    {
+        ERROR("Failed to open %s: %s\n", fileName, strerror(errno));
+        this->Close();
+        return false;
+    }
+
+    mapSize = info.st_size;
+    if (mapSize >= ARCHIVE_PAGE_SIZE)
+        map = (const unsigned char*)mmap(NULL, mapSize, PROT_READ, MAP_SHARED, file, 0);
+    if (map == NULL || map == MAP_FAILED || memcmp(map, ARCHIVE_MAGIC, 8) != 0)
+    {
+        ERROR("%s is not a frame archive\n", fileName);
+        if (map == MAP_FAILED)
+            map = NULL;
+        this->Close();
+        return false;
+    }
+
+    ArchiveTrailer trailer;
+    memcpy(&trailer, map + mapSize - sizeof(trailer), sizeof(trailer));
+    if (memcmp(trailer.magic, INDEX_MAGIC, 8) == 0 && trailer.entrySize == sizeof(ArchiveEntry) && trailer.indexOffset <= mapSize &&
+        trailer.indexOffset + (uint64_t)trailer.count * sizeof(ArchiveEntry) + sizeof(trailer) <= mapSize)
+    {
+        const ArchiveEntry* entries = (const ArchiveEntry*)(map + trailer.indexOffset);
+        bool valid = true;
+        for (uint32_t i=0; i<trailer.count && valid; i++)
+            valid = InMap(entries[i], mapSize);
+        if (valid)
+        {
+            index.assign(entries, entries + trailer.count);
+            return true;
+        }
+        ERROR("%s has a damaged index, rebuilding it\n", fileName);
+    }
+    else
+        DEBUG("%s was not closed, rebuilding its index\n", fileName);
+    return this->Scan();
+}
+
+bool ArchiveReader::Scan()
+{
+    size_t offset = ARCHIVE_PAGE_SIZE;
+    while (offset + ARCHIVE_PAGE_SIZE <= mapSize && memcmp(map + offset, FRAME_MAGIC, 8) == 0)
+    {
+        ArchiveEntry entry;
+        memcpy(&entry, map + offset + 8, sizeof(entry));
+        if (entry.offset != offset + ARCHIVE_PAGE_SIZE || !InMap(entry, mapSize))
+            break; // Cut off while it was being written
+        index.push_back(entry);
+        offset = entry.offset + PageAlign(entry.size);
+    }
+    return true;
+}
+
+void ArchiveReader::Close()
+{
+    if (map != NULL)
+        munmap((void*)map, mapSize);
+    if (file >= 0)
+        close(file);
+    map = NULL;
+    mapSize = 0;
+    file = -1;
+    index.clear();
+}
+
+int ArchiveReader::GetFrameCount()
+{
+    return index.size();
+}
+
+const ArchiveEntry* ArchiveReader::GetEntry(int frame)
+{
+    if (frame < 0 || frame >= (int)index.size())
+        return NULL;
+    return &index[frame];
+}
+
+const unsigned char* ArchiveReader::GetData(int frame)
+{
+    const ArchiveEntry* entry = this->GetEntry(frame);
+    return (entry != NULL && InMap(*entry, mapSize)) ? map + entry->offset : NULL;
+}
+
+const uint16_t* ArchiveReader::GetPixels(int frame)
+{
+    const ArchiveEntry* entry = this->GetEntry(frame);
+    if (entry == NULL || entry->content == ARCHIVE_RAW || !InMap(*entry, mapSize))
+        return NULL;
+    return (const uint16_t*)(map + entry->offset);
+}
+
+const uint16_t* ArchiveReader::GetRow(int frame, int row)
+{
+    const uint16_t* pixels = this->GetPixels(frame);
+    if (pixels == NULL || row < 0 || row >= (int)index[frame].height)
+        return NULL;
+    return pixels + (size_t)row * index[frame].width;
+}
+
+void ArchiveReader::WillNeed(int frame)
+{
+    const ArchiveEntry* entry = this->GetEntry(frame);
+    if (entry != NULL)
+        madvise((void*)(map + entry->offset), PageAlign(entry->size), MADV_WILLNEED);
+}
@@ -0,0 +1,117 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_ARCHIVE_H__
+#define __OPEN_SSPRO_ARCHIVE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "framepool.h"
+
+// Session archive layout, all fields in host (little endian) order:
+//   page 0          file header, "SSPROARC" and the version
+//   per frame       one page holding "SSPROFRM" and its ArchiveEntry, then the data padded to a page
+//   after the last  the ArchiveEntry index, then an ArchiveTrailer in the last 32 bytes
+// Data starts on a page so readers can use it straight from the mapping. An archive that was
+// never closed has no trailer, readers rebuild the index by walking the frame pages.
+#define ARCHIVE_PAGE_SIZE 4096
+#define ARCHIVE_VERSION   1
+
+namespace OpenSSPRO
+{
+    enum ArchiveContent
+    {
+        ARCHIVE_RAW = 0,         // The download as received, dataSize bytes
+        ARCHIVE_PIXELS = 1,      // Decoded pixels, width x height uint16_t
+        ARCHIVE_MASTER_BIAS = 2, // Calibration masters, pixels like ARCHIVE_PIXELS, see Calibration::Save
+        ARCHIVE_MASTER_DARK = 3,
+        ARCHIVE_MASTER_FLAT = 4
+    };
+
+    struct ArchiveEntry {
+        uint64_t offset; // Start of the data in the file
+        uint64_t size;   // Bytes of data
+        uint32_t content;
+        uint32_t width;
+        uint32_t height;
+        int32_t exposureMs;
+        int32_t readoutSpeed;
+        uint32_t dio;    // DIO byte at capture, bit 0 cooler on, bit 1 fan high
+        int64_t startSeconds; // Exposure start, UTC
+        int64_t startNanoseconds;
+        int64_t writtenSeconds;
+        uint32_t rowsFound;
+        uint32_t rowsRepaired;
+        uint32_t rowsMissing;
+        uint32_t bytesDropped;
+        int32_t subframeX;  // Origin of the read out area, binned pixels of the effective image
+        int32_t subframeY;
+        uint32_t binning;   // 1 or 2, 0 in archives written before it was kept
+        uint8_t reserved[36];
+    };
+
+    struct ArchiveTrailer {
+        char magic[8]; // "SSPROIDX"
+        uint64_t indexOffset;
+        uint32_t count;
+        uint32_t entrySize;
+        uint64_t reserved;
+    };
+
+    // Appends frames to one preallocated file through a shared mapping, the index is written on Close
+    class ArchiveWriter
+    {
+    private:
+        int file;
+        unsigned char* map;
+        size_t mapSize;
+        size_t cursor; // End of the last frame, page aligned
+        size_t growth;
+        std::vector<ArchiveEntry> index;
+
+        bool Reserve(size_t bytes);
+
+    public:
+        ArchiveWriter();
+        ~ArchiveWriter();
+
+        bool Create(const char* fileName, size_t preallocate); // Replaces the file, grows past preallocate as needed
+        bool Append(const struct rawImage* image, ArchiveContent content);
+        bool Close(); // Writes the index and trims the file
+        int GetFrameCount();
+    };
+
+    // Maps a whole archive read only, frames and rows are handed out without copying
+    class ArchiveReader
+    {
+    private:
+        int file;
+        const unsigned char* map;
+        size_t mapSize;
+        std::vector<ArchiveEntry> index;
+
+        bool Scan(); // Rebuilds the index of an archive that was never closed
+
+    public:
+        ArchiveReader();
+        ~ArchiveReader();
+
+        bool Open(const char* fileName);
+        void Close();
+
+        int GetFrameCount();
+        const ArchiveEntry* GetEntry(int frame);
+        const unsigned char* GetData(int frame);       // Valid until Close
+        const uint16_t* GetPixels(int frame);          // NULL for ARCHIVE_RAW frames
+        const uint16_t* GetRow(int frame, int row);
+        void WillNeed(int frame); // Starts reading the frame in ahead of use
+    };
+}
+
+#endif /* __OPEN_SSPRO_ARCHIVE_H__ */
@@ -0,0 +1,823 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  calibration.cpp - Master bias, dark and flat frames, built from sequences and applied as frames download
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "opensspro.h"
+#include "calibration.h"
+#include "archive.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    #include <emmintrin.h>
+    #define HAVE_SSE2
+#endif
+
+// vdivq_f32 and vcvtnq_s32_f32 are AArch64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+    #define HAVE_NEON
+#endif
+
+#define BAND_ROWS            32   // Rows per task
+#define CLIP_MIN_VARIANCE    1.0f // Keeps identical samples from rejecting every later one that differs
+#define MAD_TO_SIGMA         1.4826f // Median absolute deviation to standard deviation for Gaussian noise
+#define MEDIAN_STEP          1.57f // pi/2, turns the mean absolute deviation into the ideal Robbins-Monro gain for Gaussian noise
+#define CALIBRATION_PEDESTAL 100  // Added back after the dark so noise below it is not clipped, as in the decoder
+
+using namespace OpenSSPRO;
+
+static bool KernelBuilt(DecodeKernel kernel)
+{
+    switch (kernel)
+    {
+        case DECODE_SCALAR:
+            return true;
+#ifdef HAVE_SSE2
+        case DECODE_SSE2:
+            return true;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static DecodeKernel BestBuiltKernel()
+{
+#if defined(HAVE_SSE2)
+    return DECODE_SSE2;
+#elif defined(HAVE_NEON)
+    return DECODE_NEON;
+#else
+    return DECODE_SCALAR;
+#endif
+}
+
+// Frames that never came from the camera leave the subframe zeroed, that is a 1x1 read
+static inline int Binning(const struct Subframe& subframe)
+{
+    return (subframe.binning == 2) ? 2 : 1;
+}
+
+// Same pixels of the sensor, the width and height are checked against the frame's own
+static bool SameSubframe(const struct MasterKey& key, const struct Subframe& subframe)
+{
+    return key.binning == Binning(subframe) && key.x == subframe.x && key.y == subframe.y;
+}
+
+static inline uint16_t Round16(float value)
+{
+    return (value <= 0.0f) ? 0 : (value >= 65535.0f) ? 0xFFFF : (uint16_t)(value + 0.5f);
+}
+
+// Welford update of the running mean, skipping samples more than clip standard deviations away.
+// The pixel's variance is never taken below floor, the frame's noise, so a few close samples
+// cannot shut out the rest. Once most of the seen frames were rejected the kept samples must be
+// the outliers, and the pixel starts again from the current one. clip2 is clip squared, 0 keeps
+// every sample
+static void AccumulateScalar(const uint16_t* pixels, float* mean, float* m2, float* count, int from, int to,
+                             float clip2, float floor, float seen)
+{
+    for (int i=from; i<to; i++)
+    {
+        float x = pixels[i];
+        float d = x - mean[i];
+        float n = count[i];
+        float previous = std::max(n - 1.0f, 1.0f);
+        if (clip2 > 0.0f && d * d * previous > clip2 * std::max(m2[i], floor * previous))
+        {
+            if (seen >= 2.0f * n)
+            {
+                mean[i] = x;
+                m2[i] = 0.0f;
+                count[i] = 1.0f;
+            }
+            continue;
+        }
+        n += 1.0f;
+        count[i] = n;
+        mean[i] += d / n;
+        m2[i] += d * (x - mean[i]);
+    }
+}
+
+#ifdef HAVE_SSE2
+static void AccumulateSSE2(const uint16_t* pixels, float* mean, float* m2, float* count, int from, int to,
+                           float clip2, float floor, float seen)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 variance = _mm_set1_ps(floor);
+    const __m128 limit = _mm_set1_ps(clip2);
+    const __m128 frames = _mm_set1_ps(seen);
+    bool clipping = (clip2 > 0.0f);
+    int i = from;
+    for (; i + 4 <= to; i += 4)
+    {
+        __m128i raw = _mm_loadl_epi64((const __m128i*)(pixels + i));
+        __m128 x = _mm_cvtepi32_ps(_mm_unpacklo_epi16(raw, zero));
+        __m128 mu = _mm_loadu_ps(mean + i);
+        __m128 s = _mm_loadu_ps(m2 + i);
+        __m128 n = _mm_loadu_ps(count + i);
+        __m128 d = _mm_sub_ps(x, mu);
+
+        __m128 keep = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        __m128 restart = _mm_setzero_ps();
+        if (clipping)
+        {
+            __m128 previous = _mm_max_ps(_mm_sub_ps(n, one), one);
+            __m128 spread = _mm_max_ps(s, _mm_mul_ps(variance, previous));
+            keep = _mm_cmple_ps(_mm_mul_ps(_mm_mul_ps(d, d), previous), _mm_mul_ps(limit, spread));
+            restart = _mm_andnot_ps(keep, _mm_cmpge_ps(frames, _mm_add_ps(n, n)));
+        }
+
+        __m128 next = _mm_add_ps(n, _mm_and_ps(keep, one));
+        __m128 newMean = _mm_add_ps(mu, _mm_and_ps(keep, _mm_div_ps(d, next)));
+        __m128 newM2 = _mm_add_ps(s, _mm_and_ps(keep, _mm_mul_ps(d, _mm_sub_ps(x, newMean))));
+        next = _mm_or_ps(_mm_and_ps(restart, one), _mm_andnot_ps(restart, next));
+        newMean = _mm_or_ps(_mm_and_ps(restart, x), _mm_andnot_ps(restart, newMean));
+        newM2 = _mm_andnot_ps(restart, newM2);
+        _mm_storeu_ps(count + i, next);
+        _mm_storeu_ps(mean + i, newMean);
+        _mm_storeu_ps(m2 + i, newM2);
+    }
+    AccumulateScalar(pixels, mean, m2, count, i, to, clip2, floor, seen);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void AccumulateNEON(const uint16_t* pixels, float* mean, float* m2, float* count, int from, int to,
+                           float clip2, float floor, float seen)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t variance = vdupq_n_f32(floor);
+    const float32x4_t limit = vdupq_n_f32(clip2);
+    const float32x4_t frames = vdupq_n_f32(seen);
+    bool clipping = (clip2 > 0.0f);
+    int i = from;
+    for (; i + 4 <= to; i += 4)
+    {
+        float32x4_t x = vcvtq_f32_u32(vmovl_u16(vld1_u16(pixels + i)));
+        float32x4_t mu = vld1q_f32(mean + i);
+        float32x4_t s = vld1q_f32(m2 + i);
+        float32x4_t n = vld1q_f32(count + i);
+        float32x4_t d = vsubq_f32(x, mu);
+
+        uint32x4_t keep = vdupq_n_u32(0xFFFFFFFF);
+        uint32x4_t restart = vdupq_n_u32(0);
+        if (clipping)
+        {
+            float32x4_t previous = vmaxq_f32(vsubq_f32(n, one), one);
+            float32x4_t spread = vmaxq_f32(s, vmulq_f32(variance, previous));
+            keep = vcleq_f32(vmulq_f32(vmulq_f32(d, d), previous), vmulq_f32(limit, spread));
+            restart = vbicq_u32(vcgeq_f32(frames, vaddq_f32(n, n)), keep);
+        }
+
+        float32x4_t next = vbslq_f32(keep, vaddq_f32(n, one), n);
+        float32x4_t newMean = vbslq_f32(keep, vaddq_f32(mu, vdivq_f32(d, next)), mu);
+        float32x4_t newM2 = vbslq_f32(keep, vaddq_f32(s, vmulq_f32(d, vsubq_f32(x, newMean))), s);
+        next = vbslq_f32(restart, one, next);
+        newMean = vbslq_f32(restart, x, newMean);
+        newM2 = vbslq_f32(restart, vdupq_n_f32(0.0f), newM2);
+        vst1q_f32(count + i, next);
+        vst1q_f32(mean + i, newMean);
+        vst1q_f32(m2 + i, newM2);
+    }
+    AccumulateScalar(pixels, mean, m2, count, i, to, clip2, floor, seen);
+}
+#endif
+
+// First three frames of a sigma clipped mean. The first two are parked in the planes, the third
+// gives their median and spread, and only the samples close to that median start the mean. An
+// outlier this early would otherwise inflate the spread enough to never be rejected
+static void SeedClipScalar(const uint16_t* pixels, float* mean, float* m2, float* count, int frames, int from, int to,
+                           float clip2, float floor)
+{
+    for (int i=from; i<to; i++)
+    {
+        float x = pixels[i];
+        if (frames == 1)
+        {
+            mean[i] = x;
+            continue;
+        }
+        if (frames == 2)
+        {
+            m2[i] = x;
+            continue;
+        }
+
+        float samples[3] = { mean[i], m2[i], x };
+        float m = std::max(std::min(samples[0], samples[1]), std::min(std::max(samples[0], samples[1]), x));
+        float a = fabsf(samples[0] - m);
+        float b = fabsf(samples[1] - m);
+        float c = fabsf(x - m);
+        float deviation = std::max(std::min(a, b), std::min(std::max(a, b), c)) * MAD_TO_SIGMA;
+        float limit = clip2 * std::max(deviation * deviation, floor);
+
+        mean[i] = 0.0f;
+        m2[i] = 0.0f;
+        count[i] = 0.0f;
+        for (int j=0; j<3; j++)
+        {
+            float d = samples[j] - mean[i];
+            if ((samples[j] - m) * (samples[j] - m) > limit)
+                continue;
+            count[i] += 1.0f;
+            mean[i] += d / count[i];
+            m2[i] += d * (samples[j] - mean[i]);
+        }
+    }
+}
+
+// Median of each pixel without keeping the samples. The first two frames are parked in the planes,
+// the third gives the median of three as a start and the spread around it, after that the estimate
+// moves towards each sample by a step that shrinks with the frame count (Robbins-Monro)
+static void MedianScalar(const uint16_t* pixels, float* median, float* deviation, int frames, int from, int to)
+{
+    for (int i=from; i<to; i++)
+    {
+        float x = pixels[i];
+        if (frames == 1)
+        {
+            median[i] = x;
+        }
+        else if (frames == 2)
+        {
+            deviation[i] = x;
+        }
+        else if (frames == 3)
+        {
+            float a = median[i];
+            float b = deviation[i];
+            float m = std::max(std::min(a, b), std::min(std::max(a, b), x));
+            median[i] = m;
+            deviation[i] = (fabsf(a - m) + fabsf(b - m) + fabsf(x - m)) / 3.0f;
+        }
+        else
+        {
+            float d = x - median[i];
+            deviation[i] += (fabsf(d) - deviation[i]) / frames;
+            float step = MEDIAN_STEP * std::max(deviation[i], 0.5f) / frames;
+            median[i] += (d > 0.0f) ? std::min(step, d) : std::max(-step, d);
+        }
+    }
+}
+
+// Dark subtracted with the pedestal kept, saturating at both ends
+static void SubtractScalar(uint16_t* pixels, const uint16_t* dark, int from, int to)
+{
+    for (int i=from; i<to; i++)
+    {
+        int value = std::min(pixels[i] + CALIBRATION_PEDESTAL, 0xFFFF) - dark[i];
+        pixels[i] = (value < 0) ? 0 : value;
+    }
+}
+
+static void FlattenScalar(uint16_t* pixels, const uint16_t* dark, const float* gain, int from, int to)
+{
+    for (int i=from; i<to; i++)
+    {
+        long value = lrintf((float)(pixels[i] - dark[i]) * gain[i] + CALIBRATION_PEDESTAL);
+        pixels[i] = (value < 0) ? 0 : (value > 0xFFFF) ? 0xFFFF : value;
+    }
+}
+
+#ifdef HAVE_SSE2
+static void SubtractSSE2(uint16_t* pixels, const uint16_t* dark, int from, int to)
+{
+    const __m128i pedestal = _mm_set1_epi16(CALIBRATION_PEDESTAL);
+    int i = from;
+    for (; i + 8 <= to; i += 8)
+    {
+        __m128i value = _mm_adds_epu16(_mm_loadu_si128((const __m128i*)(pixels + i)), pedestal);
+        _mm_storeu_si128((__m128i*)(pixels + i), _mm_subs_epu16(value, _mm_loadu_si128((const __m128i*)(dark + i))));
+    }
+    SubtractScalar(pixels, dark, i, to);
+}
+
+static inline __m128i FlattenSSE2(__m128i value, __m128i dark, const float* gain)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 pedestal = _mm_set1_ps(CALIBRATION_PEDESTAL);
+    __m128i low = _mm_sub_epi32(_mm_unpacklo_epi16(value, zero), _mm_unpacklo_epi16(dark, zero));
+    __m128i high = _mm_sub_epi32(_mm_unpackhi_epi16(value, zero), _mm_unpackhi_epi16(dark, zero));
+    low = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(low), _mm_loadu_ps(gain)), pedestal));
+    high = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(high), _mm_loadu_ps(gain + 4)), pedestal));
+
+    // SSE2 only packs to signed 16 bits, so shift into that range and back
+    const __m128i offset = _mm_set1_epi32(0x8000);
+    __m128i packed = _mm_packs_epi32(_mm_sub_epi32(low, offset), _mm_sub_epi32(high, offset));
+    return _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000));
+}
+
+static void FlattenRowSSE2(uint16_t* pixels, const uint16_t* dark, const float* gain, int from, int to)
+{
+    int i = from;
+    for (; i + 8 <= to; i += 8)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128i offset = _mm_loadu_si128((const __m128i*)(dark + i));
+        _mm_storeu_si128((__m128i*)(pixels + i), FlattenSSE2(value, offset, gain + i));
+    }
+    FlattenScalar(pixels, dark, gain, i, to);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void SubtractNEON(uint16_t* pixels, const uint16_t* dark, int from, int to)
+{
+    const uint16x8_t pedestal = vdupq_n_u16(CALIBRATION_PEDESTAL);
+    int i = from;
+    for (; i + 8 <= to; i += 8)
+        vst1q_u16(pixels + i, vqsubq_u16(vqaddq_u16(vld1q_u16(pixels + i), pedestal), vld1q_u16(dark + i)));
+    SubtractScalar(pixels, dark, i, to);
+}
+
+static void FlattenRowNEON(uint16_t* pixels, const uint16_t* dark, const float* gain, int from, int to)
+{
+    const float32x4_t pedestal = vdupq_n_f32(CALIBRATION_PEDESTAL);
+    int i = from;
+    for (; i + 8 <= to; i += 8)
+    {
+        uint16x8_t value = vld1q_u16(pixels + i);
+        uint16x8_t offset = vld1q_u16(dark + i);
+        int32x4_t low = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(value))),
+                                  vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(offset))));
+        int32x4_t high = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(value))),
+                                   vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(offset))));
+        low = vcvtnq_s32_f32(vmlaq_f32(pedestal, vcvtq_f32_s32(low), vld1q_f32(gain + i)));
+        high = vcvtnq_s32_f32(vmlaq_f32(pedestal, vcvtq_f32_s32(high), vld1q_f32(gain + i + 4)));
+        vst1q_u16(pixels + i, vcombine_u16(vqmovun_s32(low), vqmovun_s32(high)));
+    }
+    FlattenScalar(pixels, dark, gain, i, to);
+}
+#endif
+
+MasterBuilder::MasterBuilder(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    method = COMBINE_SIGMA_CLIP;
+    combining = method;
+    clipSigma = 3.0f;
+    kernel = BestBuiltKernel();
+    this->Begin(MASTER_BIAS);
+}
+
+MasterBuilder::~MasterBuilder()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+void MasterBuilder::SetMethod(CombineMethod method)
+{
+    this->method = method;
+}
+
+void MasterBuilder::SetClipSigma(float sigma)
+{
+    clipSigma = sigma;
+}
+
+bool MasterBuilder::SetKernel(DecodeKernel kernel)
+{
+    if (!KernelBuilt(kernel))
+        return false;
+    this->kernel = kernel;
+    return true;
+}
+
+DecodeKernel MasterBuilder::GetKernel()
+{
+    return kernel;
+}
+
+void MasterBuilder::Begin(MasterType type)
+{
+    memset(&key, 0, sizeof(key));
+    key.type = type;
+    key.binning = 1;
+    width = 0;
+    height = 0;
+    frames = 0;
+    noiseFloor = CLIP_MIN_VARIANCE;
+    estimate.clear();
+    spread.clear();
+    count.clear();
+}
+
+bool MasterBuilder::Add(const struct rawImage* image)
+{
+    if (image->pixels == NULL)
+    {
+        ERROR("Frame was not decoded, turn on SetDecodeOnDownload\n");
+        return false;
+    }
+
+    if (frames == 0)
+    {
+        key.exposureMs = image->capture.exposureMs;
+        key.readoutSpeed = image->capture.readoutSpeed;
+        key.coolerOn = image->capture.coolerOn;
+        key.binning = Binning(image->capture.subframe);
+        key.x = image->capture.subframe.x;
+        key.y = image->capture.subframe.y;
+    }
+    else if (image->capture.readoutSpeed != key.readoutSpeed || image->capture.coolerOn != key.coolerOn ||
+             !SameSubframe(key, image->capture.subframe) ||
+             (key.type != MASTER_FLAT && image->capture.exposureMs != key.exposureMs))
+    {
+        // Flats may vary in exposure, the master is normalised anyway
+        ERROR("Frame does not match the master's exposure, readout speed, cooler state or subframe\n");
+        return false;
+    }
+
+    return this->Add(image->pixels, image->width, image->height);
+}
+
+bool MasterBuilder::Add(const uint16_t* pixels, int width, int height)
+{
+    if (frames == 0)
+    {
+        combining = method;
+        this->width = width;
+        this->height = height;
+
+        size_t size = (size_t)width * height;
+        estimate.assign(size, 0.0f);
+        spread.assign(size, 0.0f);
+        if (combining != COMBINE_MEDIAN)
+            count.assign(size, 0.0f);
+    }
+    else if (width != this->width || height != this->height)
+    {
+        ERROR("Frame is %dx%d, the master %dx%d\n", width, height, this->width, this->height);
+        return false;
+    }
+
+    frames++;
+    int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->AddRows(pixels, first, std::min(first + BAND_ROWS, height));
+    });
+
+    if (combining == COMBINE_SIGMA_CLIP && frames == 2)
+        this->MeasureNoise();
+    return true;
+}
+
+// Variance of one frame's noise from the difference of the two parked frames, robust to outliers
+void MasterBuilder::MeasureNoise()
+{
+    std::vector<unsigned int> histogram(0x10000, 0);
+    for (size_t i=0; i<estimate.size(); i++)
+        histogram[(int)fabsf(estimate[i] - spread[i])]++;
+
+    size_t half = estimate.size() / 2;
+    size_t seen = 0;
+    int median = 0;
+    while (seen + histogram[median] <= half)
+        seen += histogram[median++];
+
+    float sigma = median * MAD_TO_SIGMA / sqrtf(2.0f); // The difference has twice the variance
+    noiseFloor = std::max(sigma * sigma, CLIP_MIN_VARIANCE);
+    DEBUG("Frame noise %.1f ADU\n", sigma);
+}
+
+void MasterBuilder::AddRows(const uint16_t* pixels, int first, int last)
+{
+    int from = first * width;
+    int to = last * width;
+    if (combining == COMBINE_MEDIAN)
+    {
+        MedianScalar(pixels, &estimate[0], &spread[0], frames, from, to);
+        return;
+    }
+
+    float clip2 = (combining == COMBINE_SIGMA_CLIP) ? clipSigma * clipSigma : 0.0f;
+    if (combining == COMBINE_SIGMA_CLIP && frames <= 3)
+    {
+        SeedClipScalar(pixels, &estimate[0], &spread[0], &count[0], frames, from, to, clip2, noiseFloor);
+        return;
+    }
+    switch (kernel)
+    {
+#ifdef HAVE_SSE2
+        case DECODE_SSE2: AccumulateSSE2(pixels, &estimate[0], &spread[0], &count[0], from, to, clip2, noiseFloor, frames - 1); break;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON: AccumulateNEON(pixels, &estimate[0], &spread[0], &count[0], from, to, clip2, noiseFloor, frames - 1); break;
+#endif
+        default: AccumulateScalar(pixels, &estimate[0], &spread[0], &count[0], from, to, clip2, noiseFloor, frames - 1); break;
+    }
+}
+
+int MasterBuilder::GetFrameCount()
+{
+    return frames;
+}
+
+bool MasterBuilder::Finish(struct Master* master)
+{
+    if (frames == 0)
+    {
+        ERROR("No frames added to the master\n");
+        return false;
+    }
+
+    master->key = key;
+    master->width = width;
+    master->height = height;
+    master->frames = frames;
+    master->pixels.resize(estimate.size());
+
+    // With fewer than three frames the median and sigma clip planes still hold the samples
+    bool parked = (combining != COMBINE_MEAN && frames == 2);
+    for (size_t i=0; i<estimate.size(); i++)
+        master->pixels[i] = Round16(parked ? (estimate[i] + spread[i]) * 0.5f : estimate[i]);
+    return true;
+}
+
+Calibration::Calibration(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    kernel = BestBuiltKernel();
+    prepared = false;
+    memset(&preparedFor, 0, sizeof(preparedFor));
+    preparedWidth = 0;
+    preparedHeight = 0;
+    steps = 0;
+}
+
+Calibration::~Calibration()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+bool Calibration::SetKernel(DecodeKernel kernel)
+{
+    if (!KernelBuilt(kernel))
+        return false;
+    std::lock_guard<std::mutex> guard(lock);
+    this->kernel = kernel;
+    return true;
+}
+
+DecodeKernel Calibration::GetKernel()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return kernel;
+}
+
+void Calibration::AddMaster(const struct Master& master)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i=0; i<masters.size(); i++)
+    {
+        const struct Master& old = masters[i];
+        if (old.key.type == master.key.type && old.key.exposureMs == master.key.exposureMs &&
+            old.key.readoutSpeed == master.key.readoutSpeed && old.key.coolerOn == master.key.coolerOn &&
+            old.key.binning == master.key.binning && old.key.x == master.key.x && old.key.y == master.key.y &&
+            old.width == master.width && old.height == master.height)
+        {
+            masters.erase(masters.begin() + i);
+            break;
+        }
+    }
+    masters.push_back(master);
+    prepared = false;
+}
+
+void Calibration::Clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    masters.clear();
+    prepared = false;
+}
+
+int Calibration::GetMasterCount()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return masters.size();
+}
+
+bool Calibration::Save(const char* fileName)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    ArchiveWriter archive;
+    if (!archive.Create(fileName, 0))
+        return false;
+
+    for (size_t i=0; i<masters.size(); i++)
+    {
+        struct rawImage image;
+        memset(&image, 0, sizeof(image));
+        image.width = masters[i].width;
+        image.height = masters[i].height;
+        image.pixels = &masters[i].pixels[0];
+        image.capture.exposureMs = masters[i].key.exposureMs;
+        image.capture.readoutSpeed = masters[i].key.readoutSpeed;
+        image.capture.coolerOn = masters[i].key.coolerOn;
+        image.capture.subframe.x = masters[i].key.x;
+        image.capture.subframe.y = masters[i].key.y;
+        image.capture.subframe.width = masters[i].width;
+        image.capture.subframe.height = masters[i].height;
+        image.capture.subframe.binning = masters[i].key.binning;
+        if (!archive.Append(&image, (ArchiveContent)(ARCHIVE_MASTER_BIAS + masters[i].key.type)))
+            return false;
+    }
+    return archive.Close();
+}
+
+bool Calibration::Load(const char* fileName)
+{
+    ArchiveReader archive;
+    if (!archive.Open(fileName))
+        return false;
+
+    int loaded = 0;
+    for (int i=0; i<archive.GetFrameCount(); i++)
+    {
+        const ArchiveEntry* entry = archive.GetEntry(i);
+        if (entry->content < ARCHIVE_MASTER_BIAS || entry->content > ARCHIVE_MASTER_FLAT)
+            continue;
+
+        struct Master master;
+        master.key.type = (MasterType)(entry->content - ARCHIVE_MASTER_BIAS);
+        master.key.exposureMs = entry->exposureMs;
+        master.key.readoutSpeed = entry->readoutSpeed;
+        master.key.coolerOn = (entry->dio & 0x01) != 0;
+        master.key.binning = (entry->binning == 2) ? 2 : 1; // 0 in archives from before it was kept
+        master.key.x = entry->subframeX;
+        master.key.y = entry->subframeY;
+        master.width = entry->width;
+        master.height = entry->height;
+        master.frames = 0; // Not kept in the archive
+        const uint16_t* pixels = archive.GetPixels(i);
+        master.pixels.assign(pixels, pixels + (size_t)entry->width * entry->height);
+        this->AddMaster(master);
+        loaded++;
+    }
+
+    DEBUG("Loaded %d masters from %s\n", loaded, fileName);
+    return true;
+}
+
+// Master of the type for the frame's readout speed, cooler state and subframe. With anyExposure
+// the closest exposure is taken when none matches
+const struct Master* Calibration::Find(MasterType type, const struct CaptureInfo& capture, int width, int height, bool anyExposure)
+{
+    const struct Master* best = NULL;
+    for (size_t i=0; i<masters.size(); i++)
+    {
+        const struct Master* master = &masters[i];
+        if (master->key.type != type || master->width != width || master->height != height ||
+            master->key.readoutSpeed != capture.readoutSpeed || master->key.coolerOn != capture.coolerOn ||
+            !SameSubframe(master->key, capture.subframe))
+            continue;
+        if (master->key.exposureMs == capture.exposureMs)
+            return master;
+        if (anyExposure && (best == NULL ||
+            abs(master->key.exposureMs - capture.exposureMs) < abs(best->key.exposureMs - capture.exposureMs)))
+            best = master;
+    }
+    return best;
+}
+
+void Calibration::Prepare(const struct CaptureInfo& capture, int width, int height)
+{
+    prepared = true;
+    preparedFor = capture;
+    preparedWidth = width;
+    preparedHeight = height;
+    steps = 0;
+    dark.clear();
+    gain.clear();
+
+    size_t pixels = (size_t)width * height;
+    const struct Master* bias = this->Find(MASTER_BIAS, capture, width, height, true);
+    const struct Master* exact = this->Find(MASTER_DARK, capture, width, height, false);
+    const struct Master* nearest = this->Find(MASTER_DARK, capture, width, height, true);
+    if (exact != NULL)
+    {
+        dark = exact->pixels;
+        steps = CALIBRATED_BIAS | CALIBRATED_DARK;
+    }
+    else if (nearest != NULL && bias != NULL && nearest->key.exposureMs > 0)
+    {
+        // Dark current grows with time, the bias does not
+        float scale = (float)capture.exposureMs / nearest->key.exposureMs;
+        dark.resize(pixels);
+        for (size_t i=0; i<pixels; i++)
+            dark[i] = Round16(bias->pixels[i] + ((float)nearest->pixels[i] - bias->pixels[i]) * scale);
+        steps = CALIBRATED_BIAS | CALIBRATED_DARK;
+        DEBUG("Scaled the %d ms dark to %d ms\n", nearest->key.exposureMs, capture.exposureMs);
+    }
+    else if (bias != NULL)
+    {
+        dark = bias->pixels;
+        steps = CALIBRATED_BIAS;
+    }
+
+    const struct Master* flat = this->Find(MASTER_FLAT, capture, width, height, true);
+    if (flat == NULL)
+        return;
+
+    // Normalise the flat after taking out its own offset, its dark if there is one, the bias otherwise
+    struct CaptureInfo flatCapture = capture;
+    flatCapture.exposureMs = flat->key.exposureMs;
+    const struct Master* offset = this->Find(MASTER_DARK, flatCapture, width, height, false);
+    if (offset == NULL)
+        offset = bias;
+
+    gain.resize(pixels);
+    double sum = 0.0;
+    for (size_t i=0; i<pixels; i++)
+    {
+        float level = (float)flat->pixels[i] - (offset ? offset->pixels[i] : CALIBRATION_PEDESTAL);
+        gain[i] = level;
+        sum += std::max(level, 0.0f);
+    }
+    float mean = sum / pixels;
+    for (size_t i=0; i<pixels; i++)
+        gain[i] = (gain[i] >= 1.0f) ? mean / gain[i] : 1.0f; // Dead pixels are left alone
+
+    if (dark.empty())
+        dark.assign(pixels, CALIBRATION_PEDESTAL);
+    steps |= CALIBRATED_FLAT;
+}
+
+void Calibration::ApplyRows(uint16_t* pixels, int first, int last)
+{
+    int from = first * preparedWidth;
+    int to = last * preparedWidth;
+    if (gain.empty())
+    {
+        switch (kernel)
+        {
+#ifdef HAVE_SSE2
+            case DECODE_SSE2: SubtractSSE2(pixels, &dark[0], from, to); break;
+#endif
+#ifdef HAVE_NEON
+            case DECODE_NEON: SubtractNEON(pixels, &dark[0], from, to); break;
+#endif
+            default: SubtractScalar(pixels, &dark[0], from, to); break;
+        }
+        return;
+    }
+
+    switch (kernel)
+    {
+#ifdef HAVE_SSE2
+        case DECODE_SSE2: FlattenRowSSE2(pixels, &dark[0], &gain[0], from, to); break;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON: FlattenRowNEON(pixels, &dark[0], &gain[0], from, to); break;
+#endif
+        default: FlattenScalar(pixels, &dark[0], &gain[0], from, to); break;
+    }
+}
+
+unsigned int Calibration::Apply(struct rawImage* image)
+{
+    if (image->pixels == NULL || image->calibrated != 0)
+        return image->calibrated;
+
+    std::lock_guard<std::mutex> guard(lock);
+    const struct CaptureInfo& capture = image->capture;
+    if (!prepared || preparedWidth != (int)image->width || preparedHeight != (int)image->height ||
+        preparedFor.exposureMs != capture.exposureMs || preparedFor.readoutSpeed != capture.readoutSpeed ||
+        preparedFor.coolerOn != capture.coolerOn || Binning(preparedFor.subframe) != Binning(capture.subframe) ||
+        preparedFor.subframe.x != capture.subframe.x || preparedFor.subframe.y != capture.subframe.y)
+        this->Prepare(capture, image->width, image->height);
+    if (steps == 0)
+        return 0;
+
+    uint16_t* pixels = image->pixels;
+    int bands = (preparedHeight + BAND_ROWS - 1) / BAND_ROWS;
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->ApplyRows(pixels, first, std::min(first + BAND_ROWS, preparedHeight));
+    });
+
+    image->calibrated = steps;
+    return steps;
+}
@@ -0,0 +1,137 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_CALIBRATION_H__
+#define __OPEN_SSPRO_CALIBRATION_H__
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "framepool.h"
+#include "rawdecoder.h"
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    enum MasterType
+    {
+        MASTER_BIAS = 0,
+        MASTER_DARK = 1,
+        MASTER_FLAT = 2
+    };
+
+    enum CombineMethod
+    {
+        COMBINE_MEAN = 0,
+        COMBINE_SIGMA_CLIP = 1, // Running mean that skips samples too far from it, removes cosmic rays and hot spots
+        COMBINE_MEDIAN = 2      // Streaming estimate, seeded with the median of the first three frames
+    };
+
+    // Settings a master is valid for, taken from the frames' CaptureInfo
+    struct MasterKey {
+        MasterType type;
+        int exposureMs;
+        int readoutSpeed; // ReadOutSpeed
+        bool coolerOn;
+        int binning;      // 1 or 2, from CaptureInfo.subframe
+        int x;            // Subframe origin, binned pixels of the effective image
+        int y;
+    };
+
+    // Combined frame, same pedestal and layout as the decoded frames it was built from
+    struct Master {
+        struct MasterKey key;
+        int width;
+        int height;
+        int frames;
+        std::vector<uint16_t> pixels;
+    };
+
+    // Combines a sequence of frames into a master one frame at a time. Only a few float planes are
+    // kept per pixel, never the frames themselves, so any number of frames fits in memory.
+    class MasterBuilder
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        CombineMethod method;
+        CombineMethod combining; // method at the first frame
+        float clipSigma;
+        DecodeKernel kernel;
+        struct MasterKey key;
+        int width;
+        int height;
+        int frames;
+        std::vector<float> estimate; // Mean or median so far
+        std::vector<float> spread;   // Sum of squared differences for the mean, mean absolute deviation for the median
+        std::vector<float> count;    // Samples kept per pixel, for sigma clipping
+        float noiseFloor;            // Smallest variance clipping assumes, measured from the first two frames
+
+        void MeasureNoise();
+        void AddRows(const uint16_t* pixels, int first, int last);
+
+    public:
+        MasterBuilder(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~MasterBuilder();
+
+        void SetMethod(CombineMethod method); // COMBINE_SIGMA_CLIP by default, applies from the next Begin
+        void SetClipSigma(float sigma);       // Rejection threshold in standard deviations, 3 by default
+        bool SetKernel(DecodeKernel kernel);  // False if the build lacks it
+        DecodeKernel GetKernel();
+
+        void Begin(MasterType type);
+        bool Add(const struct rawImage* image); // False if the frame is not decoded or its size or settings differ
+        bool Add(const uint16_t* pixels, int width, int height); // Settings not checked, for frames that were warped or combined
+        int GetFrameCount();
+        bool Finish(struct Master* master);     // False before the first frame
+    };
+
+    // Set of masters applied to decoded frames. The dark and flat for a frame are chosen by its
+    // exposure time, readout speed, cooler state and subframe, and prepared once for each new combination.
+    class Calibration
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        DecodeKernel kernel;
+        std::vector<struct Master> masters;
+        std::mutex lock; // Guards everything, Apply runs on the camera's I/O thread
+
+        // Planes for the last combination of settings
+        bool prepared;
+        struct CaptureInfo preparedFor;
+        int preparedWidth;
+        int preparedHeight;
+        unsigned int steps;        // CalibrationStep bits the planes give
+        std::vector<uint16_t> dark; // Subtracted, pedestal included
+        std::vector<float> gain;    // Multiplied after subtracting, empty without a flat
+
+        const struct Master* Find(MasterType type, const struct CaptureInfo& capture, int width, int height, bool anyExposure);
+        void Prepare(const struct CaptureInfo& capture, int width, int height);
+        void ApplyRows(uint16_t* pixels, int first, int last);
+
+    public:
+        Calibration(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~Calibration();
+
+        bool SetKernel(DecodeKernel kernel); // False if the build lacks it
+        DecodeKernel GetKernel();
+
+        void AddMaster(const struct Master& master); // Replaces one with the same key and size
+        void Clear();
+        int GetMasterCount();
+        bool Save(const char* fileName); // Every master in one frame archive
+        bool Load(const char* fileName); // Adds the masters in an archive written by Save
+
+        // Subtracts the matching dark, or a bias scaled dark, then divides by the flat. Sets and
+        // returns image->calibrated, 0 when there is no master for the frame's settings
+        unsigned int Apply(struct rawImage* image);
+    };
+}
+
+#endif /* __OPEN_SSPRO_CALIBRATION_H__ */
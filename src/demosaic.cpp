@@ -0,0 +1,377 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  demosaic.cpp - Bayer to RGB interpolation, tiled across worker threads
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "demosaic.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    #include <emmintrin.h>
+    #define HAVE_SSE2
+#endif
+
+#if defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define HAVE_NEON
+#endif
+
+#define BAND_ROWS 32 // Rows per task, small enough to balance the threads and keep the rows in cache
+
+using namespace OpenSSPRO;
+
+// Reflects around the edges, which keeps the colour of the pixel the same
+static inline int Mirror(int i, int n)
+{
+    return (i < 0) ? -i : (i >= n) ? 2 * (n - 1) - i : i;
+}
+
+static inline int Clamp(int value)
+{
+    return (value < 0) ? 0 : (value > 0xFFFF) ? 0xFFFF : value;
+}
+
+// Rounds up like the vector averaging instructions
+static inline uint16_t Avg(uint16_t a, uint16_t b)
+{
+    return (a + b + 1) >> 1;
+}
+
+// One row of bilinear interpolation for columns from..to-1. site is the column parity of the row's
+// red or blue pixels, their colour goes to x and the other one to y
+static void BilinearScalar(const uint16_t* up, const uint16_t* row, const uint16_t* down, int width, int site,
+                           int from, int to, uint16_t* x, uint16_t* g, uint16_t* y)
+{
+    for (int i=from; i<to; i++)
+    {
+        int w = Mirror(i - 1, width);
+        int e = Mirror(i + 1, width);
+        uint16_t h = Avg(row[w], row[e]);
+        uint16_t v = Avg(up[i], down[i]);
+        if ((i & 1) == site)
+        {
+            x[i] = row[i];
+            g[i] = Avg(h, v);
+            y[i] = Avg(Avg(up[w], up[e]), Avg(down[w], down[e]));
+        }
+        else
+        {
+            x[i] = h;
+            g[i] = row[i];
+            y[i] = v;
+        }
+    }
+}
+
+#ifdef HAVE_SSE2
+static void BilinearSSE2(const uint16_t* up, const uint16_t* row, const uint16_t* down, int width, int site,
+                         uint16_t* x, uint16_t* g, uint16_t* y)
+{
+    // Starting on an even column keeps the site lanes fixed
+    const __m128i even = _mm_set_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+    const __m128i mask = site ? _mm_xor_si128(even, _mm_set1_epi16(-1)) : even;
+    int i = 2;
+    for (; i + 9 <= width; i += 8)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(row + i));
+        __m128i h = _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(row + i - 1)),
+                                  _mm_loadu_si128((const __m128i*)(row + i + 1)));
+        __m128i v = _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + i)),
+                                  _mm_loadu_si128((const __m128i*)(down + i)));
+        __m128i d = _mm_avg_epu16(_mm_avg_epu16(_mm_loadu_si128((const __m128i*)(up + i - 1)),
+                                                _mm_loadu_si128((const __m128i*)(up + i + 1))),
+                                  _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(down + i - 1)),
+                                                _mm_loadu_si128((const __m128i*)(down + i + 1))));
+        __m128i cross = _mm_avg_epu16(h, v);
+        _mm_storeu_si128((__m128i*)(x + i), _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, h)));
+        _mm_storeu_si128((__m128i*)(g + i), _mm_or_si128(_mm_and_si128(mask, cross), _mm_andnot_si128(mask, c)));
+        _mm_storeu_si128((__m128i*)(y + i), _mm_or_si128(_mm_and_si128(mask, d), _mm_andnot_si128(mask, v)));
+    }
+    BilinearScalar(up, row, down, width, site, 0, 2, x, g, y);
+    BilinearScalar(up, row, down, width, site, i, width, x, g, y);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void BilinearNEON(const uint16_t* up, const uint16_t* row, const uint16_t* down, int width, int site,
+                         uint16_t* x, uint16_t* g, uint16_t* y)
+{
+    const uint16_t lanes[8] = { 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0 };
+    uint16x8_t mask = vld1q_u16(lanes);
+    if (site)
+        mask = vmvnq_u16(mask);
+    int i = 2;
+    for (; i + 9 <= width; i += 8)
+    {
+        uint16x8_t c = vld1q_u16(row + i);
+        uint16x8_t h = vrhaddq_u16(vld1q_u16(row + i - 1), vld1q_u16(row + i + 1));
+        uint16x8_t v = vrhaddq_u16(vld1q_u16(up + i), vld1q_u16(down + i));
+        uint16x8_t d = vrhaddq_u16(vrhaddq_u16(vld1q_u16(up + i - 1), vld1q_u16(up + i + 1)),
+                                   vrhaddq_u16(vld1q_u16(down + i - 1), vld1q_u16(down + i + 1)));
+        vst1q_u16(x + i, vbslq_u16(mask, c, h));
+        vst1q_u16(g + i, vbslq_u16(mask, vrhaddq_u16(h, v), c));
+        vst1q_u16(y + i, vbslq_u16(mask, d, v));
+    }
+    BilinearScalar(up, row, down, width, site, 0, 2, x, g, y);
+    BilinearScalar(up, row, down, width, site, i, width, x, g, y);
+}
+#endif
+
+// Green at a red or blue pixel, interpolated along the direction with the smaller gradient
+// and corrected by the second derivative of the pixel's own colour
+static inline uint16_t EdgeGreen(const uint16_t* up2, const uint16_t* up, const uint16_t* row, const uint16_t* down,
+                                 const uint16_t* down2, int i, int w, int e, int ww, int ee)
+{
+    int centre = row[i] * 2;
+    int laplaceH = centre - row[ww] - row[ee];
+    int laplaceV = centre - up2[i] - down2[i];
+    int gradientH = abs(row[w] - row[e]) + abs(laplaceH);
+    int gradientV = abs(up[i] - down[i]) + abs(laplaceV);
+    int greenH = 2 * (row[w] + row[e]) + laplaceH; // Four times the estimate
+    int greenV = 2 * (up[i] + down[i]) + laplaceV;
+
+    int green;
+    if (gradientH < gradientV)
+        green = greenH;
+    else if (gradientV < gradientH)
+        green = greenV;
+    else
+        green = (greenH + greenV) >> 1;
+    return Clamp((green + 2) >> 2);
+}
+
+Demosaic::Demosaic(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    mode = DEMOSAIC_BILINEAR;
+    pattern = BAYER_GBRG;
+    layout = RGB_INTERLEAVED;
+#if defined(HAVE_SSE2)
+    kernel = DECODE_SSE2;
+#elif defined(HAVE_NEON)
+    kernel = DECODE_NEON;
+#else
+    kernel = DECODE_SCALAR;
+#endif
+}
+
+Demosaic::~Demosaic()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+void Demosaic::SetMode(DemosaicMode mode)
+{
+    this->mode = mode;
+}
+
+void Demosaic::SetPattern(BayerPattern pattern)
+{
+    this->pattern = pattern;
+}
+
+void Demosaic::SetLayout(RgbLayout layout)
+{
+    this->layout = layout;
+}
+
+bool Demosaic::SetKernel(DecodeKernel kernel)
+{
+    switch (kernel)
+    {
+        case DECODE_SCALAR:
+            break;
+#ifdef HAVE_SSE2
+        case DECODE_SSE2:
+            break;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON:
+            break;
+#endif
+        default:
+            return false;
+    }
+
+    this->kernel = kernel;
+    return true;
+}
+
+DecodeKernel Demosaic::GetKernel()
+{
+    return kernel;
+}
+
+int Demosaic::SiteParity(int y, bool* redRow)
+{
+    // Column and row of red in the 2x2 cell, blue is diagonal to it
+    static const int redColumn[4] = { 0, 1, 0, 1 };
+    static const int redRowParity[4] = { 1, 0, 0, 1 };
+
+    *redRow = ((y & 1) == redRowParity[pattern]);
+    return *redRow ? redColumn[pattern] : 1 - redColumn[pattern];
+}
+
+void Demosaic::Store(const uint16_t* red, const uint16_t* green, const uint16_t* blue, int width, int height, int y, uint16_t* rgb)
+{
+    if (layout == RGB_PLANAR)
+    {
+        size_t plane = (size_t)width * height;
+        memcpy(rgb + (size_t)y * width, red, width * sizeof(uint16_t));
+        memcpy(rgb + plane + (size_t)y * width, green, width * sizeof(uint16_t));
+        memcpy(rgb + 2 * plane + (size_t)y * width, blue, width * sizeof(uint16_t));
+        return;
+    }
+
+    uint16_t* out = rgb + (size_t)y * width * 3;
+    for (int i=0; i<width; i++)
+    {
+        out[i*3] = red[i];
+        out[i*3 + 1] = green[i];
+        out[i*3 + 2] = blue[i];
+    }
+}
+
+void Demosaic::BilinearBand(const uint16_t* raw, int width, int height, int first, int last, uint16_t* rgb)
+{
+    std::vector<uint16_t> scratch(width * 3);
+    uint16_t* x = &scratch[0];
+    uint16_t* g = x + width;
+    uint16_t* y = g + width;
+
+    for (int row=first; row<last; row++)
+    {
+        const uint16_t* up = raw + (size_t)Mirror(row - 1, height) * width;
+        const uint16_t* centre = raw + (size_t)row * width;
+        const uint16_t* down = raw + (size_t)Mirror(row + 1, height) * width;
+        bool redRow;
+        int site = this->SiteParity(row, &redRow);
+
+        switch (kernel)
+        {
+#ifdef HAVE_SSE2
+            case DECODE_SSE2: BilinearSSE2(up, centre, down, width, site, x, g, y); break;
+#endif
+#ifdef HAVE_NEON
+            case DECODE_NEON: BilinearNEON(up, centre, down, width, site, x, g, y); break;
+#endif
+            default: BilinearScalar(up, centre, down, width, site, 0, width, x, g, y); break;
+        }
+
+        if (redRow)
+            this->Store(x, g, y, width, height, row, rgb);
+        else
+            this->Store(y, g, x, width, height, row, rgb);
+    }
+}
+
+void Demosaic::GreenBand(const uint16_t* raw, int width, int height, int first, int last)
+{
+    for (int row=first; row<last; row++)
+    {
+        const uint16_t* up2 = raw + (size_t)Mirror(row - 2, height) * width;
+        const uint16_t* up = raw + (size_t)Mirror(row - 1, height) * width;
+        const uint16_t* centre = raw + (size_t)row * width;
+        const uint16_t* down = raw + (size_t)Mirror(row + 1, height) * width;
+        const uint16_t* down2 = raw + (size_t)Mirror(row + 2, height) * width;
+        uint16_t* out = &green[(size_t)row * width];
+        bool redRow;
+        int site = this->SiteParity(row, &redRow);
+
+        // Green pixels are copied, the rest interpolated. Only the two columns at each edge need mirroring
+        for (int i=0; i<width; i++)
+        {
+            if ((i & 1) != site)
+                out[i] = centre[i];
+            else if (i >= 2 && i < width - 2)
+                out[i] = EdgeGreen(up2, up, centre, down, down2, i, i - 1, i + 1, i - 2, i + 2);
+            else
+                out[i] = EdgeGreen(up2, up, centre, down, down2, i, Mirror(i - 1, width), Mirror(i + 1, width),
+                                   Mirror(i - 2, width), Mirror(i + 2, width));
+        }
+    }
+}
+
+void Demosaic::ColourBand(const uint16_t* raw, int width, int height, int first, int last, uint16_t* rgb)
+{
+    std::vector<uint16_t> scratch(width * 2);
+    uint16_t* x = &scratch[0];
+    uint16_t* y = x + width;
+
+    for (int row=first; row<last; row++)
+    {
+        int above = Mirror(row - 1, height);
+        int below = Mirror(row + 1, height);
+        const uint16_t* up = raw + (size_t)above * width;
+        const uint16_t* centre = raw + (size_t)row * width;
+        const uint16_t* down = raw + (size_t)below * width;
+        const uint16_t* greenUp = &green[(size_t)above * width];
+        const uint16_t* greenRow = &green[(size_t)row * width];
+        const uint16_t* greenDown = &green[(size_t)below * width];
+        bool redRow;
+        int site = this->SiteParity(row, &redRow);
+
+        // Red and blue follow green, the colour differences are smooth even across edges
+        for (int i=0; i<width; i++)
+        {
+            int w = Mirror(i - 1, width);
+            int e = Mirror(i + 1, width);
+            if ((i & 1) == site)
+            {
+                int diagonal = (up[w] - greenUp[w]) + (up[e] - greenUp[e]) +
+                               (down[w] - greenDown[w]) + (down[e] - greenDown[e]);
+                x[i] = centre[i];
+                y[i] = Clamp(greenRow[i] + ((diagonal + 2) >> 2));
+            }
+            else
+            {
+                int horizontal = (centre[w] - greenRow[w]) + (centre[e] - greenRow[e]);
+                int vertical = (up[i] - greenUp[i]) + (down[i] - greenDown[i]);
+                x[i] = Clamp(greenRow[i] + ((horizontal + 1) >> 1));
+                y[i] = Clamp(greenRow[i] + ((vertical + 1) >> 1));
+            }
+        }
+
+        if (redRow)
+            this->Store(x, greenRow, y, width, height, row, rgb);
+        else
+            this->Store(y, greenRow, x, width, height, row, rgb);
+    }
+}
+
+bool Demosaic::Process(const uint16_t* raw, int width, int height, uint16_t* rgb)
+{
+    if (raw == NULL || rgb == NULL || width < 4 || height < 4)
+        return false;
+
+    int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+    if (mode == DEMOSAIC_BILINEAR)
+    {
+        pool->Run(bands, [&](int band) {
+            int first = band * BAND_ROWS;
+            this->BilinearBand(raw, width, height, first, std::min(first + BAND_ROWS, height), rgb);
+        });
+        return true;
+    }
+
+    // Red and blue need the green of the rows around them, so green is finished for the whole frame first
+    green.resize((size_t)width * height);
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->GreenBand(raw, width, height, first, std::min(first + BAND_ROWS, height));
+    });
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->ColourBand(raw, width, height, first, std::min(first + BAND_ROWS, height), rgb);
+    });
+    return true;
+}
@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_DEMOSAIC_H__
+#define __OPEN_SSPRO_DEMOSAIC_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "rawdecoder.h"
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    // Colours of the top left 2x2 cell, named row by row
+    enum BayerPattern
+    {
+        BAYER_GBRG = 0, // Gb B / R Gr, the sensor pattern in the README
+        BAYER_GRBG = 1,
+        BAYER_RGGB = 2,
+        BAYER_BGGR = 3
+    };
+
+    enum DemosaicMode
+    {
+        DEMOSAIC_BILINEAR = 0, // Average of the nearest samples, fast enough for live preview
+        DEMOSAIC_EDGE = 1      // Hamilton-Adams, green along the smoother direction, red and blue from colour differences
+    };
+
+    enum RgbLayout
+    {
+        RGB_INTERLEAVED = 0, // R G B R G B ...
+        RGB_PLANAR = 1       // All red, then all green, then all blue
+    };
+
+    // Turns a decoded mono frame into 16 bit RGB, split into bands of rows across a thread pool
+    class Demosaic
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        DemosaicMode mode;
+        BayerPattern pattern;
+        RgbLayout layout;
+        DecodeKernel kernel;
+        std::vector<uint16_t> green; // Full green plane for DEMOSAIC_EDGE
+
+        int SiteParity(int y, bool* redRow); // Column of the row's red or blue pixels
+        void BilinearBand(const uint16_t* raw, int width, int height, int first, int last, uint16_t* rgb);
+        void GreenBand(const uint16_t* raw, int width, int height, int first, int last);
+        void ColourBand(const uint16_t* raw, int width, int height, int first, int last, uint16_t* rgb);
+        void Store(const uint16_t* red, const uint16_t* green, const uint16_t* blue, int width, int height, int y, uint16_t* rgb);
+
+    public:
+        Demosaic(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~Demosaic();
+
+        void SetMode(DemosaicMode mode);
+        void SetPattern(BayerPattern pattern);
+        void SetLayout(RgbLayout layout);
+        bool SetKernel(DecodeKernel kernel); // Vector kernel for the bilinear rows, false if the build lacks it
+        DecodeKernel GetKernel();
+
+        // rgb holds width * height * 3 values. False for frames under 4x4
+        bool Process(const uint16_t* raw, int width, int height, uint16_t* rgb);
+    };
+}
+
+#endif /* __OPEN_SSPRO_DEMOSAIC_H__ */
@@ -0,0 +1,599 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  fitswriter.cpp - Streams decoded frames to FITS files without cfitsio
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "opensspro.h"
+#include "fitswriter.h"
+
+#define FITS_BLOCK_SIZE   2880          // Header and data units are padded to this
+#define FITS_CARD_SIZE    80
+#define FITS_BUFFER_SIZE  (1024 * 1024) // Staging buffer, a multiple of DIRECT_IO_ALIGN
+#define DIRECT_IO_ALIGN   4096          // O_DIRECT wants the buffer, offset and length on this boundary
+#define CAMERA_NAME       "Orion StarShoot Pro V2.0"
+#define RICE_BLOCK_SIZE   32            // Pixels per Rice block, what cfitsio and fpack use
+#define RICE_FS_BITS      4
+#define RICE_FS_MAX       14
+#define RICE_BBITS        16
+#define COMPRESS_BAND     16            // Rows per thread pool task
+
+using namespace OpenSSPRO;
+
+// FITS stores signed 16 bit big endian, BZERO 32768 maps it back to unsigned
+static void ToFitsOrder(const uint16_t* src, unsigned char* dst, size_t pixels)
+{
+    for (size_t i=0; i<pixels; i++)
+    {
+        uint16_t value = src[i] ^ 0x8000;
+        dst[i*2] = value >> 8;
+        dst[i*2 + 1] = value & 0xFF;
+    }
+}
+
+// Big endian bit packer for the Rice coder
+struct BitWriter {
+    unsigned char* out;
+    size_t pos;
+    uint64_t bits;
+    int count;
+
+    BitWriter(unsigned char* out) : out(out), pos(0), bits(0), count(0) {}
+
+    inline void Put(uint32_t value, int n)
+    {
+        bits = (bits << n) | (value & ((1u << n) - 1));
+        count += n;
+        while (count >= 8)
+        {
+            count -= 8;
+            out[pos++] = (unsigned char)(bits >> count);
+        }
+    }
+
+    inline void Zeros(uint32_t n)
+    {
+        for (; n > 16; n -= 16)
+            this->Put(0, 16);
+        this->Put(0, n);
+    }
+
+    size_t Finish()
+    {
+        if (count > 0)
+            out[pos++] = (unsigned char)(bits << (8 - count));
+        count = 0;
+        return pos;
+    }
+};
+
+// Worst case Rice output, every block falls back to raw 16 bit differences
+static size_t RiceBound(int pixels)
+{
+    int blocks = (pixels + RICE_BLOCK_SIZE - 1) / RICE_BLOCK_SIZE;
+    return 2 + ((size_t)blocks * (RICE_FS_BITS + RICE_BLOCK_SIZE * RICE_BBITS) + 7) / 8 + 1;
+}
+
+// RICE_1 as in cfitsio's fits_rcomp_short, so funpack and every FITS reader can open the tiles.
+// Pixels are offset to signed by BZERO first. Returns the bytes written to out
+static size_t RiceCompress(const uint16_t* pixels, int count, unsigned char* out)
+{
+    BitWriter writer(out);
+    int16_t last = (int16_t)(pixels[0] ^ 0x8000);
+    writer.Put((uint16_t)last, RICE_BBITS);
+
+    uint32_t diff[RICE_BLOCK_SIZE];
+    for (int i=0; i<count; i+=RICE_BLOCK_SIZE)
+    {
+        int block = (count - i < RICE_BLOCK_SIZE) ? count - i : RICE_BLOCK_SIZE;
+        double sum = 0.0;
+        for (int j=0; j<block; j++)
+        {
+            int16_t next = (int16_t)(pixels[i + j] ^ 0x8000);
+            int16_t delta = (int16_t)(next - last); // Wraps like the reference coder
+            diff[j] = (delta < 0) ? ~(delta << 1) : (delta << 1);
+            diff[j] &= 0xFFFF;
+            sum += diff[j];
+            last = next;
+        }
+
+        // Split point from the mean difference
+        double mean = (sum - (block / 2) - 1) / block;
+        if (mean < 0.0)
+            mean = 0.0;
+        unsigned int split = ((unsigned short)mean) >> 1;
+        int fs = 0;
+        for (; split > 0; fs++)
+            split >>= 1;
+
+        if (fs >= RICE_FS_MAX)
+        {
+            writer.Put(RICE_FS_MAX + 1, RICE_FS_BITS); // Noise, differences go out raw
+            for (int j=0; j<block; j++)
+                writer.Put(diff[j], RICE_BBITS);
+        }
+        else if (fs == 0 && sum == 0.0)
+            writer.Put(0, RICE_FS_BITS); // Flat block
+        else
+        {
+            writer.Put(fs + 1, RICE_FS_BITS);
+            uint32_t mask = (1u << fs) - 1;
+            for (int j=0; j<block; j++)
+            {
+                writer.Zeros(diff[j] >> fs); // Unary high part, then the low fs bits
+                writer.Put(1, 1);
+                if (fs > 0)
+                    writer.Put(diff[j] & mask, fs);
+            }
+        }
+    }
+
+    return writer.Finish();
+}
+
+static void PutBigEndian32(unsigned char* out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static std::string Card(const char* name, const char* value, const char* comment)
+{
+    char card[FITS_CARD_SIZE + 1];
+    int length;
+    if (comment != NULL && comment[0] != '\0')
+        length = snprintf(card, sizeof(card), "%-8.8s= %s / %s", name, value, comment);
+    else
+        length = snprintf(card, sizeof(card), "%-8.8s= %s", name, value);
+    if (length < 0)
+        length = 0;
+
+    std::string result(card, (length > FITS_CARD_SIZE) ? FITS_CARD_SIZE : length);
+    result.resize(FITS_CARD_SIZE, ' ');
+    for (int i=0; i<8; i++)
+        result[i] = toupper(result[i]);
+    return result;
+}
+
+FitsWriter::FitsWriter()
+{
+    file = -1;
+    directIO = false;
+    usingDirectIO = false;
+    compression = FITS_UNCOMPRESSED;
+    compressing = false;
+    pool = NULL;
+    failed = false;
+    width = 0;
+    height = 0;
+    rowsWritten = 0;
+    buffer = NULL;
+    bufferUsed = 0;
+    fileSize = 0;
+}
+
+FitsWriter::~FitsWriter()
+{
+    if (file >= 0)
+        this->Close();
+    free(buffer);
+}
+
+void FitsWriter::SetDirectIO(bool direct)
+{
+    directIO = direct;
+}
+
+void FitsWriter::SetCompression(FitsCompression compression)
+{
+    this->compression = compression;
+}
+
+void FitsWriter::SetThreadPool(ThreadPool* pool)
+{
+    this->pool = pool;
+}
+
+void FitsWriter::AddCard(const char* name, const char* value, const char* comment)
+{
+    cards.push_back(Card(name, value, comment));
+}
+
+void FitsWriter::AddKey(const char* name, const char* value, const char* comment)
+{
+    // Quotes inside a string are doubled, the closing quote is at column 20 or later
+    std::string quoted = "'";
+    for (const char* c=value; *c != '\0'; c++)
+    {
+        quoted += *c;
+        if (*c == '\'')
+            quoted += '\'';
+    }
+    while (quoted.size() < 9)
+        quoted += ' ';
+    quoted += '\'';
+    this->AddCard(name, quoted.c_str(), comment);
+}
+
+void FitsWriter::AddKey(const char* name, long value, const char* comment)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%20ld", value);
+    this->AddCard(name, text, comment);
+}
+
+void FitsWriter::AddKey(const char* name, double value, const char* comment)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.10G", value);
+    if (strpbrk(number, ".EN") == NULL) // Keep it a real for readers that look at the format
+        strcat(number, ".");
+    char text[32];
+    snprintf(text, sizeof(text), "%20s", number);
+    this->AddCard(name, text, comment);
+}
+
+void FitsWriter::AddKey(const char* name, bool value, const char* comment)
+{
+    this->AddCard(name, value ? "                   T" : "                   F", comment);
+}
+
+void FitsWriter::AddCaptureKeys(const struct CaptureInfo& capture)
+{
+    char date[32];
+    struct tm utc;
+    gmtime_r(&capture.exposureStart.tv_sec, &utc);
+    size_t length = strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(date + length, sizeof(date) - length, ".%03ld", capture.exposureStart.tv_nsec / 1000000);
+
+    char written[32];
+    time_t now = time(NULL);
+    gmtime_r(&now, &utc);
+    strftime(written, sizeof(written), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    this->AddKey("INSTRUME", CAMERA_NAME, "Camera");
+    this->AddKey("DATE-OBS", date, "UTC start of the exposure");
+    this->AddKey("DATE", written, "UTC time the file was written");
+    this->AddKey("EXPTIME", capture.exposureMs / 1000.0, "Exposure time in seconds");
+    this->AddKey("EXPOSURE", capture.exposureMs / 1000.0, "Exposure time in seconds");
+    this->AddKey("READOUT", (long)capture.readoutSpeed, "Readout speed, 0 fastest to 7 slowest");
+    this->AddKey("COOLER", capture.coolerOn, "TE cooler on");
+    this->AddKey("FANHIGH", capture.fanHigh, "Fan on high");
+}
+
+void FitsWriter::ClearKeys()
+{
+    cards.clear();
+}
+
+bool FitsWriter::Open(const char* fileName, int width, int height)
+{
+    if (file >= 0)
+        this->Close();
+
+    if (buffer == NULL && posix_memalign((void**)&buffer, DIRECT_IO_ALIGN, FITS_BUFFER_SIZE) != 0)
+    {
+        buffer = NULL;
+        ERROR("Failed to allocate the FITS write buffer\n");
+        return false;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    usingDirectIO = false;
+#ifdef O_DIRECT
+    if (directIO)
+    {
+        file = open(fileName, flags | O_DIRECT, 0644);
+        usingDirectIO = (file >= 0);
+    }
+#endif
+    if (file < 0)
+        file = open(fileName, flags, 0644); // Not asked for, or the filesystem (e.g. tmpfs) refused it
+    if (file < 0)
+    {
+        ERROR("Failed to create %s: %s\n", fileName, strerror(errno));
+        return false;
+    }
+
+    this->width = width;
+    this->height = height;
+    rowsWritten = 0;
+    bufferUsed = 0;
+    fileSize = 0;
+    failed = false;
+
+    keyCards.clear();
+    for (size_t i=0; i<cards.size(); i++)
+        keyCards += cards[i];
+
+    compressing = (compression == FITS_RICE);
+    if (compressing)
+    {
+        // The table header needs the heap size, so everything is written by Close
+        tiles.resize(height);
+        tileSizes.assign(height, 0);
+        return true;
+    }
+
+    char number[32];
+    std::string header = Card("SIMPLE", "                   T", "Standard FITS");
+    header += Card("BITPIX", "                  16", "16 bit pixels");
+    header += Card("NAXIS", "                   2", NULL);
+    snprintf(number, sizeof(number), "%20d", width);
+    header += Card("NAXIS1", number, "Columns");
+    snprintf(number, sizeof(number), "%20d", height);
+    header += Card("NAXIS2", number, "Rows");
+    header += Card("BZERO", "               32768", "Unsigned pixels stored offset by 32768");
+    header += Card("BSCALE", "                   1", NULL);
+    header += keyCards;
+    header += std::string("END").append(FITS_CARD_SIZE - 3, ' ');
+    header.append((FITS_BLOCK_SIZE - header.size() % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE, ' ');
+
+    return this->Append(header.data(), header.size());
+}
+
+bool FitsWriter::Append(const void* data, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (length > 0)
+    {
+        size_t chunk = FITS_BUFFER_SIZE - bufferUsed;
+        if (chunk > length)
+            chunk = length;
+        memcpy(buffer + bufferUsed, bytes, chunk);
+        bufferUsed += chunk;
+        bytes += chunk;
+        length -= chunk;
+        if (bufferUsed == FITS_BUFFER_SIZE && !this->Flush(false))
+            return false;
+    }
+    return true;
+}
+
+bool FitsWriter::WriteRows(const uint16_t* pixels, int rows)
+{
+    if (file < 0 || failed)
+        return false;
+    if (rows > height - rowsWritten)
+        rows = height - rowsWritten;
+
+    if (compressing)
+    {
+        this->CompressRows(pixels, rowsWritten, rows);
+        rowsWritten += rows;
+        return true;
+    }
+
+    // Swapped straight into the staging buffer, a row may straddle two flushes
+    size_t remaining = (size_t)rows * width;
+    while (remaining > 0)
+    {
+        size_t count = (FITS_BUFFER_SIZE - bufferUsed) / 2;
+        if (count > remaining)
+            count = remaining;
+        ToFitsOrder(pixels, buffer + bufferUsed, count);
+        bufferUsed += count * 2;
+        pixels += count;
+        remaining -= count;
+        if (bufferUsed == FITS_BUFFER_SIZE && !this->Flush(false))
+            return false;
+    }
+
+    rowsWritten += rows;
+    return true;
+}
+
+void FitsWriter::CompressRows(const uint16_t* pixels, int first, int rows)
+{
+    // One tile per row, the same tiling fpack picks for images
+    size_t bound = RiceBound(width);
+    auto compress = [&](int band) {
+        int end = std::min((band + 1) * COMPRESS_BAND, rows);
+        for (int row=band * COMPRESS_BAND; row<end; row++)
+        {
+            std::vector<unsigned char>& tile = tiles[first + row];
+            if (tile.size() < bound)
+                tile.resize(bound);
+            tileSizes[first + row] = RiceCompress(pixels + (size_t)row * width, width, &tile[0]);
+        }
+    };
+
+    int bands = (rows + COMPRESS_BAND - 1) / COMPRESS_BAND;
+    if (pool != NULL)
+        pool->Run(bands, compress);
+    else
+        for (int band=0; band<bands; band++)
+            compress(band);
+}
+
+bool FitsWriter::CloseCompressed()
+{
+    // Empty primary HDU, then the image as a binary table of variable length tiles
+    std::string header = Card("SIMPLE", "                   T", "Standard FITS");
+    header += Card("BITPIX", "                  16", NULL);
+    header += Card("NAXIS", "                   0", NULL);
+    header += Card("EXTEND", "                   T", NULL);
+    header += std::string("END").append(FITS_CARD_SIZE - 3, ' ');
+    header.append((FITS_BLOCK_SIZE - header.size() % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE, ' ');
+
+    size_t heapSize = 0;
+    size_t largest = 0;
+    for (int i=0; i<height; i++)
+    {
+        heapSize += tileSizes[i];
+        largest = std::max(largest, (size_t)tileSizes[i]);
+    }
+
+    char number[32];
+    char text[64];
+    header += Card("XTENSION", "'BINTABLE'", "Binary table extension");
+    header += Card("BITPIX", "                   8", NULL);
+    header += Card("NAXIS", "                   2", NULL);
+    header += Card("NAXIS1", "                   8", "Bytes per tile descriptor");
+    snprintf(number, sizeof(number), "%20d", height);
+    header += Card("NAXIS2", number, "Tiles");
+    snprintf(number, sizeof(number), "%20lu", (unsigned long)heapSize);
+    header += Card("PCOUNT", number, "Heap size");
+    header += Card("GCOUNT", "                   1", NULL);
+    header += Card("TFIELDS", "                   1", NULL);
+    header += Card("TTYPE1", "'COMPRESSED_DATA'", NULL);
+    snprintf(text, sizeof(text), "'1PB(%lu)'", (unsigned long)largest);
+    header += Card("TFORM1", text, NULL);
+    header += Card("ZIMAGE", "                   T", "Tile compressed image");
+    header += Card("ZBITPIX", "                  16", NULL);
+    header += Card("ZNAXIS", "                   2", NULL);
+    snprintf(number, sizeof(number), "%20d", width);
+    header += Card("ZNAXIS1", number, "Columns");
+    snprintf(text, sizeof(text), "%20d", height);
+    header += Card("ZNAXIS2", text, "Rows");
+    header += Card("ZTILE1", number, "One row per tile");
+    header += Card("ZTILE2", "                   1", NULL);
+    header += Card("ZCMPTYPE", "'RICE_1  '", "Compression algorithm");
+    header += Card("ZNAME1", "'BLOCKSIZE'", NULL);
+    header += Card("ZVAL1", "                  32", NULL);
+    header += Card("ZNAME2", "'BYTEPIX '", NULL);
+    header += Card("ZVAL2", "                   2", NULL);
+    header += Card("BZERO", "               32768", "Unsigned pixels stored offset by 32768");
+    header += Card("BSCALE", "                   1", NULL);
+    header += keyCards;
+    header += std::string("END").append(FITS_CARD_SIZE - 3, ' ');
+    header.append((FITS_BLOCK_SIZE - header.size() % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE, ' ');
+    if (!this->Append(header.data(), header.size()))
+        return false;
+
+    // Descriptors are element count and heap offset, the heap follows the table directly
+    std::vector<unsigned char> table((size_t)height * 8);
+    size_t offset = 0;
+    for (int i=0; i<height; i++)
+    {
+        PutBigEndian32(&table[i * 8], tileSizes[i]);
+        PutBigEndian32(&table[i * 8 + 4], offset);
+        offset += tileSizes[i];
+    }
+    if (!this->Append(&table[0], table.size()))
+        return false;
+    for (int i=0; i<height; i++)
+        if (tileSizes[i] > 0 && !this->Append(&tiles[i][0], tileSizes[i]))
+            return false;
+
+    size_t dataSize = table.size() + heapSize;
+    std::vector<unsigned char> padding((FITS_BLOCK_SIZE - dataSize % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE, 0);
+    return padding.empty() || this->Append(&padding[0], padding.size());
+}
+
+bool FitsWriter::Flush(bool last)
+{
+    size_t length = bufferUsed;
+    if (last && usingDirectIO && length % DIRECT_IO_ALIGN != 0)
+    {
+        // O_DIRECT only writes whole blocks, the file is cut back to size afterwards
+        length += DIRECT_IO_ALIGN - length % DIRECT_IO_ALIGN;
+        memset(buffer + bufferUsed, 0, length - bufferUsed);
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t written = write(file, buffer + done, length - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            ERROR("Failed to write FITS data: %s\n", strerror(errno));
+            failed = true;
+            return false;
+        }
+        done += written;
+    }
+
+    bool padded = (length != bufferUsed);
+    fileSize += bufferUsed;
+    bufferUsed = 0;
+    if (padded && ftruncate(file, fileSize) != 0)
+    {
+        ERROR("Failed to trim FITS file: %s\n", strerror(errno));
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool FitsWriter::Close()
+{
+    if (file < 0)
+        return false;
+
+    // Rows that never arrived read back as 0
+    if (!failed && rowsWritten < height)
+    {
+        std::vector<uint16_t> zeros(width, 0);
+        while (rowsWritten < height && this->WriteRows(&zeros[0], 1))
+            ;
+    }
+
+    if (!failed && compressing)
+        this->CloseCompressed();
+    else if (!failed)
+    {
+        size_t dataSize = (size_t)width * height * 2;
+        std::vector<unsigned char> padding((FITS_BLOCK_SIZE - dataSize % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE, 0);
+        if (!padding.empty())
+            this->Append(&padding[0], padding.size());
+    }
+    if (!failed)
+        this->Flush(true);
+
+    if (close(file) != 0)
+        failed = true;
+    file = -1;
+    return !failed;
+}
+
+off_t FitsWriter::GetFileSize()
+{
+    return fileSize;
+}
+
+bool FitsWriter::Write(const char* fileName, const struct rawImage* image)
+{
+    if (image->pixels == NULL)
+    {
+        ERROR("Frame was not decoded, turn on SetDecodeOnDownload\n");
+        return false;
+    }
+
+    std::vector<std::string> keys = cards; // The caller's keys stay for the next frame
+    this->AddCaptureKeys(image->capture);
+    if (image->calibrated != 0)
+    {
+        char steps[4] = "";
+        if (image->calibrated & CALIBRATED_BIAS)
+            strcat(steps, "B");
+        if (image->calibrated & CALIBRATED_DARK)
+            strcat(steps, "D");
+        if (image->calibrated & CALIBRATED_FLAT)
+            strcat(steps, "F");
+        this->AddKey("CALSTAT", steps, "Calibration applied, Bias Dark Flat");
+    }
+    bool opened = this->Open(fileName, image->width, image->height);
+    cards = keys;
+    if (!opened)
+        return false;
+
+    this->WriteRows(image->pixels, image->height);
+    return this->Close();
+}
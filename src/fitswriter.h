@@ -0,0 +1,83 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_FITSWRITER_H__
+#define __OPEN_SSPRO_FITSWRITER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "framepool.h"
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    enum FitsCompression
+    {
+        FITS_UNCOMPRESSED = 0,
+        FITS_RICE = 1 // Lossless RICE_1 tile compression, one tile per row, readable by cfitsio/funpack
+    };
+
+    // Writes a 16 bit unsigned FITS image (BITPIX 16, BZERO 32768) straight from decoded rows.
+    // Rows are swapped to big endian through a small aligned buffer, the image is never copied whole.
+    // With FITS_RICE rows are compressed as they arrive and the file is written on Close.
+    class FitsWriter
+    {
+    private:
+        int file;
+        bool directIO;
+        bool usingDirectIO;
+        FitsCompression compression;
+        bool compressing; // compression was FITS_RICE at Open
+        ThreadPool* pool; // Compresses tiles in parallel when set
+        bool failed;
+        int width;
+        int height;
+        int rowsWritten;
+        std::vector<std::string> cards; // 80 character header cards added before Open
+        std::string keyCards;           // Cards as they were at Open
+        std::vector<std::vector<unsigned char> > tiles; // Compressed rows, kept until Close
+        std::vector<unsigned int> tileSizes;
+        unsigned char* buffer;
+        size_t bufferUsed;
+        off_t fileSize;
+
+        void AddCard(const char* name, const char* value, const char* comment);
+        bool Append(const void* data, size_t length);
+        bool Flush(bool last);
+        void CompressRows(const uint16_t* pixels, int first, int rows);
+        bool CloseCompressed();
+
+    public:
+        FitsWriter();
+        ~FitsWriter();
+
+        void SetDirectIO(bool direct); // O_DIRECT, bypasses the page cache. Falls back to buffered writes if refused
+        void SetCompression(FitsCompression compression); // Applies from the next Open
+        void SetThreadPool(ThreadPool* pool);            // Shared with the caller, NULL compresses on the calling thread
+
+        // Keys go in the header in the order added, call before Open. Names over 8 characters are cut
+        void AddKey(const char* name, const char* value, const char* comment);
+        void AddKey(const char* name, long value, const char* comment);
+        void AddKey(const char* name, double value, const char* comment);
+        void AddKey(const char* name, bool value, const char* comment);
+        void AddCaptureKeys(const struct CaptureInfo& capture); // EXPTIME, DATE-OBS, readout, cooler and fan
+        void ClearKeys();
+
+        bool Open(const char* fileName, int width, int height); // Replaces an existing file, writes the header
+        bool WriteRows(const uint16_t* pixels, int rows);      // Next rows in image order, top row first
+        bool Close(); // Pads the data unit and flushes, rows never written are zero. False if any write failed
+        off_t GetFileSize(); // Bytes written to the last file
+
+        // Header with the frame's capture keys, then every row of image->pixels
+        bool Write(const char* fileName, const struct rawImage* image);
+    };
+}
+
+#endif /* __OPEN_SSPRO_FITSWRITER_H__ */
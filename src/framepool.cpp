@@ -0,0 +1,279 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  framepool.cpp - Preallocated frame buffers with move-only ownership handles
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "opensspro.h"
+
+using namespace OpenSSPRO;
+
+// Held while a slot is handed from its pool to its last Frame, so the two can't both free it
+static std::mutex detachLock;
+
+Frame::Frame() : slot(NULL)
+{
+}
+
+Frame::Frame(FrameSlot* slot) : slot(slot)
+{
+}
+
+Frame::Frame(Frame&& other) : slot(other.slot)
+{
+    other.slot = NULL;
+}
+
+Frame& Frame::operator=(Frame&& other)
+{
+    if (this != &other)
+    {
+        this->Release();
+        slot = other.slot;
+        other.slot = NULL;
+    }
+    return *this;
+}
+
+Frame::~Frame()
+{
+    this->Release();
+}
+
+bool Frame::IsValid() const
+{
+    return (slot != NULL);
+}
+
+struct rawImage* Frame::Image() const
+{
+    if (slot == NULL)
+        return NULL;
+    return &slot->image;
+}
+
+unsigned char* Frame::Data() const
+{
+    if (slot == NULL)
+        return NULL;
+    return slot->image.data;
+}
+
+uint16_t* Frame::Pixels() const
+{
+    if (slot == NULL)
+        return NULL;
+    return slot->image.pixels;
+}
+
+const struct FrameStats* Frame::Stats() const
+{
+    if (slot == NULL)
+        return NULL;
+    return &slot->image.stats;
+}
+
+unsigned int Frame::Capacity() const
+{
+    if (slot == NULL)
+        return 0;
+    return slot->capacity;
+}
+
+void Frame::Release()
+{
+    if (slot)
+        FramePool::Release(slot);
+    slot = NULL;
+}
+
+FramePool::FramePool() : pixelCount(0)
+{
+}
+
+FramePool::~FramePool()
+{
+    this->Free();
+}
+
+bool FramePool::Allocate(int count, unsigned int frameSize, Transport* transport)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    DEBUG("Allocating %d frame buffers...", count);
+    int lentCount = 0;
+    for (int i=0; i<count; i++)
+    {
+        FrameSlot* newSlot = new FrameSlot();
+        newSlot->image.data = transport ? transport->AllocateBuffer(frameSize) : NULL;
+        newSlot->transport = (newSlot->image.data != NULL) ? transport : NULL;
+        if (newSlot->image.data == NULL)
+            newSlot->image.data = (unsigned char*)malloc(frameSize);
+        if (newSlot->image.data == NULL)
+        {
+            ERROR("Failed to allocate frame buffer %d", i);
+            delete newSlot;
+            return false;
+        }
+        if (newSlot->transport)
+            lentCount++;
+
+        newSlot->capacity = frameSize;
+        newSlot->pool = this;
+        newSlot->owned = true;
+        newSlot->inUse = false;
+        slots.push_back(newSlot);
+        released.notify_one();
+    }
+    DEBUG("Done (%d in transport memory)\n", lentCount);
+
+    return true;
+}
+
+bool FramePool::Add(unsigned char* buffer, unsigned int size)
+{
+    if (buffer == NULL)
+        return false;
+
+    std::lock_guard<std::mutex> guard(lock);
+    FrameSlot* newSlot = new FrameSlot();
+    newSlot->image.data = buffer;
+    newSlot->capacity = size;
+    newSlot->pool = this;
+    newSlot->owned = false;
+    newSlot->transport = NULL;
+    newSlot->inUse = false;
+    slots.push_back(newSlot);
+    released.notify_one();
+
+    return true;
+}
+
+void FramePool::SetPixelCount(unsigned int count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    pixelCount = count; // Buffers are resized on their next Acquire, frames in use keep what they have
+}
+
+void FramePool::Free(void (*done)(void* context), void* context)
+{
+    {
+        std::lock_guard<std::mutex> detach(detachLock);
+        std::lock_guard<std::mutex> guard(lock);
+
+        DetachedFrames* detached = NULL;
+        for (size_t i=0; i<slots.size(); i++)
+        {
+            if (slots[i]->inUse)
+            {
+                // Waiting here would hang Disconnect on a frame the caller never gives back
+                if (detached == NULL)
+                    detached = new DetachedFrames{ 0, done, context };
+                slots[i]->pool = NULL;
+                slots[i]->detached = detached;
+                detached->count++;
+                continue;
+            }
+            Destroy(slots[i]);
+        }
+        slots.clear();
+        if (detached != NULL)
+        {
+            DEBUG("%d frames still held, freed when they are released\n", detached->count);
+            return;
+        }
+    }
+    if (done)
+        done(context);
+}
+
+void FramePool::Destroy(FrameSlot* slot)
+{
+    if (slot->owned && slot->transport)
+        slot->transport->FreeBuffer(slot->image.data, slot->capacity);
+    else if (slot->owned)
+        free(slot->image.data);
+    free(slot->image.pixels);
+    delete slot;
+}
+
+Frame FramePool::Acquire(int timeoutMs)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while (true)
+    {
+        for (size_t i=0; i<slots.size(); i++)
+        {
+            if (!slots[i]->inUse)
+            {
+                struct rawImage* image = &slots[i]->image;
+                if (slots[i]->pixelCapacity != pixelCount)
+                {
+                    free(image->pixels);
+                    image->pixels = (pixelCount > 0) ? (uint16_t*)malloc(pixelCount * sizeof(uint16_t)) : NULL;
+                    slots[i]->pixelCapacity = (image->pixels != NULL) ? pixelCount : 0;
+                }
+                slots[i]->inUse = true;
+                image->dataSize = 0;
+                memset(&image->integrity, 0, sizeof(image->integrity));
+                memset(&image->capture, 0, sizeof(image->capture));
+                image->calibrated = 0;
+                memset(&image->stats, 0, sizeof(image->stats));
+                return Frame(slots[i]);
+            }
+        }
+
+        if (timeoutMs < 0)
+            released.wait(guard);
+        else if (released.wait_until(guard, deadline) == std::cv_status::timeout)
+            return Frame();
+    }
+}
+
+void FramePool::Release(FrameSlot* slot)
+{
+    std::unique_lock<std::mutex> detach(detachLock);
+    FramePool* pool = slot->pool;
+    if (pool == NULL)
+    {
+        DetachedFrames* detached = slot->detached;
+        Destroy(slot); // Outlived its pool
+        if (--detached->count > 0)
+            return;
+        detach.unlock();
+        if (detached->done)
+            detached->done(detached->context);
+        delete detached;
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    slot->inUse = false;
+    pool->released.notify_all();
+}
+
+int FramePool::Count()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return (int)slots.size();
+}
+
+int FramePool::Available()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int count = 0;
+    for (size_t i=0; i<slots.size(); i++)
+        if (!slots[i]->inUse)
+            count++;
+    return count;
+}
@@ -0,0 +1,131 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_FRAMEPOOL_H__
+#define __OPEN_SSPRO_FRAMEPOOL_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "rawdecoder.h"
+
+namespace OpenSSPRO
+{
+    class Transport;
+
+    // Camera settings the frame was taken with
+    struct CaptureInfo {
+        int exposureMs;
+        int readoutSpeed;              // ReadOutSpeed
+        bool coolerOn;
+        bool fanHigh;
+        struct timespec exposureStart; // CLOCK_REALTIME, when the camera acknowledged the capture command
+        struct Subframe subframe;      // As read out, binned pixels of the effective image
+    };
+
+    // Corrections applied to rawImage.pixels, see Calibration
+    enum CalibrationStep
+    {
+        CALIBRATED_BIAS = 0x01,
+        CALIBRATED_DARK = 0x02, // Includes the bias
+        CALIBRATED_FLAT = 0x04
+    };
+
+    struct rawImage {
+        unsigned int width;
+        unsigned int height;
+        unsigned int dataSize;
+        unsigned char* data;
+        uint16_t* pixels;      // Decoded while downloading, width x height. NULL when decoding is off
+        struct FrameIntegrity integrity; // How well the rows synced
+        struct CaptureInfo capture;
+        unsigned int calibrated; // CalibrationStep bits
+        struct FrameStats stats; // Levels and star size, gathered while decoding. Zero when not measured
+    };
+
+    class FramePool;
+
+    // What a freed pool leaves to the frames still held. Releasing the last of them runs done, so
+    // whatever lent their memory is only closed once nothing points into it
+    struct DetachedFrames {
+        int count;
+        void (*done)(void* context);
+        void* context;
+    };
+
+    // One pooled buffer. Left to its last Frame when the pool is freed under it (pool is then NULL)
+    struct FrameSlot {
+        struct rawImage image;
+        unsigned int capacity;
+        unsigned int pixelCapacity;
+        bool inUse;
+        bool owned;           // Allocated by the pool rather than supplied by the caller
+        Transport* transport; // Lent the buffer, NULL when it came from the heap
+        FramePool* pool;
+        DetachedFrames* detached;
+    };
+
+    // Move-only handle to one pooled frame buffer, the buffer goes back to the pool when the handle dies
+    class Frame
+    {
+    private:
+        FrameSlot* slot;
+
+        Frame(FrameSlot* slot);
+        friend class FramePool;
+
+    public:
+        Frame();
+        Frame(Frame&& other);
+        Frame& operator=(Frame&& other);
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+        ~Frame();
+
+        bool IsValid() const;
+        struct rawImage* Image() const; // NULL for an empty handle
+        unsigned char* Data() const;
+        uint16_t* Pixels() const;
+        const struct FrameStats* Stats() const; // NULL for an empty handle
+        unsigned int Capacity() const;
+        void Release();
+    };
+
+    // Fixed set of frame buffers allocated up front, handed out as Frame handles
+    class FramePool
+    {
+    private:
+        std::vector<FrameSlot*> slots; // Pointers so Image() stays valid while the pool grows
+        std::mutex lock;
+        std::condition_variable released;
+        unsigned int pixelCount;
+
+        static void Release(FrameSlot* slot);
+        static void Destroy(FrameSlot* slot);
+        friend class Frame;
+
+    public:
+        FramePool();
+        ~FramePool();
+
+        bool Allocate(int count, unsigned int frameSize, Transport* transport); // Transport memory where it has any
+        bool Add(unsigned char* buffer, unsigned int size); // Caller owned, must stay valid while in use
+        // Doesn't wait, frames still held are detached and freed when they are released. done runs once
+        // the last of them is, straight away when none are held
+        void Free(void (*done)(void* context) = NULL, void* context = NULL);
+        void SetPixelCount(unsigned int count); // Decoded image buffer added to each frame, 0 for none
+
+        Frame Acquire(int timeoutMs); // 0 = don't wait, -1 = wait forever
+        int Count();
+        int Available();
+    };
+}
+
+#endif /* __OPEN_SSPRO_FRAMEPOOL_H__ */
@@ -0,0 +1,288 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  framestats.cpp - Histogram, levels and star size of a frame, gathered row by row as it decodes
+*/
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "framestats.h"
+
+#define STAR_RADIUS   8      // Window around a candidate, in 2x2 colour cells
+#define STAR_SIGMA    8.0f   // Candidate peak over the background, in noise sigmas
+#define STAR_MIN_HFR  0.75f  // Anything smaller is a hot pixel or cosmic ray, frame pixels
+#define CELL_SIGMA    2.0f   // Cells below this many sigmas of cell noise don't count towards the HFR
+#define HFR_TO_FWHM   1.8789f // 2 sqrt(2 ln 2) / sqrt(pi / 2), Gaussian FWHM over its flux weighted mean radius
+
+using namespace OpenSSPRO;
+
+static float Median(std::vector<float>& values)
+{
+    size_t middle = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    return values[middle];
+}
+
+FrameStatistics::FrameStatistics()
+{
+    saturation = STATS_SATURATION;
+    this->Begin(0, 0, 1);
+}
+
+void FrameStatistics::SetSaturation(uint16_t level)
+{
+    saturation = level;
+}
+
+void FrameStatistics::Begin(int width, int height, int fields)
+{
+    this->width = width;
+    this->height = height;
+    fieldCount = (fields < 1) ? 1 : (fields > 2) ? 2 : fields;
+    histograms.assign(fieldCount * 2 * STATS_HISTOGRAM_BINS, 0);
+    for (int i=0; i<2; i++)
+    {
+        sum[i] = 0;
+        sumSquares[i] = 0;
+        pixels[i] = 0;
+        minimum[i] = 0xFFFF;
+        maximum[i] = 0;
+        saturated[i] = 0;
+    }
+
+    // Even tile widths keep every tile starting on an even column
+    tileWidth = std::max((width / STATS_TILES_ACROSS) & ~1, 2);
+    tileHeight = std::max(height / STATS_TILES_DOWN, 1);
+    struct peak empty = { 0, -1, -1 };
+    peaks.assign(STATS_TILES_ACROSS * STATS_TILES_DOWN, empty);
+}
+
+void FrameStatistics::AddRow(const uint16_t* row, int y, int field)
+{
+    if (field < 0 || field >= fieldCount || y < 0 || y >= height)
+        return;
+
+    uint32_t* even = &histograms[field * 2 * STATS_HISTOGRAM_BINS];
+    uint32_t* odd = even + STATS_HISTOGRAM_BINS;
+    uint64_t rowSum = 0;
+    uint64_t rowSquares = 0;
+    unsigned int low = minimum[field];
+    unsigned int high = maximum[field];
+    unsigned int over = 0;
+    struct peak* tiles = &peaks[std::min(y / tileHeight, STATS_TILES_DOWN - 1) * STATS_TILES_ACROSS];
+
+    for (int tile=0; tile<STATS_TILES_ACROSS; tile++)
+    {
+        int from = tile * tileWidth;
+        int to = (tile == STATS_TILES_ACROSS - 1) ? width : std::min(from + tileWidth, width);
+        unsigned int best = tiles[tile].value;
+        int bestX = -1;
+        for (int x=from; x<to; x++)
+        {
+            unsigned int value = row[x];
+            ((x & 1) ? odd : even)[value >> STATS_HISTOGRAM_SHIFT]++;
+            rowSum += value;
+            rowSquares += value * value;
+            low = std::min(low, value);
+            high = std::max(high, value);
+            over += (value >= saturation);
+            if (value > best)
+            {
+                best = value;
+                bestX = x;
+            }
+        }
+        if (bestX >= 0)
+        {
+            tiles[tile].value = best;
+            tiles[tile].x = bestX;
+            tiles[tile].y = y;
+        }
+    }
+
+    sum[field] += rowSum;
+    sumSquares[field] += rowSquares;
+    pixels[field] += width;
+    minimum[field] = low;
+    maximum[field] = high;
+    saturated[field] += over;
+}
+
+// Levels of one field, or of the whole frame for field -1. histogram gets the counts, added to what is there
+void FrameStatistics::Summarise(int field, struct FieldStats* stats, uint32_t* histogram)
+{
+    memset(stats, 0, sizeof(*stats));
+    int first = (field < 0) ? 0 : field;
+    int last = (field < 0) ? fieldCount - 1 : field;
+    uint64_t total = 0;
+    uint64_t squares = 0;
+    stats->minimum = 0xFFFF;
+    for (int i=first; i<=last; i++)
+    {
+        const uint32_t* counts = &histograms[i * 2 * STATS_HISTOGRAM_BINS];
+        for (int bin=0; bin<STATS_HISTOGRAM_BINS; bin++)
+            histogram[bin] += counts[bin] + counts[bin + STATS_HISTOGRAM_BINS];
+        stats->pixels += pixels[i];
+        stats->minimum = std::min(stats->minimum, minimum[i]);
+        stats->maximum = std::max(stats->maximum, maximum[i]);
+        stats->saturated += saturated[i];
+        total += sum[i];
+        squares += sumSquares[i];
+    }
+
+    if (stats->pixels == 0)
+    {
+        stats->minimum = 0;
+        return;
+    }
+
+    stats->mean = (double)total / stats->pixels;
+    stats->stddev = sqrt(std::max((double)squares / stats->pixels - stats->mean * stats->mean, 0.0));
+
+    double half = stats->pixels / 2.0;
+    double seen = 0.0;
+    for (int bin=0; bin<STATS_HISTOGRAM_BINS; bin++)
+    {
+        if (seen + histogram[bin] >= half && histogram[bin] > 0)
+        {
+            stats->median = ((bin + (half - seen) / histogram[bin]) * (1 << STATS_HISTOGRAM_SHIFT));
+            break;
+        }
+        seen += histogram[bin];
+    }
+}
+
+// Half flux radius and elongation from the 2x2 colour cells around a candidate. False for
+// candidates too close to the edge or too small to be a star
+bool FrameStatistics::MeasureStar(const uint16_t* image, const struct peak& candidate, float background, float noise, float* hfr, float* elongation)
+{
+    int cellsAcross = width / 2;
+    int cellsDown = height / 2;
+    int cx = candidate.x / 2;
+    int cy = candidate.y / 2;
+    if (cx < STAR_RADIUS || cy < STAR_RADIUS || cx + STAR_RADIUS >= cellsAcross || cy + STAR_RADIUS >= cellsDown)
+        return false;
+
+    const int size = 2 * STAR_RADIUS + 1;
+    float cells[size * size];
+    float cellBackground = background * 4.0f;
+    double flux = 0.0, sumX = 0.0, sumY = 0.0;
+    for (int j=0; j<size; j++)
+    {
+        const uint16_t* top = image + (size_t)(cy - STAR_RADIUS + j) * 2 * width + (cx - STAR_RADIUS) * 2;
+        const uint16_t* bottom = top + width;
+        for (int i=0; i<size; i++)
+        {
+            float value = top[i*2] + top[i*2 + 1] + bottom[i*2] + bottom[i*2 + 1] - cellBackground;
+            cells[j * size + i] = value;
+            if (value <= 0.0f)
+                continue;
+            flux += value;
+            sumX += value * i;
+            sumY += value * j;
+        }
+    }
+    if (flux <= 0.0)
+        return false;
+
+    // Centroid, then the flux weighted mean radius and the second moments about it
+    double centreX = sumX / flux;
+    double centreY = sumY / flux;
+    float floor = CELL_SIGMA * 2.0f * noise; // Four pixels to a cell double the noise
+    double total = 0.0, radius = 0.0, xx = 0.0, yy = 0.0, xy = 0.0;
+    for (int j=0; j<size; j++)
+    {
+        for (int i=0; i<size; i++)
+        {
+            float value = cells[j * size + i];
+            if (value <= floor)
+                continue;
+            double dx = i - centreX;
+            double dy = j - centreY;
+            total += value;
+            radius += value * sqrt(dx * dx + dy * dy);
+            xx += value * dx * dx;
+            yy += value * dy * dy;
+            xy += value * dx * dy;
+        }
+    }
+
+    *hfr = radius / total * 2.0; // Cells are two frame pixels across
+    if (*hfr < STAR_MIN_HFR)
+        return false;
+
+    xx /= total;
+    yy /= total;
+    xy /= total;
+    double root = sqrt((xx - yy) * (xx - yy) / 4.0 + xy * xy);
+    double major = (xx + yy) / 2.0 + root;
+    double minor = std::max((xx + yy) / 2.0 - root, 1e-6);
+    *elongation = sqrt(major / minor);
+    return true;
+}
+
+void FrameStatistics::Finish(const uint16_t* image, struct FrameStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->fieldCount = fieldCount;
+    uint32_t scratch[STATS_HISTOGRAM_BINS];
+    for (int i=0; i<fieldCount; i++)
+    {
+        memset(scratch, 0, sizeof(scratch));
+        this->Summarise(i, &stats->fields[i], scratch);
+    }
+    this->Summarise(-1, &stats->frame, stats->histogram);
+    if (stats->frame.pixels == 0)
+        return;
+
+    // Noise from the median absolute deviation, read off the histogram by widening a window around the
+    // median a bin each side at a time. The last step is interpolated, the bins are coarse next to read noise
+    int centre = std::min((int)stats->frame.median >> STATS_HISTOGRAM_SHIFT, STATS_HISTOGRAM_BINS - 1);
+    double half = stats->frame.pixels / 2.0;
+    double inside = stats->histogram[centre];
+    double deviation = 0.5 * half / std::max(inside, 1.0); // In bins
+    for (int spread=1; inside < half && spread < STATS_HISTOGRAM_BINS; spread++)
+    {
+        double added = 0.0;
+        if (centre - spread >= 0)
+            added += stats->histogram[centre - spread];
+        if (centre + spread < STATS_HISTOGRAM_BINS)
+            added += stats->histogram[centre + spread];
+        if (added > 0.0)
+            deviation = spread - 0.5 + std::min((half - inside) / added, 1.0);
+        inside += added;
+    }
+    float noise = std::max((float)(deviation * (1 << STATS_HISTOGRAM_SHIFT) * 1.4826), 1.0f);
+    stats->noise = noise;
+    if (image == NULL)
+        return;
+
+    float background = stats->frame.median;
+
+    std::vector<float> radii;
+    std::vector<float> elongations;
+    for (size_t i=0; i<peaks.size(); i++)
+    {
+        const struct peak& candidate = peaks[i];
+        if (candidate.x < 0 || candidate.value >= saturation || candidate.value - background < STAR_SIGMA * noise)
+            continue;
+
+        float hfr, elongation;
+        if (!this->MeasureStar(image, candidate, background, noise, &hfr, &elongation))
+            continue;
+        radii.push_back(hfr);
+        elongations.push_back(elongation);
+    }
+
+    stats->stars = radii.size();
+    if (radii.empty())
+        return;
+    stats->hfr = Median(radii);
+    stats->fwhm = stats->hfr * HFR_TO_FWHM;
+    stats->elongation = Median(elongations);
+}
@@ -0,0 +1,84 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_FRAMESTATS_H__
+#define __OPEN_SSPRO_FRAMESTATS_H__
+
+#include <stdint.h>
+#include <vector>
+
+#define STATS_HISTOGRAM_BINS  4096
+#define STATS_HISTOGRAM_SHIFT 4      // Pixel values per bin, as a shift
+#define STATS_TILES_ACROSS    16     // The brightest pixel of each tile is a star candidate
+#define STATS_TILES_DOWN      12
+#define STATS_SATURATION      0xF000 // Decoded full scale is 65535 less the row bias, so stay well clear of it
+
+namespace OpenSSPRO
+{
+    struct FieldStats {
+        unsigned int pixels;
+        unsigned int minimum;
+        unsigned int maximum;
+        unsigned int saturated; // At or over the saturation level
+        double mean;
+        double stddev;
+        double median; // Interpolated within its histogram bin
+    };
+
+    // Measured while the frame decodes, ready as soon as the download is
+    struct FrameStats {
+        struct FieldStats frame;
+        struct FieldStats fields[2]; // Interlaced fields in the order the camera sends them
+        int fieldCount;
+        uint32_t histogram[STATS_HISTOGRAM_BINS]; // Whole frame
+        float noise;      // Background sigma from the median absolute deviation of the histogram
+        int stars;        // Candidates that looked like stars, 0 when HFR and FWHM are unknown
+        float hfr;        // Median half flux radius of the sample, frame pixels
+        float fwhm;       // From the HFR assuming a Gaussian profile
+        float elongation; // Median major over minor axis, 1 for round stars, trailing shows up here
+    };
+
+    // Accumulates FrameStats one decoded row at a time. Only the rows are touched, the star sample
+    // reads small windows around the brightest pixel of each tile once the frame is complete.
+    class FrameStatistics
+    {
+    private:
+        struct peak {
+            uint16_t value;
+            int x;
+            int y;
+        };
+
+        int width;
+        int height;
+        int fieldCount;
+        uint16_t saturation;
+        std::vector<uint32_t> histograms; // Two per field, even and odd columns, so equal values in a row don't stall
+        uint64_t sum[2];
+        uint64_t sumSquares[2];
+        unsigned int pixels[2];
+        unsigned int minimum[2];
+        unsigned int maximum[2];
+        unsigned int saturated[2];
+        std::vector<struct peak> peaks;
+        int tileWidth;
+        int tileHeight;
+
+        void Summarise(int field, struct FieldStats* stats, uint32_t* histogram);
+        bool MeasureStar(const uint16_t* image, const struct peak& candidate, float background, float noise, float* hfr, float* elongation);
+
+    public:
+        FrameStatistics();
+
+        void SetSaturation(uint16_t level); // STATS_SATURATION by default
+        void Begin(int width, int height, int fields);
+        void AddRow(const uint16_t* row, int y, int field); // Decoded image row y, from field 0 or 1
+        void Finish(const uint16_t* image, struct FrameStats* stats); // image is the finished frame, for the star sample
+    };
+}
+
+#endif /* __OPEN_SSPRO_FRAMESTATS_H__ */
@@ -0,0 +1,175 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  framewriter.cpp - Background FITS writer fed by the capture path
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "opensspro.h"
+#include "framewriter.h"
+
+#define DEFAULT_WRITE_QUEUE_DEPTH 1
+
+using namespace OpenSSPRO;
+
+FrameWriter::FrameWriter(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    compression = FITS_UNCOMPRESSED;
+    directIO = false;
+    tracer = NULL;
+    queueDepth = DEFAULT_WRITE_QUEUE_DEPTH;
+    running = true;
+    writing = false;
+    framesWritten = 0;
+    failures = 0;
+    imageBytes = 0.0;
+    fileBytes = 0.0;
+    writeSeconds = 0.0;
+
+    fits.SetThreadPool(this->pool);
+    worker = std::thread(&FrameWriter::Run, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+    }
+    changed.notify_all();
+    worker.join();
+
+    if (ownsPool)
+        delete pool;
+}
+
+void FrameWriter::SetCompression(FitsCompression compression)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    this->compression = compression;
+}
+
+void FrameWriter::SetDirectIO(bool direct)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    directIO = direct;
+}
+
+void FrameWriter::SetQueueDepth(int depth)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    queueDepth = (depth < 1) ? 1 : depth;
+    changed.notify_all();
+}
+
+void FrameWriter::SetTracer(Tracer* tracer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    this->tracer = tracer;
+}
+
+bool FrameWriter::Submit(Frame&& frame, const std::string& fileName)
+{
+    if (!frame.IsValid() || frame.Pixels() == NULL)
+    {
+        ERROR("Frame was not decoded, turn on SetDecodeOnDownload\n");
+        return false;
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    while ((int)queue.size() >= queueDepth)
+        changed.wait(guard); // Backpressure, the disk is slower than the camera
+
+    job next;
+    next.frame = std::move(frame);
+    next.fileName = fileName;
+    queue.push_back(std::move(next));
+    changed.notify_all();
+    return true;
+}
+
+void FrameWriter::Flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!queue.empty() || writing)
+        changed.wait(guard);
+}
+
+void FrameWriter::Run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        while (running && queue.empty())
+            changed.wait(guard);
+        if (queue.empty())
+            break; // Stopped and drained
+
+        job current = std::move(queue.front());
+        queue.pop_front();
+        writing = true;
+        fits.SetCompression(compression);
+        fits.SetDirectIO(directIO);
+        Tracer* trace = tracer;
+        changed.notify_all(); // Room for the next Submit
+        guard.unlock();
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t traceStart = Tracer::Now();
+        const struct rawImage* image = current.frame.Image();
+        bool saved = fits.Write(current.fileName.c_str(), image);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (saved && trace)
+            trace->Span(TRACE_SAVE, traceStart, fits.GetFileSize());
+        double size = (double)image->width * image->height * 2;
+        current.frame.Release(); // Back to the pool before waking Flush
+
+        guard.lock();
+        writing = false;
+        if (saved)
+        {
+            framesWritten++;
+            imageBytes += size;
+            fileBytes += fits.GetFileSize();
+            writeSeconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+        else
+        {
+            failures++;
+            ERROR("Failed to save %s\n", current.fileName.c_str());
+        }
+        changed.notify_all();
+    }
+}
+
+int FrameWriter::GetFramesWritten()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return framesWritten;
+}
+
+int FrameWriter::GetFailures()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return failures;
+}
+
+double FrameWriter::GetCompressionRatio()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return (fileBytes > 0.0) ? imageBytes / fileBytes : 0.0;
+}
+
+double FrameWriter::GetWriteTime()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return (framesWritten > 0) ? writeSeconds / framesWritten : 0.0;
+}
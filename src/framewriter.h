@@ -0,0 +1,78 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_FRAMEWRITER_H__
+#define __OPEN_SSPRO_FRAMEWRITER_H__
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "framepool.h"
+#include "fitswriter.h"
+#include "threadpool.h"
+#include "trace.h"
+
+namespace OpenSSPRO
+{
+    // Saves frames as FITS on a thread of its own so a slow card never holds up the next exposure.
+    // Frames wait in a bounded queue and go back to the pool once they are on disk.
+    class FrameWriter
+    {
+    private:
+        struct job {
+            Frame frame;
+            std::string fileName;
+        };
+
+        FitsWriter fits;
+        ThreadPool* pool;
+        bool ownsPool;
+        FitsCompression compression;
+        bool directIO;
+        Tracer* tracer;
+
+        std::deque<job> queue;
+        int queueDepth;
+        bool running;
+        bool writing;
+        std::mutex lock; // Guards everything above and the counters below
+        std::condition_variable changed;
+        std::thread worker;
+
+        int framesWritten;
+        int failures;
+        double imageBytes; // Uncompressed size of the frames written
+        double fileBytes;
+        double writeSeconds;
+
+        void Run();
+
+    public:
+        FrameWriter(ThreadPool* pool = NULL); // Tile compression threads, NULL for a pool of its own
+        ~FrameWriter();                      // Writes what is still queued
+
+        void SetCompression(FitsCompression compression); // FITS_UNCOMPRESSED by default
+        void SetDirectIO(bool direct);
+        void SetQueueDepth(int depth); // Frames waiting besides the one being written, at least 1
+        void SetTracer(Tracer* tracer); // Records a save span per frame, e.g. the camera's GetTracer(). NULL by default
+
+        // Takes the frame, blocking while the queue is full so capture cannot outrun the disk.
+        // False if the frame has no decoded pixels
+        bool Submit(Frame&& frame, const std::string& fileName);
+        void Flush(); // Returns once everything submitted is written
+
+        int GetFramesWritten();
+        int GetFailures();
+        double GetCompressionRatio(); // Image bytes over file bytes so far
+        double GetWriteTime();        // Average seconds per frame
+    };
+}
+
+#endif /* __OPEN_SSPRO_FRAMEWRITER_H__ */
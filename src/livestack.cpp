@@ -0,0 +1,320 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  livestack.cpp - Star aligned stacking of frames as they are captured
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "opensspro.h"
+#include "livestack.h"
+
+#define BAND_ROWS     32 // Rows per warp task
+#define MATCH_STARS   20 // Brightest stars of each frame tried as pairs
+#define MIN_STARS     4  // A reference needs at least this many
+#define MIN_MATCHES   4  // Pairs needed to accept an alignment
+#define MATCH_SHARE   3  // and at least one in this many of the stars tried
+#define REFINE_PASSES 2
+
+using namespace OpenSSPRO;
+
+LiveStack::LiveStack(ThreadPool* pool) : pool(pool ? pool : new ThreadPool()), ownsPool(pool == NULL),
+                                         finder(this->pool), stack(this->pool)
+{
+    mode = STACK_MEAN;
+    kappa = 3.0f;
+    tolerance = 8.0f;
+    this->Reset();
+}
+
+LiveStack::~LiveStack()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+void LiveStack::SetMode(StackMode mode)
+{
+    this->mode = mode;
+}
+
+void LiveStack::SetKappa(float kappa)
+{
+    this->kappa = kappa;
+}
+
+void LiveStack::SetTolerance(float pixels)
+{
+    tolerance = pixels;
+}
+
+StarFinder* LiveStack::GetStarFinder()
+{
+    return &finder;
+}
+
+void LiveStack::Reset()
+{
+    stack.SetMethod((mode == STACK_KAPPA_SIGMA) ? COMBINE_SIGMA_CLIP : COMBINE_MEAN);
+    stack.SetClipSigma(kappa);
+    stack.Begin(MASTER_BIAS); // The type only labels the master
+    reference.clear();
+    width = 0;
+    height = 0;
+    rejected = 0;
+    memset(&lastTransform, 0, sizeof(lastTransform));
+}
+
+bool LiveStack::Add(const struct rawImage* image)
+{
+    if (image->pixels == NULL)
+    {
+        ERROR("Frame was not decoded, turn on SetDecodeOnDownload\n");
+        return false;
+    }
+
+    finder.Find(image->pixels, image->width, image->height, &stars);
+    memset(&lastTransform, 0, sizeof(lastTransform));
+    lastTransform.stars = stars.size();
+
+    if (reference.empty())
+    {
+        if ((int)stars.size() < MIN_STARS)
+        {
+            DEBUG("Only %d stars, not enough for a reference\n", lastTransform.stars);
+            rejected++;
+            return false;
+        }
+        reference = stars;
+        width = image->width;
+        height = image->height;
+        lastTransform.matches = lastTransform.stars;
+        return stack.Add(image->pixels, width, height);
+    }
+
+    if ((int)image->width != width || (int)image->height != height || !this->Match(&lastTransform))
+    {
+        DEBUG("Frame not aligned, %d stars, %d matched\n", lastTransform.stars, lastTransform.matches);
+        rejected++;
+        return false;
+    }
+
+    warped.resize((size_t)width * height);
+    const uint16_t* raw = image->pixels;
+    int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->Warp(raw, lastTransform, first, std::min(first + BAND_ROWS, height));
+    });
+    return stack.Add(&warped[0], width, height);
+}
+
+// Stars of the frame that land within the tolerance of a reference star. Without pairs only the
+// brightest MATCH_STARS of each list are tried, with pairs every star and pairs[i] is the
+// reference star for frame star i or -1
+int LiveStack::CountMatches(double angle, double dx, double dy, std::vector<int>* pairs)
+{
+    double c = cos(angle);
+    double s = sin(angle);
+    int limit = pairs ? (int)stars.size() : std::min((int)stars.size(), MATCH_STARS);
+    int references = pairs ? (int)reference.size() : std::min((int)reference.size(), MATCH_STARS);
+    float tolerance2 = tolerance * tolerance;
+    int matches = 0;
+    if (pairs)
+        pairs->assign(stars.size(), -1);
+
+    for (int i=0; i<limit; i++)
+    {
+        double x = c * stars[i].x - s * stars[i].y + dx;
+        double y = s * stars[i].x + c * stars[i].y + dy;
+        int best = -1;
+        double bestDistance = tolerance2;
+        for (int j=0; j<references; j++)
+        {
+            double distance = (reference[j].x - x) * (reference[j].x - x) + (reference[j].y - y) * (reference[j].y - y);
+            if (distance <= bestDistance)
+            {
+                best = j;
+                bestDistance = distance;
+            }
+        }
+        if (best >= 0)
+        {
+            matches++;
+            if (pairs)
+                (*pairs)[i] = best;
+        }
+    }
+    return matches;
+}
+
+// Any two stars fix a rotation and shift. Pairs of stars the same distance apart in both frames
+// are tried, the hypothesis most other stars agree with wins and is refined by least squares
+bool LiveStack::Match(struct StackTransform* transform)
+{
+    int current = std::min((int)stars.size(), MATCH_STARS);
+    int references = std::min((int)reference.size(), MATCH_STARS);
+    int best = 0;
+    double bestAngle = 0.0, bestX = 0.0, bestY = 0.0;
+
+    for (int i=0; i<references; i++)
+    {
+        for (int j=i + 1; j<references; j++)
+        {
+            double rx = reference[j].x - reference[i].x;
+            double ry = reference[j].y - reference[i].y;
+            double length = sqrt(rx * rx + ry * ry);
+            for (int k=0; k<current; k++)
+            {
+                for (int l=0; l<current; l++)
+                {
+                    if (l == k)
+                        continue;
+                    double cx = stars[l].x - stars[k].x;
+                    double cy = stars[l].y - stars[k].y;
+                    if (fabs(sqrt(cx * cx + cy * cy) - length) > tolerance)
+                        continue;
+
+                    double angle = atan2(ry, rx) - atan2(cy, cx);
+                    double c = cos(angle);
+                    double s = sin(angle);
+                    double dx = reference[i].x - (c * stars[k].x - s * stars[k].y);
+                    double dy = reference[i].y - (s * stars[k].x + c * stars[k].y);
+                    int matches = this->CountMatches(angle, dx, dy, NULL);
+                    if (matches > best)
+                    {
+                        best = matches;
+                        bestAngle = angle;
+                        bestX = dx;
+                        bestY = dy;
+                    }
+                }
+            }
+        }
+    }
+
+    transform->matches = best;
+    if (best < std::max(MIN_MATCHES, std::min(current, references) / MATCH_SHARE))
+        return false;
+
+    // Rotation and shift that best fit every matched pair, re-pairing with the better transform
+    std::vector<int> pairs;
+    for (int pass=0; pass<REFINE_PASSES; pass++)
+    {
+        int matches = this->CountMatches(bestAngle, bestX, bestY, &pairs);
+        if (matches < MIN_MATCHES)
+            break;
+
+        double meanX = 0.0, meanY = 0.0, refX = 0.0, refY = 0.0;
+        for (size_t i=0; i<pairs.size(); i++)
+        {
+            if (pairs[i] < 0)
+                continue;
+            meanX += stars[i].x;
+            meanY += stars[i].y;
+            refX += reference[pairs[i]].x;
+            refY += reference[pairs[i]].y;
+        }
+        meanX /= matches;
+        meanY /= matches;
+        refX /= matches;
+        refY /= matches;
+
+        double dot = 0.0, cross = 0.0;
+        for (size_t i=0; i<pairs.size(); i++)
+        {
+            if (pairs[i] < 0)
+                continue;
+            double x = stars[i].x - meanX;
+            double y = stars[i].y - meanY;
+            double u = reference[pairs[i]].x - refX;
+            double v = reference[pairs[i]].y - refY;
+            dot += x * u + y * v;
+            cross += x * v - y * u;
+        }
+        bestAngle = atan2(cross, dot);
+        bestX = refX - (cos(bestAngle) * meanX - sin(bestAngle) * meanY);
+        bestY = refY - (sin(bestAngle) * meanX + cos(bestAngle) * meanY);
+        transform->matches = matches;
+    }
+
+    transform->angle = bestAngle;
+    transform->dx = bestX;
+    transform->dy = bestY;
+    return true;
+}
+
+// Each stack pixel takes the nearest frame pixel of the same Bayer colour, which keeps the mosaic
+// intact at the cost of up to a pixel of shift. Pixels mapped from outside the frame repeat its edge
+void LiveStack::Warp(const uint16_t* raw, const struct StackTransform& transform, int first, int last)
+{
+    double c = cos(transform.angle);
+    double s = sin(transform.angle);
+    int lastX = width - 1;
+    int lastY = height - 1;
+
+    for (int y=first; y<last; y++)
+    {
+        // Inverse transform, frame position of stack pixel (0, y), stepping by (c, -s) along the row
+        double ty = y - transform.dy;
+        double fx = c * -transform.dx + s * ty;
+        double fy = -s * -transform.dx + c * ty;
+        int py = y & 1;
+        uint16_t* out = &warped[(size_t)y * width];
+
+        for (int x=0; x<width; x++, fx += c, fy -= s)
+        {
+            int px = x & 1;
+            int sx = px + 2 * (int)floor((fx - px) * 0.5 + 0.5);
+            int sy = py + 2 * (int)floor((fy - py) * 0.5 + 0.5);
+            if (sx < 0)
+                sx = px;
+            else if (sx > lastX)
+                sx = lastX - ((lastX - px) & 1);
+            if (sy < 0)
+                sy = py;
+            else if (sy > lastY)
+                sy = lastY - ((lastY - py) & 1);
+            out[x] = raw[(size_t)sy * width + sx];
+        }
+    }
+}
+
+int LiveStack::GetFrameCount()
+{
+    return stack.GetFrameCount();
+}
+
+int LiveStack::GetRejectedCount()
+{
+    return rejected;
+}
+
+struct StackTransform LiveStack::GetLastTransform()
+{
+    return lastTransform;
+}
+
+int LiveStack::GetWidth()
+{
+    return width;
+}
+
+int LiveStack::GetHeight()
+{
+    return height;
+}
+
+bool LiveStack::GetImage(uint16_t* pixels)
+{
+    if (!stack.Finish(&result))
+        return false;
+    memcpy(pixels, &result.pixels[0], result.pixels.size() * sizeof(uint16_t));
+    return true;
+}
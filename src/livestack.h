@@ -0,0 +1,84 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_LIVESTACK_H__
+#define __OPEN_SSPRO_LIVESTACK_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "framepool.h"
+#include "calibration.h"
+#include "starfinder.h"
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    enum StackMode
+    {
+        STACK_MEAN = 0,
+        STACK_KAPPA_SIGMA = 1 // Running mean that leaves out satellites, planes and cosmic rays
+    };
+
+    // Rotation about the frame origin then shift, takes a frame onto the reference frame
+    struct StackTransform {
+        double angle; // Radians, counterclockwise with y pointing down the frame
+        double dx;
+        double dy;
+        int stars;    // Found in the frame
+        int matches;  // Paired with reference stars
+    };
+
+    // Stacks frames as they arrive. Every frame is aligned to the first one by its stars and added
+    // to a fixed set of per pixel planes, so memory does not grow with the number of frames.
+    // The stack stays a Bayer mosaic, frames are resampled from pixels of the same colour.
+    class LiveStack
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        StarFinder finder;
+        MasterBuilder stack;
+        StackMode mode;
+        float kappa;
+        float tolerance; // Match distance in frame pixels
+        int width;
+        int height;
+        int rejected;
+        std::vector<struct Star> reference;
+        std::vector<struct Star> stars;
+        std::vector<uint16_t> warped;
+        struct Master result;
+        struct StackTransform lastTransform;
+
+        bool Match(struct StackTransform* transform);
+        int CountMatches(double angle, double dx, double dy, std::vector<int>* pairs);
+        void Warp(const uint16_t* raw, const struct StackTransform& transform, int first, int last);
+
+    public:
+        LiveStack(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~LiveStack();
+
+        void SetMode(StackMode mode); // STACK_MEAN by default, applies from the next Reset
+        void SetKappa(float kappa);   // Rejection threshold for STACK_KAPPA_SIGMA, 3 by default
+        void SetTolerance(float pixels); // How far a star may be from its match, 8 frame pixels by default
+        StarFinder* GetStarFinder();  // For the detection settings
+        void Reset();
+
+        // Aligns and adds a decoded frame. The first frame with enough stars becomes the reference.
+        // False if the frame could not be aligned, it is then left out
+        bool Add(const struct rawImage* image);
+        int GetFrameCount();
+        int GetRejectedCount();
+        struct StackTransform GetLastTransform();
+        int GetWidth();
+        int GetHeight();
+        bool GetImage(uint16_t* pixels); // Width x height, false before the first frame
+    };
+}
+
+#endif /* __OPEN_SSPRO_LIVESTACK_H__ */
@@ -10,114 +10,344 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <libusb-1.0/libusb.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "opensspro.h"
-
-#define USB_REQ_STATUS    0x02
-#define USB_REQ_SET_FRAME 0x0B
-#define USB_REQ_CAPTURE   0x03
-#define USB_REQ_DOWNLOAD  0x04
-#define USB_REQ_ABORT     0x05
-#define USB_REQ_SET_DIO   0x0C
-#define USB_REQ_UNKNOWN   0x09
-
-#define USB_TIMEOUT      1000
-#define USB_RX_ENDPOINT  0x82
-#define USB_CMD_ENDPOINT 0x08
-#define USB_CONTROL_TYPE 0x03
-#define START_BYTE       0xA5
+#include "protocol.h"
+#include "usbtransport.h"
+#include "calibration.h"
 
 #define IMAGE_WIDTH       3040
 #define IMAGE_HEIGHT      2024
-#define BUFFER_SIZE       1024
-#define MAX_TRANSFER_SIZE 12677612
+
+#define DEFAULT_TRANSFER_COUNT 8
+#define DEFAULT_TRANSFER_SIZE  (256*1024) // Must be a multiple of BUFFER_SIZE
+
+#define DEFAULT_FRAME_POOL_SIZE 2
+#define FRAME_ACQUIRE_TIMEOUT   1000
+
+#define DEFAULT_CAPTURE_TIMEOUT 30000 // Allowance for readout past the end of the exposure
+#define DEFAULT_RECONNECT_TIMEOUT 30000 // Long enough for a hub or a camera to power cycle
+#define POLL_LEAD_MS            20    // Start tight polling this long before the expected end
+#define POLL_TIGHT_MS           5     // Poll interval around the expected end
+#define POLL_TIGHT_WINDOW_MS    2000  // How long past the expected end to keep polling tightly
+#define POLL_MAX_MS             250   // Back off to this interval once the window has passed
+#define POLL_IDLE_MS            1000  // Interval while the exposure is still far from done
 
 using namespace OpenSSPRO;
 
-libusb_context* usb = NULL;
+SSPRO::SSPRO() : rowDecoder(&decoder)
+{
+    transferCount = DEFAULT_TRANSFER_COUNT;
+    transferSize = DEFAULT_TRANSFER_SIZE;
+    downloadRate = 0.0;
+    framePoolSize = DEFAULT_FRAME_POOL_SIZE;
+    layoutMode = LAYOUT_EFFECTIVE;
+    decodeLayout = RawDecoder::Layout(layoutMode);
+    decodeOnDownload = true;
+    measureOnDownload = true;
+    calibration = NULL;
+    framePool.SetPixelCount(decodeLayout.width * decodeLayout.height);
+    readoutSpeed = READOUT_FASTEST;
+    exposureMs = 0;
+    memset(&subframe, 0, sizeof(subframe));
+    subframe.binning = 1;
+    captureFrame = RawDecoder::Fit(subframe);
+    measuring = false;
+    firstFieldBytes = 0;
+    secondField = false;
+    downloadOffset = 0;
+    tracer = &ownTracer;
+    decoding = false;
+    downloadStart = 0;
+    transferEnd = 0;
+    transferBytes = 0;
+    reconnectTimeout = DEFAULT_RECONNECT_TIMEOUT;
+    reconnects = 0;
+    reconnectMs = 0.0;
+    captureTimeout = DEFAULT_CAPTURE_TIMEOUT;
+    captureGeneration = 0;
+    cancelledGeneration = 0;
+    frameReadyCallback = NULL;
+    frameReadyContext = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &exposureStart);
+    clock_gettime(CLOCK_REALTIME, &exposureStartUtc);
+    fanHigh = false;
+    coolerOn = true;
+    capturing = false;
+    frameReady = false;
+    downloading = false;
+    ioRunning = false;
+    transport = NULL;
+    ownsTransport = false;
+}
 
-SSPRO::SSPRO()
+SSPRO::~SSPRO()
 {
-    lastImage.width = IMAGE_WIDTH;
-    lastImage.height = IMAGE_HEIGHT;
-    lastImage.data = NULL;
+    if (this->IsConnected())
+        this->Disconnect();
+}
 
-    DEBUG("Searching for USB root...");
-    if (usb == NULL)
+bool SSPRO::Connect()
+{
+    return this->Connect(std::string());
+}
+
+bool SSPRO::Connect(const std::string& serial)
+{
+    UsbTransport* usbTransport = new UsbTransport(serial);
+    if (!this->Connect(usbTransport))
     {
-        int result = libusb_init(&usb);
-        if (result < 0)
-            ERROR("Failed to init libusb, result = %d", result);
-        else
-            DEBUG("Ready\n");
+        delete usbTransport;
+        return false;
     }
+    ownsTransport = true;
+    return true;
 }
 
-bool SSPRO::Connect()
+struct deviceInfo* SSPRO::GetDevices()
+{
+    return UsbTransport::ListDevices();
+}
+
+void SSPRO::FreeDevices(struct deviceInfo* devices)
+{
+    UsbTransport::FreeDevices(devices);
+}
+
+bool SSPRO::Connect(Transport* transport)
 {
-    DEBUG("Looking for camera...");
-    if ((this->device = libusb_open_device_with_vid_pid(usb, SSPRO_VENDOR_ID, SSPRO_PRODUCT_ID)) == NULL)
+    if (this->transport != NULL)
     {
-        DEBUG("NOT found!\n");
+        ERROR("Already connected, disconnect first\n");
         return false;
     }
-    DEBUG("Found it!\n");
+    if (transport == NULL || !transport->Open())
+        return false;
+    this->transport = transport;
+    ownsTransport = false;
+    transport->SetTransferQueue(transferCount, transferSize);
 
-    DEBUG("Checking for kernel driver...");
-    int result;
-    if (libusb_kernel_driver_active(this->device, 0) == 1)
+    if (!framePool.Allocate(framePoolSize, MAX_TRANSFER_SIZE, transport))
     {
-        result = libusb_detach_kernel_driver(this->device, 0);
-        if (result < 0)
-            ERROR("Failed to detach kernel driver, result = %d", result);
+        this->Disconnect();
+        return false;
     }
-    DEBUG("Done\n");
-
-    DEBUG("Setting USB configuration...");
-    result = libusb_set_configuration(this->device, 1); // Only one configuration available
-    if (result < 0)
-        ERROR("Failed to set configuration, result = %d", result);
-    DEBUG("Done\n");
 
-    DEBUG("Claiming USB interface...");
-    result = libusb_claim_interface(this->device, 0); // Only one interface available
-    if (result < 0)
-        ERROR("Failed to claim interface, result = %d", result);
+    DEBUG("Starting I/O thread...");
+    ioRunning = true;
+    ioThread = std::thread(&SSPRO::IOThread, this);
     DEBUG("Done\n");
 
-    this->Init();
+    if (!this->Execute([this]{ return this->Init(); }, false))
+    {
+        ERROR("Failed to initialize camera\n");
+        this->Disconnect();
+        return false;
+    }
     return true;
 }
 
+static void CloseTransport(void* transport)
+{
+    ((Transport*)transport)->Close();
+}
+
+static void DeleteTransport(void* transport)
+{
+    ((Transport*)transport)->Close();
+    delete (Transport*)transport;
+}
+
 void SSPRO::Disconnect()
 {
     DEBUG("Disconnecting camera...");
-    if (this->device)
-        libusb_close(this->device);
-    this->device = NULL;
+    if (ioThread.joinable())
+    {
+        // Let queued commands finish, the thread exits once the queue is empty
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            ioRunning = false;
+        }
+        queueReady.notify_all();
+        ioThread.join();
+    }
+
+    this->DropFieldCMD(); // The I/O thread is gone, nothing else touches it now
+    {
+        std::lock_guard<std::mutex> guard(frameLock);
+        lastFrame.Release();
+    }
+    // Frames still held keep the transport open, the memory it lent them must go back before it closes
+    if (this->transport)
+        framePool.Free(ownsTransport ? DeleteTransport : CloseTransport, this->transport);
+    else
+        framePool.Free();
+    this->transport = NULL;
+    ownsTransport = false;
     DEBUG("Done\n");
 }
 
 bool SSPRO::IsConnected()
 {
-    return (this->device != NULL);
+    return (this->transport != NULL);
+}
+
+bool SSPRO::IsDeviceLost()
+{
+    return (this->transport != NULL && !this->transport->IsAttached());
+}
+
+bool SSPRO::Reconnect()
+{
+    if (this->transport == NULL)
+        return false;
+    return this->Execute([this]{ return this->ReconnectCMD(); }, true);
+}
+
+bool SSPRO::ReconnectCMD()
+{
+    DEBUG("Reconnecting camera...");
+    uint64_t start = Tracer::Now();
+    // Whatever the camera was doing went with it
+    this->DropFieldCMD();
+    frameReady = false;
+    capturing = false;
+    downloading = false;
+
+    if (!transport->Reconnect(reconnectTimeout))
+    {
+        ERROR("Camera did not come back within %d ms\n", reconnectTimeout);
+        return false;
+    }
+    transport->SetTransferQueue(transferCount, transferSize);
+    if (!this->SetDIO()) // Not Init, that would forget the fan and cooler settings
+        return false;
+
+    tracer->Span(TRACE_RECONNECT, start);
+    reconnectMs = (Tracer::Now() - start) / 1e6;
+    reconnects++;
+    DEBUG("Done (%.1f ms)\n", reconnectMs.load());
+    return true;
+}
+
+void SSPRO::SetReconnectTimeout(int ms)
+{
+    reconnectTimeout = ms;
+}
+
+double SSPRO::GetReconnectTime()
+{
+    return reconnectMs;
 }
 
-void SSPRO::GetStatus()
+int SSPRO::GetReconnectCount()
+{
+    return reconnects;
+}
+
+void SSPRO::IOThread()
+{
+    std::unique_lock<std::mutex> guard(queueLock);
+    while (true)
+    {
+        while (ioRunning && commandQueue.empty())
+            queueReady.wait(guard);
+        if (commandQueue.empty())
+            break; // Stopping and drained
+
+        std::packaged_task<bool()> command = std::move(commandQueue.front());
+        commandQueue.pop_front();
+        guard.unlock();
+        command();
+        guard.lock();
+    }
+}
+
+std::future<bool> SSPRO::Enqueue(std::function<bool()> command, bool priority)
+{
+    std::packaged_task<bool()> task(command);
+    std::future<bool> result = task.get_future();
+
+    // Commands issued from the I/O thread itself would wait on themselves, run them in place
+    if (std::this_thread::get_id() == ioThread.get_id())
+    {
+        task();
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        if (!ioRunning)
+        {
+            ERROR("Camera not connected");
+            std::promise<bool> failed;
+            failed.set_value(false);
+            return failed.get_future();
+        }
+
+        if (priority)
+            commandQueue.push_front(std::move(task));
+        else
+            commandQueue.push_back(std::move(task));
+    }
+    queueReady.notify_one();
+
+    return result;
+}
+
+bool SSPRO::Execute(std::function<bool()> command, bool priority)
+{
+    return this->Enqueue(command, priority).get();
+}
+
+bool SSPRO::GetStatus()
+{
+    // The camera streams the frame on the response endpoint, a status query would have to wait it out
+    if (downloading)
+        return true;
+
+    // A short exposure moves on to its second field as soon as a poll finds the first one ready
+    return this->Execute([this]{ return this->StatusCMD() && this->NextFieldCMD(); }, false);
+}
+
+std::future<bool> SSPRO::GetStatusAsync()
+{
+    return this->Enqueue([this]{ return this->StatusCMD() && this->NextFieldCMD(); }, false);
+}
+
+bool SSPRO::IsCapturing()
+{
+    return capturing;
+}
+
+bool SSPRO::IsFrameReady()
+{
+    return frameReady && !secondField; // Only the first field of a short exposure is not a frame yet
+}
+
+bool SSPRO::StatusCMD()
 {
     DEBUG("Requesting camera status...");
     if (!this->SendCMD( USB_REQ_STATUS, 0x00, 0x00, 0x00, 0x00 ))
+    {
         ERROR("Failed to get status");
-    else
-        DEBUG("Done\n");
+        return false;
+    }
+    DEBUG("Done\n");
+
+    return true;
 }
 
-void SSPRO::SetupFrame()
+// First row pair and rows per field. A 1x1 pair is one row of each field, a 2x2 one is summed on the sensor
+void SSPRO::SetupFrame(const struct Subframe& frame)
 {
     DEBUG("Setting up frame...");
-    if (!this->SendCMD( USB_REQ_SET_FRAME, 0x00, 0x00, 0x03, 0xF9 ))
+    int pair = (frame.binning == 1) ? 2 : 1;
+    int start = frame.y / pair;
+    int rows = frame.height / pair + RawDecoder::BlankingRows(frame.binning);
+    if (!this->SendCMD( USB_REQ_SET_FRAME, start >> 8, start & 0xFF, rows >> 8, rows & 0xFF ))
         ERROR("Failed to setup frame");
     else
         DEBUG("Done\n");
@@ -125,31 +355,34 @@ void SSPRO::SetupFrame()
 
 bool SSPRO::SendCMD(unsigned char cmd, unsigned char data0, unsigned char data1, unsigned char data2, unsigned char data3)
 {
+    uint64_t start = Tracer::Now();
     int txCount;
-    unsigned char data[6] = { START_BYTE, cmd, data0, data1, data2, data3 };
-    int result = libusb_bulk_transfer(this->device, USB_CMD_ENDPOINT, data, 6, &txCount, USB_TIMEOUT);
+    unsigned char data[CMD_LENGTH] = { START_BYTE, cmd, data0, data1, data2, data3 };
+    int result = transport->Send(data, CMD_LENGTH, &txCount, USB_TIMEOUT);
     if (result < 0)
         return false;
 
-    if (txCount != 6)
+    if (txCount != CMD_LENGTH)
         return false;
 
-    return this->GetCMDResult(cmd);
+    bool acknowledged = this->GetCMDResult(cmd);
+    tracer->Span(TRACE_COMMAND, start, cmd);
+    return acknowledged;
 }
 
 bool SSPRO::GetCMDResult(unsigned char cmd)
 {
     DEBUG("Getting command result...");
     int rxCount;
-    unsigned char rxData[8];
-    int result = libusb_bulk_transfer(this->device, USB_RX_ENDPOINT, rxData, sizeof(rxData), &rxCount, USB_TIMEOUT);
+    unsigned char rxData[RESULT_LENGTH];
+    int result = transport->Receive(rxData, sizeof(rxData), &rxCount, USB_TIMEOUT);
     if (result < 0)
     {
         ERROR("Failed to read command result, returned %d", result);
         return false;
     }
 
-    if (rxCount != 8)
+    if (rxCount != RESULT_LENGTH)
     {
         ERROR("Invalid packet size, %d", rxCount);
         return false;
@@ -175,7 +408,7 @@ bool SSPRO::GetCMDResult(unsigned char cmd)
                     rxData[0], rxData[1], rxData[2], rxData[3], rxData[4], rxData[5], rxData[6], rxData[7]);
             capturing = (rxData[4] & 0x01) == 0x01;
             frameReady = (rxData[4] & 0x02) == 0x02;
-            DEBUG("Capturing = %d, FrameReady = %d\n", capturing, frameReady);
+            DEBUG("Capturing = %d, FrameReady = %d\n", (bool)capturing, (bool)frameReady);
             return true;
             break;
         case USB_REQ_SET_FRAME:
@@ -222,59 +455,314 @@ bool SSPRO::GetCMDResult(unsigned char cmd)
     return false;
 }
 
+static long ElapsedMs(const struct timespec* since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// A CLOCK_MONOTONIC time as Tracer::Now() gives it
+static uint64_t Nanoseconds(const struct timespec* time)
+{
+    return (uint64_t)time->tv_sec * 1000000000ull + time->tv_nsec;
+}
+
 struct rawImage* SSPRO::Capture(int ms)
 {
     DEBUG("Performing a blocking capture...\n");
     if (!this->StartCapture(ms))
         return NULL;
 
-    usleep((ms+100)*1000); // Wait capture time + 100 ms
+    if (!this->WaitForFrame(captureTimeout))
+        return NULL;
+
+    if (!this->Execute([this]{ return this->DownloadFrame(); }, false))
+        return NULL;
+
+    std::lock_guard<std::mutex> guard(frameLock);
+    return lastFrame.Image();
+}
 
-    int count = 0;
-    while (!this->frameReady && count++ < 10)
+Frame SSPRO::CaptureFrame(int ms)
+{
+    if (this->Capture(ms) == NULL)
+        return Frame();
+
+    return this->TakeLastFrame();
+}
+
+bool SSPRO::StartCapture(int ms)
+{
+    return this->StartCaptureAsync(ms).get();
+}
+
+std::future<bool> SSPRO::StartCaptureAsync(int ms)
+{
+    uint64_t generation;
     {
-        this->GetStatus();
-        usleep(500*1000); // Wait 500 ms
+        std::lock_guard<std::mutex> guard(waitLock);
+        generation = ++captureGeneration;
     }
+    return this->Enqueue([this, ms, generation]{ return this->CaptureCMD(ms, generation); }, false);
+}
 
-    if (count >= 10)
-        return NULL;
+bool SSPRO::CaptureCMD(int ms, uint64_t generation)
+{
+    this->DropFieldCMD(); // Left over from a short exposure that was never finished
+    {
+        std::lock_guard<std::mutex> guard(waitLock);
+        if (generation <= cancelledGeneration)
+        {
+            DEBUG("Capture cancelled before it started\n");
+            return false;
+        }
+        captureFrame = RawDecoder::Fit(subframe);
+    }
+    decodeLayout = RawDecoder::Layout(layoutMode, captureFrame);
+    this->SetupFrame(captureFrame);
+    frameReady = false; // Don't let the previous frame satisfy WaitForFrame
 
-    if (!this->DownloadFrame())
-        return NULL;
+    // Both fields of a 1x1 frame share one exposure only when it is long enough that the
+    // readout of the first doesn't add to the second
+    bool fields = (captureFrame.binning == 1 && ms <= CAPTURE_FIELD_LIMIT);
+    unsigned char mode = (captureFrame.binning == 2) ? CAPTURE_BINNED : fields ? CAPTURE_FIELD_A : CAPTURE_FULL;
+    if (!this->ExposeCMD(ms, mode))
+        return false;
+    {
+        std::lock_guard<std::mutex> guard(waitLock);
+        clock_gettime(CLOCK_REALTIME, &exposureStartUtc);
+        if (generation <= cancelledGeneration)
+            return false; // Cancelled while it was starting, the queued AbortCMD stops the exposure
+    }
+    secondField = fields;
 
-    return &lastImage;
+    return true;
 }
 
-bool SSPRO::StartCapture(int ms)
+// Cmd0 holds the readout speed and time unit, Cmd1-2 the time. Milliseconds below 10 s, tenths of a second above
+bool SSPRO::ExposeCMD(int ms, unsigned char mode)
 {
-    this->SetupFrame();
+    bool tenths = (ms >= CAPTURE_MS_LIMIT);
+    long value = tenths ? (ms + 50) / 100 : ms;
+    if (value > 0xFFFF)
+    {
+        ERROR("Exposure of %d ms is over the camera's limit, capped at 6553.5 s\n", ms);
+        value = 0xFFFF;
+    }
+    else if (value < 1)
+        value = 1;
+    unsigned char timing = ((readoutSpeed & 0x07) << 1) | (tenths ? CAPTURE_TENTHS : 0);
 
     DEBUG("Starting capture...");
-    if (!this->SendCMD( USB_REQ_CAPTURE, 0x08, 0x01, 0x2C, 0x02 )) // 30s Color 1x1 binning
+    if (!this->SendCMD( USB_REQ_CAPTURE, timing, value >> 8, value & 0xFF, mode ))
     {
         ERROR("Failed to capture");
         return false;
     }
+    {
+        std::lock_guard<std::mutex> guard(waitLock);
+        clock_gettime(CLOCK_MONOTONIC, &exposureStart);
+        exposureMs = tenths ? value * 100 : value; // What the camera was actually asked for
+    }
     DEBUG("Done\n");
 
     return true;
 }
 
+// Once the first field of a short exposure is ready, fetch it and expose the second. Nothing to do otherwise
+bool SSPRO::NextFieldCMD()
+{
+    if (!frameReady || !secondField)
+        return true;
+
+    secondField = false;
+    Frame frame = this->BeginFrame();
+    unsigned int received = 0;
+    if (frame.IsValid() && this->ReceiveField(frame, 0, &received))
+    {
+        firstField = std::move(frame);
+        firstFieldBytes = received;
+
+        int ms;
+        {
+            std::lock_guard<std::mutex> guard(waitLock);
+            ms = exposureMs;
+        }
+        if (this->ExposeCMD(ms, CAPTURE_FIELD_B))
+            return true;
+    }
+
+    // Half a frame can't be finished, nothing is left to download
+    frameReady = false;
+    this->DropFieldCMD();
+    return false;
+}
+
+// A short exposure that won't be finished, its first field goes back to the pool
+bool SSPRO::DropFieldCMD()
+{
+    secondField = false;
+    firstField.Release();
+    firstFieldBytes = 0;
+    return true;
+}
+
 void SSPRO::CancelCapture()
 {
+    this->CancelCaptureAsync().get();
+}
+
+std::future<bool> SSPRO::CancelCaptureAsync()
+{
+    {
+        std::lock_guard<std::mutex> guard(waitLock);
+        cancelledGeneration = captureGeneration;
+    }
+    waitWake.notify_all();
+
+    return this->Enqueue([this]{ return this->AbortCMD(); }, true);
+}
+
+bool SSPRO::AbortCMD()
+{
+    this->DropFieldCMD();
     DEBUG("Attempting to cancel capture...");
     if (!this->SendCMD( USB_REQ_ABORT, 0x00, 0x00, 0x00, 0x00 ))
+    {
         ERROR("Failed to cancel capture");
+        return false;
+    }
+    DEBUG("Done\n");
+
+    return true;
+}
+
+bool SSPRO::WaitForFrame(int timeoutMs)
+{
+    DEBUG("Waiting for exposure to complete...");
+    std::unique_lock<std::mutex> guard(waitLock);
+    struct timespec start = exposureStart;
+    long duration = exposureMs;
+    long deadline = duration + timeoutMs;
+    int interval = POLL_TIGHT_MS;
+    bool ready = false;
+
+    while (cancelledGeneration < captureGeneration)
+    {
+        if (!transport->IsAttached())
+        {
+            ERROR("Camera lost while waiting for frame\n");
+            break;
+        }
+        long elapsed = ElapsedMs(&start);
+        long remaining = duration - elapsed;
+
+        // Only ask the camera once the end is near, then poll tightly through readout and back off after
+        int sleepMs;
+        if (remaining > POLL_LEAD_MS)
+        {
+            sleepMs = remaining - POLL_LEAD_MS;
+            if (sleepMs > POLL_IDLE_MS)
+                sleepMs = POLL_IDLE_MS;
+        }
+        else
+        {
+            guard.unlock();
+            bool result = this->GetStatus();
+            guard.lock();
+            if (!result)
+                break;
+            if (exposureStart.tv_sec != start.tv_sec || exposureStart.tv_nsec != start.tv_nsec)
+            {
+                // Half way through a short exposure, the wait starts over for the second field
+                tracer->Span(TRACE_EXPOSURE, Nanoseconds(&start), duration);
+                start = exposureStart;
+                interval = POLL_TIGHT_MS;
+                continue;
+            }
+            if (frameReady)
+            {
+                tracer->Span(TRACE_EXPOSURE, Nanoseconds(&start), duration);
+                ready = true;
+                break;
+            }
+
+            if (-remaining > POLL_TIGHT_WINDOW_MS && interval < POLL_MAX_MS)
+                interval = (interval * 2 > POLL_MAX_MS) ? POLL_MAX_MS : interval * 2;
+            sleepMs = interval;
+        }
+
+        if (elapsed >= deadline)
+        {
+            ERROR("Timed out waiting for frame after %ld ms", elapsed);
+            break;
+        }
+        if (elapsed + sleepMs > deadline)
+            sleepMs = deadline - elapsed;
+        waitWake.wait_for(guard, std::chrono::milliseconds(sleepMs));
+    }
+    guard.unlock();
+
+    if (ready)
+        DEBUG("Done (%ld ms after the expected end)\n", ElapsedMs(&start) - duration);
     else
-        DEBUG("Done\n");
+    {
+        DEBUG("Failed\n");
+        // Nothing will download a first field left waiting for its second. It belongs to the I/O thread
+        this->Execute([this]{ return this->DropFieldCMD(); }, true);
+    }
+
+    if (frameReadyCallback)
+        frameReadyCallback(this, ready, frameReadyContext);
+
+    return ready;
 }
 
-bool SSPRO::DownloadFrame()
+std::future<bool> SSPRO::WaitForFrameAsync(int timeoutMs)
 {
-    if (!frameReady)
-        return false;
+    return std::async(std::launch::async, &SSPRO::WaitForFrame, this, timeoutMs);
+}
+
+void SSPRO::SetFrameReadyCallback(FrameReadyCallback callback, void* context)
+{
+    frameReadyCallback = callback;
+    frameReadyContext = context;
+}
+
+void SSPRO::SetCaptureTimeout(int ms)
+{
+    captureTimeout = ms;
+}
+
+int SSPRO::GetCaptureTimeout()
+{
+    return captureTimeout;
+}
+
+// Pooled buffer for the next frame, the row decoder starts on it
+Frame SSPRO::BeginFrame()
+{
+    Frame frame = framePool.Acquire(FRAME_ACQUIRE_TIMEOUT);
+    if (!frame.IsValid())
+    {
+        ERROR("No free frame buffer, release frames taken with TakeLastFrame/CaptureFrame");
+        return frame;
+    }
 
+    struct rawImage* image = frame.Image();
+    measuring = (image->pixels != NULL) && measureOnDownload;
+    rowDecoder.SetStatistics(measuring ? &statistics : NULL);
+    rowDecoder.Begin(frame.Data(), image->pixels, &decodeLayout);
+    return frame;
+}
+
+// One download from the camera into frame at offset, rows are decoded as they land
+bool SSPRO::ReceiveField(Frame& frame, unsigned int offset, unsigned int* received)
+{
+    downloadStart = Tracer::Now();
+    transferEnd = downloadStart;
+    transferBytes = 0;
     DEBUG("Requesting frame download...");
     if (!this->SendCMD( USB_REQ_DOWNLOAD, 0x00, 0x00, 0x00, 0x00 ))
     {
@@ -282,45 +770,285 @@ bool SSPRO::DownloadFrame()
         return false;
     }
     DEBUG("Done\n");
+    downloading = true;
 
-    DEBUG("Waiting for data from camera...");
-    int rxCount;
-    int rxTotal = 0;
-    unsigned char* rxData = (unsigned char*)malloc(BUFFER_SIZE);
-    unsigned char* newImage = (unsigned char*)malloc(MAX_TRANSFER_SIZE);
-    unsigned char* pointer = newImage;
-    // Loop through until we get a partial buffer of data
-    do
-    {
-        int result = libusb_bulk_transfer(this->device, USB_RX_ENDPOINT, rxData, BUFFER_SIZE, &rxCount, USB_TIMEOUT);
-        if (result < 0)
-        {
-            ERROR("Failed to download image, result = %d", result);
-            free(rxData);
+    DEBUG("Waiting for data from camera (%d x %d byte transfers)...", transferCount, transferSize);
+    // The URBs write straight into a pooled frame buffer, there is no staging copy
+    downloadOffset = offset;
+    decoding = (frame.Pixels() != NULL);
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    *received = 0;
+    int result = transport->ReceiveFrame(frame.Data() + offset, frame.Capacity() - offset, received,
+                                         DownloadProgress, this);
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    tracer->Span(TRACE_DOWNLOAD, downloadStart, *received);
+    downloading = false;
+    frameReady = false; // The camera has handed the frame over
+
+    if (result < 0)
+    {
+        ERROR("Failed to download image, result = %d", result);
+        return false;
+    }
+
+    double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    downloadRate = (seconds > 0.0) ? (*received / 1e6) / seconds : 0.0;
+    DEBUG("Done (Received %u bytes in %.3f s, %.2f MB/s)\n", *received, seconds, downloadRate);
+    return true;
+}
+
+bool SSPRO::DownloadFrame()
+{
+    if (secondField)
+    {
+        ERROR("Short exposure is still on its first field, wait for the frame before downloading it\n");
+        return false;
+    }
+    if (!frameReady)
+        return false;
+
+    // The second field of a short exposure lands after the first, the decoder carries on across the join
+    Frame frame = std::move(firstField);
+    unsigned int offset = firstFieldBytes;
+    firstFieldBytes = 0;
+    if (!frame.IsValid())
+    {
+        offset = 0;
+        frame = this->BeginFrame();
+        if (!frame.IsValid())
             return false;
-        }
+    }
+
+    unsigned int received = 0;
+    if (!this->ReceiveField(frame, offset, &received))
+        return false;
+    received += offset;
 
-        //DEBUG(".");
-        memcpy(pointer, rxData, rxCount);
-        pointer += rxCount; // Using BUFFER_SIZE here will push it off the end of the object on the last packet
-        rxTotal += rxCount;
-    } while (rxCount == BUFFER_SIZE);
-    free(rxData);
-    DEBUG("Done (Received %d bytes)\n", rxTotal);
-
-    DEBUG("Updating lastImage...");
-    if (lastImage.data)
-        free(lastImage.data);
-    lastImage.data = newImage;
-    lastImage.dataSize = rxTotal;
-    lastImage.width = IMAGE_WIDTH;
-    lastImage.height = IMAGE_HEIGHT;
-    DEBUG("Done (Data Size=%d, Width=%d, Height=%d)\n", lastImage.dataSize, lastImage.width, lastImage.height);
+    // Only the rows in the last packet are left to decode
+    struct rawImage* image = frame.Image();
+    bool decode = (image->pixels != NULL);
+    uint64_t start = Tracer::Now();
+    rowDecoder.Finish(received);
+    tracer->Span(TRACE_DECODE, start);
+    image->integrity = rowDecoder.GetIntegrity();
+    if (measuring)
+    {
+        start = Tracer::Now();
+        statistics.Finish(image->pixels, &image->stats); // Before calibration, these describe what the camera sent
+        tracer->Span(TRACE_MEASURE, start);
+    }
+    if (image->integrity.rowsRepaired > 0 || image->integrity.rowsMissing > 0)
+        ERROR("Frame damaged in transfer, %u rows repaired, %u missing, %u bytes dropped\n",
+              image->integrity.rowsRepaired, image->integrity.rowsMissing, image->integrity.bytesDropped);
+
+    DEBUG("Updating lastFrame...");
+    image->dataSize = received;
+    image->width = decode ? decodeLayout.width : IMAGE_WIDTH;
+    image->height = decode ? decodeLayout.height : IMAGE_HEIGHT;
+    {
+        std::lock_guard<std::mutex> guard(waitLock);
+        image->capture.exposureMs = exposureMs;
+        image->capture.exposureStart = exposureStartUtc;
+    }
+    image->capture.readoutSpeed = readoutSpeed;
+    image->capture.subframe = captureFrame;
+    image->capture.coolerOn = coolerOn;
+    image->capture.fanHigh = fanHigh;
+
+    Calibration* masters = calibration;
+    if (decode && masters != NULL)
+    {
+        start = Tracer::Now();
+        masters->Apply(image);
+        tracer->Span(TRACE_CALIBRATE, start);
+    }
+    {
+        std::lock_guard<std::mutex> guard(frameLock);
+        lastFrame = std::move(frame); // Hands the previous frame back to the pool unless it was taken
+    }
+    DEBUG("Done (Data Size=%d, Rows=%d, Width=%d, Height=%d)\n", image->dataSize, image->integrity.rowsFound, image->width, image->height);
 
     return true;
 }
 
-void SSPRO::SetDIO()
+void SSPRO::DownloadProgress(unsigned int received, void* context)
+{
+    SSPRO* camera = (SSPRO*)context;
+    Tracer* tracer = camera->tracer;
+    if (camera->transferBytes == 0) // The first URB back is as close as libusb gets to the first byte
+        tracer->Instant(TRACE_FIRST_BYTE, Tracer::Now() - camera->downloadStart);
+    unsigned int bytes = received - camera->transferBytes;
+    tracer->Span(TRACE_TRANSFER, camera->transferEnd, bytes);
+    camera->transferEnd = Tracer::Now();
+    camera->transferBytes = received;
+
+    if (!camera->decoding)
+        return;
+    uint64_t start = camera->transferEnd;
+    camera->rowDecoder.Feed(camera->downloadOffset + received);
+    tracer->Span(TRACE_DECODE, start, bytes);
+}
+
+void SSPRO::SetTransferQueue(int count, int size)
+{
+    transferCount = count;
+    transferSize = size;
+    if (transport)
+        transport->SetTransferQueue(count, size);
+}
+
+double SSPRO::GetDownloadRate()
+{
+    return downloadRate;
+}
+
+bool SSPRO::SetFramePoolSize(int count)
+{
+    framePoolSize = (count < 2) ? 2 : count; // One being filled while the last one is held
+    if (this->transport == NULL)
+        return true;
+
+    // Buffers are only ever added while connected, frames in use may still point at the others
+    int missing = framePoolSize - framePool.Count();
+    if (missing <= 0)
+        return true;
+    return framePool.Allocate(missing, MAX_TRANSFER_SIZE, transport);
+}
+
+int SSPRO::GetFramePoolSize()
+{
+    return framePoolSize;
+}
+
+int SSPRO::GetFreeFrameBuffers()
+{
+    return framePool.Available();
+}
+
+bool SSPRO::AddFrameBuffer(unsigned char* buffer, unsigned int size)
+{
+    if (buffer == NULL || size < MAX_TRANSFER_SIZE)
+    {
+        ERROR("Frame buffer must hold at least %d bytes", MAX_TRANSFER_SIZE);
+        return false;
+    }
+
+    return framePool.Add(buffer, size);
+}
+
+void SSPRO::SetDecodeOnDownload(bool decode)
+{
+    decodeOnDownload = decode;
+    // Sized for the whole sensor, subframes use the start of it
+    struct FrameLayout largest = RawDecoder::Layout(layoutMode);
+    framePool.SetPixelCount(decode ? largest.width * largest.height : 0);
+}
+
+void SSPRO::SetDecodeLayout(LayoutMode mode)
+{
+    layoutMode = mode;
+    this->SetDecodeOnDownload(decodeOnDownload);
+}
+
+void SSPRO::SetMeasureOnDownload(bool measure)
+{
+    measureOnDownload = measure;
+}
+
+void SSPRO::SetCalibration(Calibration* calibration)
+{
+    this->calibration = calibration;
+}
+
+void SSPRO::SetTracer(Tracer* tracer)
+{
+    this->tracer = tracer ? tracer : &ownTracer;
+}
+
+Tracer* SSPRO::GetTracer()
+{
+    return tracer;
+}
+
+unsigned char* SSPRO::GetLastImage()
+{
+    std::lock_guard<std::mutex> guard(frameLock);
+    return lastFrame.Data();
+}
+
+Frame SSPRO::TakeLastFrame()
+{
+    std::lock_guard<std::mutex> guard(frameLock);
+    return std::move(lastFrame);
+}
+
+Frame SSPRO::Download()
+{
+    if (!this->Execute([this]{ return this->DownloadFrame(); }, false))
+        return Frame();
+
+    return this->TakeLastFrame();
+}
+
+bool SSPRO::SetFan(bool high)
+{
+    fanHigh = high;
+    return this->Execute([this]{ return this->SetDIO(); }, false);
+}
+
+bool SSPRO::SetCooler(bool on)
+{
+    coolerOn = on;
+    return this->Execute([this]{ return this->SetDIO(); }, false);
+}
+
+bool SSPRO::IsFanHigh()
+{
+    return fanHigh;
+}
+
+bool SSPRO::IsCoolerOn()
+{
+    return coolerOn;
+}
+
+void SSPRO::SetReadoutSpeed(ReadOutSpeed speed)
+{
+    readoutSpeed = speed;
+}
+
+ReadOutSpeed SSPRO::GetReadoutSpeed()
+{
+    return readoutSpeed;
+}
+
+bool SSPRO::SetBinning(int binning)
+{
+    if (binning != 1 && binning != 2)
+        return false;
+
+    std::lock_guard<std::mutex> guard(waitLock);
+    subframe.binning = binning;
+    return true;
+}
+
+void SSPRO::SetSubframe(int x, int y, int width, int height)
+{
+    std::lock_guard<std::mutex> guard(waitLock);
+    subframe.x = x;
+    subframe.y = y;
+    subframe.width = width;
+    subframe.height = height;
+}
+
+struct Subframe SSPRO::GetSubframe()
+{
+    std::lock_guard<std::mutex> guard(waitLock);
+    return RawDecoder::Fit(subframe);
+}
+
+bool SSPRO::SetDIO()
 {
     DEBUG("Setting DIO...");
     unsigned char dio =0x00;
@@ -329,19 +1057,22 @@ void SSPRO::SetDIO()
     if (coolerOn)
         dio |= 0x01;
     if (!this->SendCMD( USB_REQ_SET_DIO, dio, 0x00, 0x00, 0x00 ))
+    {
         ERROR("Failed to set DIO");
-    else
-        DEBUG("Done\n");
+        return false;
+    }
+    DEBUG("Done\n");
+
+    return true;
 }
 
-void SSPRO::Init()
+bool SSPRO::Init()
 {
     DEBUG("Initializing camera...");
     fanHigh = false;
     coolerOn = true;
     frameReady = false;
-    readoutSpeed = READOUT_FASTEST;
     DEBUG("Done\n");
 
-    this->SetDIO();
+    return this->SetDIO();
 }
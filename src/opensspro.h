@@ -9,9 +9,9 @@
 #define __OPEN_SSPRO_H__ 
 
 #ifdef VERBOSE
-    #define DEBUG(...) printf(__VA_ARGS__)
+    #define DEBUG(...) do { printf(__VA_ARGS__); } while (0)
 #else
-    #define DEBUG(...)
+    #define DEBUG(...) do { } while (0)
 #endif
 
 #define ERROR(...) printf(__VA_ARGS__)
@@ -19,7 +19,18 @@
 #define SSPRO_VENDOR_ID 0x1856  // Imaginova
 #define SSPRO_PRODUCT_ID 0x001E // Starshoot Pro V2.0
 
-typedef struct libusb_device_handle libusb_device_handle;
+#include <time.h>
+#include <string>
+#include <future>
+#include <thread>
+#include <deque>
+#include <atomic>
+#include <functional>
+
+#include "framepool.h"
+#include "transport.h"
+#include "rawdecoder.h"
+#include "trace.h"
 
 namespace OpenSSPRO
 {
@@ -35,49 +46,172 @@ namespace OpenSSPRO
         READOUT_SLOWEST = 7
     };
 
-    struct rawImage {
-        unsigned int width;
-        unsigned int height;
-        unsigned int dataSize;
-        unsigned char* data;
-    };
-
+    // One camera found by SSPRO::GetDevices. Either string picks it in Connect, the location only
+    // holds while the camera stays in the same socket
     struct deviceInfo {
-        char serialNum[256];
+        char serialNum[256]; // USB serial number, empty if the camera reports none or is open elsewhere
+        char location[32];   // Bus and port path, e.g. 1-2.3
         struct deviceInfo* next;
     };
 
+    class SSPRO;
+    class Calibration;
+
+    // Called from WaitForFrame once the exposure finished (ready=true) or failed/timed out
+    typedef void (*FrameReadyCallback)(SSPRO* camera, bool ready, void* context);
+
     class SSPRO
     {
     private:
-        libusb_device_handle* device;
-        struct rawImage lastImage;
-        ReadOutSpeed readoutSpeed;
-        bool fanHigh;
-        bool coolerOn;
-        bool capturing;
-        bool frameReady;
-
-        void Init();
-        void SetupFrame();
+        Transport* transport;
+        bool ownsTransport; // Created by Connect(), deleted on Disconnect
+        FramePool framePool;
+        Frame lastFrame;
+        int framePoolSize;
+        struct timespec exposureStart;
+        struct timespec exposureStartUtc; // For the frame's CaptureInfo
+        int exposureMs;
+        struct Subframe subframe;     // Requested, fitted to the sensor when the capture starts
+        int captureTimeout;
+        uint64_t captureGeneration;   // Counts captures asked for, each CaptureCMD carries the one it was queued as
+        uint64_t cancelledGeneration; // Captures up to this one are cancelled, even if they haven't started yet
+        std::mutex waitLock; // Guards the exposure fields above, waitWake ends WaitForFrame's sleeps on cancel
+        std::condition_variable waitWake;
+        FrameReadyCallback frameReadyCallback;
+        void* frameReadyContext;
+        std::atomic<ReadOutSpeed> readoutSpeed;
+        std::atomic<bool> fanHigh;
+        std::atomic<bool> coolerOn;
+        std::atomic<bool> capturing;
+        std::atomic<bool> frameReady;
+        std::atomic<bool> downloading;
+        std::mutex frameLock; // Guards lastFrame between the I/O thread and callers
+
+        // Every USB transfer happens on ioThread, public calls queue a command and wait on its future
+        std::thread ioThread;
+        std::mutex queueLock;
+        std::condition_variable queueReady;
+        std::deque<std::packaged_task<bool()> > commandQueue;
+        bool ioRunning;
+        int transferCount;
+        int transferSize;
+        double downloadRate;
+
+        // Rows are decoded on the I/O thread as the download lands in the frame buffer
+        RawDecoder decoder;
+        RowDecoder rowDecoder;
+        LayoutMode layoutMode;
+        struct FrameLayout decodeLayout; // For the frame being captured, set on the I/O thread
+        struct Subframe captureFrame;
+        bool measuring;
+        bool decodeOnDownload;
+        bool measureOnDownload;
+        FrameStatistics statistics;
+        std::atomic<Calibration*> calibration;
+
+        // Short 1x1 exposures are taken a field at a time. The first field waits here for the second
+        Frame firstField;
+        unsigned int firstFieldBytes;
+        std::atomic<bool> secondField; // The frame ready now is the first field
+        unsigned int downloadOffset;   // Where the field being downloaded starts in the frame buffer
+
+        Tracer ownTracer;
+        Tracer* tracer;
+        bool decoding;               // The download in progress is decoded as it lands
+        uint64_t downloadStart;      // Tracer::Now() at the download command
+        uint64_t transferEnd;        // Tracer::Now() when the last URB completed
+        unsigned int transferBytes;  // Received as of the last URB
+
+        int reconnectTimeout;
+        std::atomic<int> reconnects;
+        std::atomic<double> reconnectMs; // Latency of the last reconnect
+
+        void IOThread();
+        std::future<bool> Enqueue(std::function<bool()> command, bool priority);
+        bool Execute(std::function<bool()> command, bool priority);
+
+        bool Init();
+        void SetupFrame(const struct Subframe& frame);
         bool DownloadFrame();
-        void SetDIO();
+        Frame BeginFrame();
+        bool ReceiveField(Frame& frame, unsigned int offset, unsigned int* received);
+        bool NextFieldCMD();
+        bool DropFieldCMD();
+        static void DownloadProgress(unsigned int received, void* context);
+        bool SetDIO();
+        bool StatusCMD();
+        bool CaptureCMD(int ms, uint64_t generation);
+        bool ExposeCMD(int ms, unsigned char mode);
+        bool AbortCMD();
+        bool ReconnectCMD();
         bool SendCMD(unsigned char cmd, unsigned char data0, unsigned char data1, unsigned char data2, unsigned char data3);
         bool GetCMDResult(unsigned char cmd);
 
     public:
         SSPRO();
+        ~SSPRO();
 
-        bool Connect();
+        bool Connect();                          // First Starshoot on the USB bus not claimed by another SSPRO
+        bool Connect(const std::string& serial); // The camera with this serial number or location from GetDevices
+        bool Connect(Transport* transport);      // Any backend, e.g. a ReplayTransport. Caller keeps ownership
+        // Doesn't wait for frames still held, each is freed when its Frame is released and the transport is
+        // closed after the last of them. A caller owned transport must outlive those frames
         void Disconnect();
         bool IsConnected();
-
-        void GetStatus();
-        struct rawImage* Capture(int ms); // Blocking call
+        static struct deviceInfo* GetDevices(); // Every Starshoot on the bus, free with FreeDevices
+        static void FreeDevices(struct deviceInfo* devices);
+
+        // A camera that drops off the bus fails whatever it was doing and IsDeviceLost turns true.
+        // Reconnect waits for it to come back, claims it and puts the fan and cooler back as they were.
+        // The exposure in progress is lost, start it again
+        bool IsDeviceLost();
+        bool Reconnect();
+        void SetReconnectTimeout(int ms); // How long Reconnect waits for the camera, 30 s by default
+        double GetReconnectTime();        // ms from Reconnect to the camera ready again, last time it succeeded
+        int GetReconnectCount();
+
+        bool GetStatus(); // Reports the cached state while a frame is downloading. Starts a short exposure's second field
+        std::future<bool> GetStatusAsync();
+        bool IsCapturing();
+        bool IsFrameReady();
+        struct rawImage* Capture(int ms); // Blocking call, image is valid until the next capture
+        Frame CaptureFrame(int ms);       // Blocking call, caller owns the frame until it is released
 
         bool StartCapture(int ms); // Asynchronous call
-        void CancelCapture();
+        std::future<bool> StartCaptureAsync(int ms);
+        void CancelCapture();      // Jumps ahead of any queued commands and ends WaitForFrame
+        std::future<bool> CancelCaptureAsync();
+        bool WaitForFrame(int timeoutMs);                         // Blocks until the frame is ready, or timeoutMs past the expected end
+        std::future<bool> WaitForFrameAsync(int timeoutMs);       // Same as WaitForFrame, on its own thread
+        void SetFrameReadyCallback(FrameReadyCallback callback, void* context);
+        void SetCaptureTimeout(int ms);                           // Readout allowance used by Capture, past the exposure time
+        int GetCaptureTimeout();
         unsigned char* GetLastImage();
+        Frame TakeLastFrame();
+        Frame Download(); // Blocking call, downloads the ready frame and hands it to the caller
+
+        void SetTransferQueue(int count, int size); // Number and size (bytes) of URBs kept in flight during download
+        double GetDownloadRate();                   // MB/s achieved by the last frame download
+        bool SetFramePoolSize(int count); // Frame buffers, at least 2. Allocated on Connect, or added now when connected
+        int GetFramePoolSize();
+        int GetFreeFrameBuffers(); // Not held by a frame, or by the camera for a download in progress
+        bool AddFrameBuffer(unsigned char* buffer, unsigned int size); // Caller owned, used until Disconnect
+        void SetDecodeOnDownload(bool decode); // Fill rawImage.pixels while downloading, on by default
+        void SetDecodeLayout(LayoutMode mode); // LAYOUT_EFFECTIVE by default
+        void SetMeasureOnDownload(bool measure); // Fill rawImage.stats while decoding, on by default
+        void SetCalibration(Calibration* calibration); // Masters applied to each decoded frame on download, NULL for none
+        void SetTracer(Tracer* tracer); // Share one between cameras and writers, NULL for the camera's own. Set before Connect
+        Tracer* GetTracer();            // Timing of commands, exposures, transfers and decoding, on by default
+
+        bool SetFan(bool high);
+        bool SetCooler(bool on);
+        bool IsFanHigh();
+        bool IsCoolerOn();
+        void SetReadoutSpeed(ReadOutSpeed speed); // Applies from the next StartCapture
+        bool SetBinning(int binning); // 1 or 2 (2x2 mono), applies from the next StartCapture
+        void SetSubframe(int x, int y, int width, int height); // Binned pixels of the effective image, 0 width for the whole sensor
+        struct Subframe GetSubframe(); // As it will be read out, rows and columns rounded to keep the Bayer phase at 1x1
+        ReadOutSpeed GetReadoutSpeed();
     };
 }
 
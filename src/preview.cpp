@@ -0,0 +1,343 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  preview.cpp - Software binning and an 8 bit stretched preview, one pass across worker threads
+*/
+
+#include <math.h>
+#include <algorithm>
+
+#include "preview.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    #include <emmintrin.h>
+    #define HAVE_SSE2
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+    #define HAVE_NEON
+#endif
+
+#define BAND_ROWS          16 // Output rows per task
+#define BACKGROUND_STRIDE  17 // Every nth pixel is sampled when the frame has no stats, odd so all colours are seen
+#define MAD_TO_SIGMA       1.4826f
+#define FULL_SCALE         65535.0f
+
+using namespace OpenSSPRO;
+
+// Adds the even columns of a row to even[] and the odd ones to odd[], cells is the number of column pairs
+static void SplitScalar(const uint16_t* row, uint32_t* even, uint32_t* odd, int from, int cells)
+{
+    for (int i=from; i<cells; i++)
+    {
+        even[i] += row[i*2];
+        odd[i] += row[i*2 + 1];
+    }
+}
+
+#ifdef HAVE_SSE2
+static void SplitSSE2(const uint16_t* row, uint32_t* even, uint32_t* odd, int cells)
+{
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    int i = 0;
+    for (; i + 4 <= cells; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(row + i*2));
+        __m128i e = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(even + i)), _mm_and_si128(pixels, low));
+        __m128i o = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(odd + i)), _mm_srli_epi32(pixels, 16));
+        _mm_storeu_si128((__m128i*)(even + i), e);
+        _mm_storeu_si128((__m128i*)(odd + i), o);
+    }
+    SplitScalar(row, even, odd, i, cells);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void SplitNEON(const uint16_t* row, uint32_t* even, uint32_t* odd, int cells)
+{
+    int i = 0;
+    for (; i + 8 <= cells; i += 8)
+    {
+        uint16x8x2_t pixels = vld2q_u16(row + i*2);
+        vst1q_u32(even + i, vaddw_u16(vld1q_u32(even + i), vget_low_u16(pixels.val[0])));
+        vst1q_u32(even + i + 4, vaddw_u16(vld1q_u32(even + i + 4), vget_high_u16(pixels.val[0])));
+        vst1q_u32(odd + i, vaddw_u16(vld1q_u32(odd + i), vget_low_u16(pixels.val[1])));
+        vst1q_u32(odd + i + 4, vaddw_u16(vld1q_u32(odd + i + 4), vget_high_u16(pixels.val[1])));
+    }
+    SplitScalar(row, even, odd, i, cells);
+}
+#endif
+
+// Midtones transfer function, maps 0, midtone and 1 to 0, 0.5 and 1
+static inline double Midtones(double midtone, double x)
+{
+    if (x <= 0.0)
+        return 0.0;
+    if (x >= 1.0)
+        return 1.0;
+    return (midtone - 1.0) * x / ((2.0 * midtone - 1.0) * x - midtone);
+}
+
+Preview::Preview(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    mode = BIN_SUPERPIXEL;
+    pattern = BAYER_GBRG;
+    factor = 2;
+    shadows = 2.8f;
+    target = 0.25f;
+    width = 0;
+    height = 0;
+    curve.resize(0x10000);
+#if defined(HAVE_SSE2)
+    kernel = DECODE_SSE2;
+#elif defined(HAVE_NEON)
+    kernel = DECODE_NEON;
+#else
+    kernel = DECODE_SCALAR;
+#endif
+}
+
+Preview::~Preview()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+void Preview::SetMode(BinMode mode)
+{
+    this->mode = mode;
+}
+
+void Preview::SetPattern(BayerPattern pattern)
+{
+    this->pattern = pattern;
+}
+
+bool Preview::SetBinning(int factor)
+{
+    if (factor != 1 && factor != 2 && factor != 4 && factor != 8)
+        return false;
+    this->factor = factor;
+    return true;
+}
+
+bool Preview::SetKernel(DecodeKernel kernel)
+{
+    switch (kernel)
+    {
+        case DECODE_SCALAR:
+            break;
+#ifdef HAVE_SSE2
+        case DECODE_SSE2:
+            break;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON:
+            break;
+#endif
+        default:
+            return false;
+    }
+
+    this->kernel = kernel;
+    return true;
+}
+
+DecodeKernel Preview::GetKernel()
+{
+    return kernel;
+}
+
+void Preview::SetStretch(float shadows, float target)
+{
+    this->shadows = shadows;
+    this->target = std::min(std::max(target, 0.01f), 0.99f);
+}
+
+int Preview::GetWidth(int rawWidth)
+{
+    int blocks = (mode == BIN_SUPERPIXEL) ? std::max(factor, 2) : factor;
+    return rawWidth / blocks;
+}
+
+int Preview::GetHeight(int rawHeight)
+{
+    int blocks = (mode == BIN_SUPERPIXEL) ? std::max(factor, 2) : factor;
+    return rawHeight / blocks;
+}
+
+int Preview::GetChannels()
+{
+    return (mode == BIN_SUPERPIXEL) ? 3 : 1;
+}
+
+// Lookup from a binned value to the stretched byte. median and noise are in frame units, scale takes
+// them to binned units
+void Preview::BuildCurve(float median, float noise, float scale)
+{
+    double black = std::max((median - shadows * noise) * scale, 0.0f);
+    double range = std::max(FULL_SCALE - black, 1.0);
+    double background = std::max((median * scale - black) / range, 1e-6);
+    double midtone = Midtones(target, background); // The midtone that takes the background to target
+
+    for (int value=0; value<0x10000; value++)
+        curve[value] = (uint8_t)(Midtones(midtone, (value - black) / range) * 255.0 + 0.5);
+}
+
+void Preview::Band(const uint16_t* raw, int rawWidth, int first, int last, uint16_t* binned, uint8_t* preview)
+{
+    int channels = this->GetChannels();
+    if (factor == 1 && mode != BIN_SUPERPIXEL)
+    {
+        for (int y=first; y<last; y++)
+        {
+            const uint16_t* in = raw + (size_t)y * rawWidth;
+            size_t offset = (size_t)y * width;
+            if (binned)
+                std::copy(in, in + width, binned + offset);
+            if (preview)
+                for (int x=0; x<width; x++)
+                    preview[offset + x] = curve[in[x]];
+        }
+        return;
+    }
+
+    // Sites of the 2x2 cell by row and column parity, red and blue from the pattern and green the other two
+    static const int redColumn[4] = { 0, 1, 0, 1 };
+    static const int redRow[4] = { 1, 0, 0, 1 };
+    int red = redRow[pattern] * 2 + redColumn[pattern];
+    int blue = 3 - red;
+    int green = (red == 0 || red == 3) ? 1 : 0; // Green sites are green and 3 - green
+
+    int block = std::max(factor, 2);
+    int span = block / 2;           // Cells across and down a block
+    int cells = width * span;
+    std::vector<uint32_t> sums(cells * 4);
+    uint32_t* site[4] = { &sums[0], &sums[cells], &sums[cells * 2], &sums[cells * 3] }; // Row parity * 2 + column parity
+
+    int siteShift = 0; // Sites per colour in a block, as a shift
+    while ((1 << siteShift) < span * span)
+        siteShift++;
+    std::vector<uint16_t> line(width * channels);
+
+    for (int y=first; y<last; y++)
+    {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int row=0; row<block; row++)
+        {
+            const uint16_t* in = raw + (size_t)(y * block + row) * rawWidth;
+            uint32_t* even = site[(row & 1) * 2];
+            uint32_t* odd = site[(row & 1) * 2 + 1];
+            switch (kernel)
+            {
+#ifdef HAVE_SSE2
+                case DECODE_SSE2: SplitSSE2(in, even, odd, cells); break;
+#endif
+#ifdef HAVE_NEON
+                case DECODE_NEON: SplitNEON(in, even, odd, cells); break;
+#endif
+                default: SplitScalar(in, even, odd, 0, cells); break;
+            }
+        }
+
+        // Cells of a block side by side are folded into the first width entries
+        if (span > 1)
+        {
+            for (int s=0; s<4; s++)
+            {
+                uint32_t* sum = site[s];
+                for (int x=0; x<width; x++)
+                {
+                    uint32_t total = 0;
+                    for (int i=0; i<span; i++)
+                        total += sum[x * span + i];
+                    sum[x] = total;
+                }
+            }
+        }
+
+        if (mode == BIN_SUPERPIXEL)
+        {
+            uint32_t half = (1 << siteShift) >> 1;
+            for (int x=0; x<width; x++)
+            {
+                line[x*3] = (site[red][x] + half) >> siteShift;
+                line[x*3 + 1] = (site[green][x] + site[3 - green][x] + (1 << siteShift)) >> (siteShift + 1);
+                line[x*3 + 2] = (site[blue][x] + half) >> siteShift;
+            }
+        }
+        else
+        {
+            uint32_t half = (1 << siteShift) * 2;
+            for (int x=0; x<width; x++)
+            {
+                uint32_t sum = site[0][x] + site[1][x] + site[2][x] + site[3][x];
+                line[x] = (mode == BIN_SUM) ? std::min(sum, 0xFFFFu) : (sum + half) >> (siteShift + 2);
+            }
+        }
+
+        size_t offset = (size_t)y * line.size();
+        if (binned)
+            std::copy(line.begin(), line.end(), binned + offset);
+        if (preview)
+            for (size_t i=0; i<line.size(); i++)
+                preview[offset + i] = curve[line[i]];
+    }
+}
+
+bool Preview::Process(const uint16_t* raw, int rawWidth, int rawHeight, const struct FrameStats* stats,
+                      uint16_t* binned, uint8_t* preview)
+{
+    width = this->GetWidth(rawWidth);
+    height = this->GetHeight(rawHeight);
+    if (raw == NULL || width < 1 || height < 1)
+        return false;
+
+    if (preview)
+    {
+        float median, noise;
+        if (stats != NULL && stats->frame.pixels > 0)
+        {
+            median = stats->frame.median;
+            noise = stats->noise;
+        }
+        else
+        {
+            // Median and median absolute deviation of a sample, the same estimate FrameStatistics reads off its histogram
+            std::vector<float> sample;
+            size_t count = (size_t)rawWidth * rawHeight;
+            sample.reserve(count / BACKGROUND_STRIDE + 1);
+            for (size_t i=0; i<count; i+=BACKGROUND_STRIDE)
+                sample.push_back(raw[i]);
+            size_t middle = sample.size() / 2;
+            std::nth_element(sample.begin(), sample.begin() + middle, sample.end());
+            median = sample[middle];
+            for (size_t i=0; i<sample.size(); i++)
+                sample[i] = fabsf(sample[i] - median);
+            std::nth_element(sample.begin(), sample.begin() + middle, sample.end());
+            noise = std::max(sample[middle] * MAD_TO_SIGMA, 1.0f);
+        }
+        this->BuildCurve(median, noise, (mode == BIN_SUM) ? factor * factor : 1.0f);
+    }
+
+    int bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->Band(raw, rawWidth, first, std::min(first + BAND_ROWS, height), binned, preview);
+    });
+    return true;
+}
+
+bool Preview::Process(const struct rawImage* image, uint16_t* binned, uint8_t* preview)
+{
+    if (image == NULL)
+        return false;
+    const struct FrameStats* stats = (image->stats.frame.pixels > 0) ? &image->stats : NULL;
+    return this->Process(image->pixels, image->width, image->height, stats, binned, preview);
+}
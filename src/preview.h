@@ -0,0 +1,74 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_PREVIEW_H__
+#define __OPEN_SSPRO_PREVIEW_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "framepool.h"
+#include "demosaic.h"
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    enum BinMode
+    {
+        BIN_SUPERPIXEL = 0, // Each block becomes one RGB pixel, every colour averaged over its own sites
+        BIN_SUM = 1,        // Mono, block total clipped at 65535
+        BIN_AVERAGE = 2     // Mono, block mean
+    };
+
+    // Binned frame and an 8 bit auto stretched copy of it, made in one pass over the decoded frame.
+    // The stretch curve comes from the frame's histogram, so it is ready as soon as the frame is
+    // decoded and needs no pass of its own. Output is interleaved RGB for BIN_SUPERPIXEL, mono otherwise.
+    class Preview
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        BinMode mode;
+        BayerPattern pattern;
+        DecodeKernel kernel;
+        int factor;
+        float shadows;
+        float target;
+        int width;  // Output size of the last frame
+        int height;
+        std::vector<uint8_t> curve; // Stretch lookup, binned value to 8 bits
+
+        void BuildCurve(float median, float noise, float scale);
+        void Band(const uint16_t* raw, int rawWidth, int first, int last, uint16_t* binned, uint8_t* preview);
+
+    public:
+        Preview(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~Preview();
+
+        void SetMode(BinMode mode);           // BIN_SUPERPIXEL by default
+        void SetPattern(BayerPattern pattern); // BAYER_GBRG by default
+        bool SetBinning(int factor);          // 1, 2, 4 or 8 pixels across a block, 2 by default. Superpixels need 2 or more
+        bool SetKernel(DecodeKernel kernel);  // False if the build lacks it
+        DecodeKernel GetKernel();
+
+        // Shadows clip this many noise sigmas below the background, and the background lands at target
+        // of full scale after the midtones transfer. 2.8 and 0.25 by default, the usual screen stretch
+        void SetStretch(float shadows, float target);
+
+        int GetWidth(int rawWidth);   // Output size for a raw frame of this size
+        int GetHeight(int rawHeight);
+        int GetChannels();            // 3 for BIN_SUPERPIXEL, 1 otherwise
+
+        // binned holds width x height x channels values and preview as many bytes, either may be NULL.
+        // stats is the frame's FrameStats, NULL measures the background from a sample of the frame
+        bool Process(const uint16_t* raw, int rawWidth, int rawHeight, const struct FrameStats* stats,
+                     uint16_t* binned, uint8_t* preview);
+        bool Process(const struct rawImage* image, uint16_t* binned, uint8_t* preview); // Uses image->stats when measured
+    };
+}
+
+#endif /* __OPEN_SSPRO_PREVIEW_H__ */
@@ -0,0 +1,44 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  protocol.h - Command codes and USB parameters shared by the driver and its transports
+*/
+
+#ifndef __OPEN_SSPRO_PROTOCOL_H__
+#define __OPEN_SSPRO_PROTOCOL_H__
+
+#define USB_REQ_STATUS    0x02
+#define USB_REQ_SET_FRAME 0x0B
+#define USB_REQ_CAPTURE   0x03
+#define USB_REQ_DOWNLOAD  0x04
+#define USB_REQ_ABORT     0x05
+#define USB_REQ_SET_DIO   0x0C
+#define USB_REQ_UNKNOWN   0x09
+
+// Capture command. Cmd0 holds the readout speed in bits 3-1 and the time unit in bit 0, Cmd1-2 the time
+#define CAPTURE_TENTHS      0x01  // Time in 0.1 s rather than ms
+#define CAPTURE_MS_LIMIT    10000 // Times from here up are sent in 0.1 s
+#define CAPTURE_FIELD_LIMIT 8000  // 1x1 exposures up to this are taken a field at a time
+
+// Last byte of the capture command
+#define CAPTURE_FIELD_A  0x00 // Short exposures, each field exposed and downloaded on its own
+#define CAPTURE_FIELD_B  0x01
+#define CAPTURE_FULL     0x02
+#define CAPTURE_BINNED   0x03 // 2x2, one field of row pairs summed on the sensor
+
+#define USB_TIMEOUT      1000
+#define USB_DOWNLOAD_TIMEOUT 5000
+#define USB_RX_ENDPOINT  0x82
+#define USB_CMD_ENDPOINT 0x08
+#define USB_CONTROL_TYPE 0x03
+#define START_BYTE       0xA5
+
+#define CMD_LENGTH        6
+#define RESULT_LENGTH     8
+#define BUFFER_SIZE       1024
+#define MAX_TRANSFER_SIZE 12677612
+
+#endif /* __OPEN_SSPRO_PROTOCOL_H__ */
@@ -0,0 +1,763 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  rawdecoder.cpp - Finds the rows in a raw download and converts them to 16 bit pixels
+*/
+
+#include <string.h>
+#include <algorithm>
+
+#include "rawdecoder.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    #include <emmintrin.h>
+    #define HAVE_SSE2
+    #if defined(__GNUC__)
+        #include <immintrin.h>
+        #define HAVE_AVX2 // Compiled for AVX2 per function, used only if the CPU reports it
+    #endif
+#endif
+
+#if defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+    #include <arm_neon.h>
+    #define HAVE_NEON
+#endif
+
+// Sensor geometry, field A is sent first and lands on the even image rows
+#define FIELD_A_FIRST_ROW   3    // Rows before this and after the last are vertical blanking
+#define FIELD_A_LAST_ROW    1014
+#define FIELD_A_FRONT_PORCH 60   // Pixels, including the 9 marker pixels
+#define FIELD_B_FIRST_ROW   1020
+#define FIELD_B_LAST_ROW    2031
+#define FIELD_B_FRONT_PORCH 70   // Field B is shifted 10 pixels right of field A
+#define BIAS_FIRST_COLUMN   20   // Columns before this still settle after the marker
+#define BIAS_PEDESTAL       100
+
+using namespace OpenSSPRO;
+
+static const unsigned char zeroMarker[RAW_MARKER_BYTES] = { 0 };
+
+static inline bool IsMarker(const unsigned char* data)
+{
+    return memcmp(data, zeroMarker, RAW_MARKER_BYTES) == 0;
+}
+
+// Start of the first run of RAW_MARKER_BYTES zeros at or after from, or size if there is none
+static unsigned int FindMarker(const unsigned char* data, unsigned int from, unsigned int size)
+{
+    unsigned int zeroCount = 0;
+    for (unsigned int i=from; i<size; i++)
+    {
+        if (data[i] != 0x00)
+            zeroCount = 0;
+        else if (++zeroCount == RAW_MARKER_BYTES)
+            return i + 1 - RAW_MARKER_BYTES;
+    }
+    return size;
+}
+
+static void DecodeScalar(const unsigned char* src, uint16_t* dst, unsigned int pixels)
+{
+    // Byte order independent, also the tail for the vector kernels
+    for (unsigned int i=0; i<pixels; i++)
+        dst[i] = (uint16_t)(src[i*2] | (src[i*2 + 1] << 8));
+}
+
+static void DecodeBiasScalar(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal)
+{
+    // Saturates the same way as the vector kernels
+    for (unsigned int i=0; i<pixels; i++)
+    {
+        int value = (src[i*2] | (src[i*2 + 1] << 8)) + pedestal;
+        if (value > 0xFFFF)
+            value = 0xFFFF;
+        value -= bias;
+        dst[i] = (uint16_t)((value < 0) ? 0 : value);
+    }
+}
+
+#ifdef HAVE_SSE2
+static void DecodeSSE2(const unsigned char* src, uint16_t* dst, unsigned int pixels)
+{
+    // x86 is little endian like the camera, so this is a straight 16 byte move with unaligned loads
+    unsigned int i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i*2));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i*2 + 16));
+        _mm_storeu_si128((__m128i*)(dst + i), a);
+        _mm_storeu_si128((__m128i*)(dst + i + 8), b);
+    }
+    DecodeScalar(src + i*2, dst + i, pixels - i);
+}
+
+static void DecodeBiasSSE2(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal)
+{
+    __m128i b = _mm_set1_epi16((short)bias);
+    __m128i p = _mm_set1_epi16((short)pedestal);
+    unsigned int i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i*2));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_subs_epu16(_mm_adds_epu16(v, p), b));
+    }
+    DecodeBiasScalar(src + i*2, dst + i, pixels - i, bias, pedestal);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void DecodeAVX2(const unsigned char* src, uint16_t* dst, unsigned int pixels)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= pixels; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i*2));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i*2 + 32));
+        _mm256_storeu_si256((__m256i*)(dst + i), a);
+        _mm256_storeu_si256((__m256i*)(dst + i + 16), b);
+    }
+    DecodeScalar(src + i*2, dst + i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void DecodeBiasAVX2(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal)
+{
+    __m256i b = _mm256_set1_epi16((short)bias);
+    __m256i p = _mm256_set1_epi16((short)pedestal);
+    unsigned int i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i*2));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_subs_epu16(_mm256_adds_epu16(v, p), b));
+    }
+    DecodeBiasScalar(src + i*2, dst + i, pixels - i, bias, pedestal);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void DecodeNEON(const unsigned char* src, uint16_t* dst, unsigned int pixels)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        uint8x16_t a = vld1q_u8(src + i*2);
+        uint8x16_t b = vld1q_u8(src + i*2 + 16);
+        vst1q_u16(dst + i, vreinterpretq_u16_u8(a));
+        vst1q_u16(dst + i + 8, vreinterpretq_u16_u8(b));
+    }
+    DecodeScalar(src + i*2, dst + i, pixels - i);
+}
+
+static void DecodeBiasNEON(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal)
+{
+    uint16x8_t b = vdupq_n_u16(bias);
+    uint16x8_t p = vdupq_n_u16(pedestal);
+    unsigned int i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(src + i*2));
+        vst1q_u16(dst + i, vqsubq_u16(vqaddq_u16(v, p), b));
+    }
+    DecodeBiasScalar(src + i*2, dst + i, pixels - i, bias, pedestal);
+}
+#endif
+
+RawDecoder::RawDecoder()
+{
+    kernel = BestKernel();
+}
+
+DecodeKernel RawDecoder::BestKernel()
+{
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return DECODE_AVX2;
+#endif
+#ifdef HAVE_SSE2
+    return DECODE_SSE2;
+#elif defined(HAVE_NEON)
+    return DECODE_NEON;
+#else
+    return DECODE_SCALAR;
+#endif
+}
+
+const char* RawDecoder::KernelName(DecodeKernel kernel)
+{
+    switch (kernel)
+    {
+        case DECODE_SSE2: return "SSE2";
+        case DECODE_AVX2: return "AVX2";
+        case DECODE_NEON: return "NEON";
+        default:          return "scalar";
+    }
+}
+
+bool RawDecoder::SetKernel(DecodeKernel kernel)
+{
+    switch (kernel)
+    {
+        case DECODE_SCALAR:
+            break;
+#ifdef HAVE_SSE2
+        case DECODE_SSE2:
+            break;
+#endif
+#ifdef HAVE_AVX2
+        case DECODE_AVX2:
+            if (!__builtin_cpu_supports("avx2"))
+                return false;
+            break;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON:
+            break;
+#endif
+        default:
+            return false;
+    }
+
+    this->kernel = kernel;
+    return true;
+}
+
+DecodeKernel RawDecoder::GetKernel()
+{
+    return kernel;
+}
+
+struct FrameLayout RawDecoder::Layout(LayoutMode mode)
+{
+    struct FrameLayout layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.rawRows = RAW_FRAME_ROWS;
+    layout.fieldCount = 2;
+    layout.columnBinning = 1;
+
+    struct FieldLayout& a = layout.fields[0];
+    struct FieldLayout& b = layout.fields[1];
+    a.rowStep = b.rowStep = 2;
+    switch (mode)
+    {
+        case LAYOUT_FULL:
+            layout.width = RAW_ROW_PIXELS;
+            layout.height = RAW_FRAME_ROWS;
+            a.firstRow = 0;
+            a.lastRow = RAW_FIELD_ROWS - 1;
+            a.imageRow = 0;
+            b.firstRow = RAW_FIELD_ROWS;
+            b.lastRow = RAW_FRAME_ROWS - 1;
+            b.imageRow = 1;
+            break;
+        case LAYOUT_INTERLACED:
+            layout.width = EFFECTIVE_WIDTH;
+            layout.height = 2028;
+            a.firstRow = FIELD_A_FIRST_ROW;
+            a.lastRow = 1010;
+            a.imageRow = FIELD_A_FIRST_ROW * 2;
+            a.frontPorch = FIELD_A_FRONT_PORCH;
+            b.firstRow = 1021;
+            b.lastRow = 2030;
+            b.imageRow = 9;
+            b.frontPorch = FIELD_B_FRONT_PORCH;
+            break;
+        default:
+            layout.width = EFFECTIVE_WIDTH;
+            layout.height = EFFECTIVE_HEIGHT;
+            layout.pedestal = BIAS_PEDESTAL;
+            a.firstRow = FIELD_A_FIRST_ROW;
+            a.lastRow = FIELD_A_LAST_ROW;
+            a.imageRow = 0;
+            a.frontPorch = FIELD_A_FRONT_PORCH;
+            a.biasStart = BIAS_FIRST_COLUMN;
+            a.biasEnd = FIELD_A_FRONT_PORCH;
+            b.firstRow = FIELD_B_FIRST_ROW;
+            b.lastRow = FIELD_B_LAST_ROW;
+            b.imageRow = 1;
+            b.frontPorch = FIELD_B_FRONT_PORCH;
+            b.biasStart = BIAS_FIRST_COLUMN;
+            b.biasEnd = FIELD_B_FRONT_PORCH;
+            break;
+    }
+
+    return layout;
+}
+
+struct Subframe RawDecoder::Fit(const struct Subframe& subframe)
+{
+    struct Subframe fitted = subframe;
+    fitted.binning = (subframe.binning == 2) ? 2 : 1;
+    int maxWidth = EFFECTIVE_WIDTH / fitted.binning;
+    int maxHeight = EFFECTIVE_HEIGHT / fitted.binning;
+    if (fitted.width <= 0 || fitted.height <= 0)
+    {
+        fitted.x = 0;
+        fitted.y = 0;
+        fitted.width = maxWidth;
+        fitted.height = maxHeight;
+        return fitted;
+    }
+
+    // A 1x1 row pair is one row from each field, and even columns keep the colours where they were
+    int step = (fitted.binning == 1) ? 2 : 1;
+    if (step == 2)
+    {
+        fitted.x &= ~1;
+        fitted.y &= ~1;
+        fitted.width = (fitted.width + 1) & ~1;
+        fitted.height = (fitted.height + 1) & ~1;
+    }
+    fitted.x = std::min(std::max(fitted.x, 0), maxWidth - step);
+    fitted.y = std::min(std::max(fitted.y, 0), maxHeight - step);
+    fitted.width = std::min(fitted.width, maxWidth - fitted.x);
+    fitted.height = std::min(fitted.height, maxHeight - fitted.y);
+    return fitted;
+}
+
+int RawDecoder::BlankingRows(int binning)
+{
+    return (binning == 2) ? RAW_BLANKING_ROWS_BINNED : RAW_BLANKING_ROWS;
+}
+
+// The camera skips rows but always sends them whole, so columns are cropped by moving the front porch.
+// 2x2 sends one field of row pairs summed on the sensor
+struct FrameLayout RawDecoder::Layout(LayoutMode mode, const struct Subframe& subframe)
+{
+    struct Subframe fitted = RawDecoder::Fit(subframe);
+    struct FrameLayout layout = RawDecoder::Layout(mode);
+    if (fitted.binning == 1 && fitted.width == EFFECTIVE_WIDTH && fitted.height == EFFECTIVE_HEIGHT)
+        return layout;
+
+    int rows = (fitted.binning == 1) ? fitted.height / 2 : fitted.height; // Light rows per field
+    int fieldRows = rows + RawDecoder::BlankingRows(fitted.binning);
+    layout.fieldCount = (fitted.binning == 1) ? 2 : 1;
+    layout.rawRows = fieldRows * layout.fieldCount;
+
+    struct FieldLayout& a = layout.fields[0];
+    struct FieldLayout& b = layout.fields[1];
+    a.rowStep = b.rowStep = layout.fieldCount;
+    if (mode == LAYOUT_FULL)
+    {
+        layout.height = layout.rawRows;
+        a.lastRow = fieldRows - 1;
+        b.firstRow = fieldRows;
+        b.lastRow = layout.rawRows - 1;
+        return layout;
+    }
+
+    layout.width = fitted.width;
+    layout.height = fitted.height;
+    layout.columnBinning = fitted.binning;
+    a.firstRow = FIELD_A_FIRST_ROW;
+    a.lastRow = a.firstRow + rows - 1;
+    a.imageRow = 0;
+    a.frontPorch = FIELD_A_FRONT_PORCH + fitted.x * fitted.binning;
+    b.firstRow = fieldRows + FIELD_A_FIRST_ROW;
+    b.lastRow = b.firstRow + rows - 1;
+    b.imageRow = 1;
+    b.frontPorch = FIELD_B_FRONT_PORCH + fitted.x * fitted.binning;
+    return layout;
+}
+
+int RawDecoder::FindRows(const unsigned char* data, unsigned int size, unsigned int* starts, int maxRows)
+{
+    RowDecoder rows(this);
+    rows.Begin(data, NULL, NULL);
+    int rowCount = rows.Finish(size);
+    if (rowCount > maxRows)
+        rowCount = maxRows;
+    memcpy(starts, rows.GetRowStarts(), rowCount * sizeof(unsigned int));
+    return rowCount;
+}
+
+void RawDecoder::DecodeRow(const unsigned char* src, uint16_t* dst, unsigned int pixels)
+{
+    switch (kernel)
+    {
+#ifdef HAVE_SSE2
+        case DECODE_SSE2: DecodeSSE2(src, dst, pixels); return;
+#endif
+#ifdef HAVE_AVX2
+        case DECODE_AVX2: DecodeAVX2(src, dst, pixels); return;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON: DecodeNEON(src, dst, pixels); return;
+#endif
+        default: DecodeScalar(src, dst, pixels); return;
+    }
+}
+
+void RawDecoder::DecodeRow(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal)
+{
+    switch (kernel)
+    {
+#ifdef HAVE_SSE2
+        case DECODE_SSE2: DecodeBiasSSE2(src, dst, pixels, bias, pedestal); return;
+#endif
+#ifdef HAVE_AVX2
+        case DECODE_AVX2: DecodeBiasAVX2(src, dst, pixels, bias, pedestal); return;
+#endif
+#ifdef HAVE_NEON
+        case DECODE_NEON: DecodeBiasNEON(src, dst, pixels, bias, pedestal); return;
+#endif
+        default: DecodeBiasScalar(src, dst, pixels, bias, pedestal); return;
+    }
+}
+
+int RawDecoder::Decode(const unsigned char* data, unsigned int size, uint16_t* image, const struct FrameLayout& layout,
+                       struct FrameIntegrity* integrity, struct FrameStats* stats)
+{
+    FrameStatistics statistics;
+    RowDecoder rows(this);
+    if (stats != NULL)
+        rows.SetStatistics(&statistics);
+    rows.Begin(data, image, &layout);
+    int rowCount = rows.Finish(size);
+    if (integrity)
+        *integrity = rows.GetIntegrity();
+    if (stats != NULL)
+        statistics.Finish(image, stats);
+    return rowCount;
+}
+
+RowDecoder::RowDecoder(RawDecoder* decoder)
+{
+    this->decoder = decoder;
+    statistics = NULL;
+    rowStarts.reserve(RAW_FRAME_ROWS);
+    rowStates.reserve(RAW_FRAME_ROWS);
+    this->Begin(NULL, NULL, NULL);
+}
+
+void RowDecoder::Begin(const unsigned char* data, uint16_t* image, const struct FrameLayout* layout)
+{
+    this->data = data;
+    this->image = (layout != NULL) ? image : NULL;
+    if (layout != NULL)
+        this->layout = *layout;
+    else
+        memset(&this->layout, 0, sizeof(this->layout));
+    expectedRows = (this->layout.rawRows > RAW_FRAME_ROWS) ? RAW_FRAME_ROWS : this->layout.rawRows;
+    rowStarts.clear();
+    rowStates.clear();
+    available = 0;
+    finishing = false;
+    tailBytes = 0;
+    memset(&integrity, 0, sizeof(integrity));
+    synced = false;
+    havePrevious = false;
+    pos = 0;
+    previous = 0;
+    scanFrom = 0;
+    if (statistics != NULL && this->image != NULL)
+        statistics->Begin(this->layout.width, this->layout.height, this->layout.fieldCount);
+}
+
+void RowDecoder::SetStatistics(FrameStatistics* statistics)
+{
+    this->statistics = statistics;
+}
+
+// Next confirmed row start at or after scanFrom, -1 until one has arrived
+int RowDecoder::Search()
+{
+    while (true)
+    {
+        unsigned int found = FindMarker(data, scanFrom, available);
+        if (found >= available)
+        {
+            // A marker may be cut off by the end of the chunk, resume where it could start
+            if (available >= RAW_MARKER_BYTES && available - (RAW_MARKER_BYTES - 1) > scanFrom)
+                scanFrom = available - (RAW_MARKER_BYTES - 1);
+            return -1;
+        }
+
+        // Runs of zero pixels turn up inside the image too, a real marker has another one a stride later
+        unsigned int next = found + RAW_ROW_BYTES;
+        if (next + RAW_MARKER_BYTES <= available)
+        {
+            if (IsMarker(data + next))
+                return found;
+            scanFrom = found + 1;
+            continue;
+        }
+        if (finishing)
+            return found; // Last row of the frame, nothing left to confirm it with
+
+        scanFrom = found; // Check again once more data is in
+        return -1;
+    }
+}
+
+int RowDecoder::Feed(unsigned int available)
+{
+    if (data == NULL || available < this->available)
+        return rowStarts.size();
+    this->available = available;
+
+    while (rowStarts.size() < RAW_FRAME_ROWS)
+    {
+        if (!synced)
+        {
+            int found = this->Search();
+            if (found < 0)
+                break;
+            if (havePrevious)
+                this->ResolveGap(previous, found, false);
+            synced = true;
+            havePrevious = false;
+            pos = found;
+        }
+
+        // Rows are a fixed stride apart, only scan when the marker is not where it should be.
+        // A row is emitted once the marker after it shows it has the right length.
+        unsigned int next = pos + RAW_ROW_BYTES;
+        if (next + RAW_MARKER_BYTES > available)
+            break;
+        if (!IsMarker(data + next))
+        {
+            integrity.resyncs++;
+            synced = false;
+            havePrevious = true;
+            previous = pos;
+            scanFrom = pos + RAW_MARKER_BYTES + 1;
+            continue;
+        }
+
+        this->Emit(pos, ROW_OK);
+        pos = next;
+    }
+
+    return rowStarts.size();
+}
+
+// Places the rows between the marker at start and end, which is the next marker or the end of the frame
+void RowDecoder::ResolveGap(unsigned int start, unsigned int end, bool last)
+{
+    // Rows leading up to end that have their own marker are whole, the damage is before them
+    unsigned int intact = end;
+    while (intact >= start + 2 * RAW_ROW_BYTES && IsMarker(data + intact - RAW_ROW_BYTES))
+        intact -= RAW_ROW_BYTES;
+
+    unsigned int length = intact - start;
+    if (length % RAW_ROW_BYTES == 0)
+    {
+        // Only the markers were hit, the rows themselves are the right length
+        for (unsigned int row=start; row<intact; row += RAW_ROW_BYTES)
+            this->Emit(row, ROW_OK);
+    }
+    else
+    {
+        // Lost or extra packets, the nearest whole number of rows were sent
+        unsigned int rows = (length + RAW_ROW_BYTES / 2) / RAW_ROW_BYTES;
+        if (rows * RAW_ROW_BYTES > length)
+            integrity.bytesDropped += rows * RAW_ROW_BYTES - length;
+        else if (rows == 0 && last)
+            tailBytes = length; // Start of a row cut off by the end of the frame
+        else
+            integrity.bytesExtra += length - rows * RAW_ROW_BYTES;
+
+        for (unsigned int i=0; i<rows; i++)
+            this->Emit(start + i * RAW_ROW_BYTES, ROW_DAMAGED);
+    }
+
+    for (unsigned int row=intact; row<end; row += RAW_ROW_BYTES)
+        this->Emit(row, ROW_OK);
+}
+
+int RowDecoder::Finish(unsigned int size)
+{
+    finishing = true;
+    this->Feed(size);
+    if (data != NULL && rowStarts.size() < RAW_FRAME_ROWS)
+    {
+        if (synced)
+            this->ResolveGap(pos, size, true);
+        else if (havePrevious)
+            this->ResolveGap(previous, size, true);
+        synced = false;
+        havePrevious = false;
+    }
+
+    int rowCount = rowStarts.size();
+    if (expectedRows > rowCount)
+    {
+        integrity.rowsMissing = expectedRows - rowCount;
+        integrity.bytesDropped += integrity.rowsMissing * RAW_ROW_BYTES - tailBytes;
+    }
+    else
+        integrity.bytesExtra += tailBytes;
+
+    if (image == NULL)
+        return rowCount;
+
+    for (int row=0; row<rowCount; row++)
+    {
+        if (rowStates[row] != ROW_DAMAGED)
+            continue;
+        this->Repair(row);
+
+        int field;
+        int y = this->ImageRow(row, &field);
+        if (statistics != NULL && y >= 0)
+            statistics->AddRow(image + (size_t)y * layout.width, y, field);
+    }
+
+    for (int y=0; y<layout.height; y++)
+    {
+        int row = this->SourceRow(y);
+        if (row < 0 || row >= rowCount)
+            memset(image + (size_t)y * layout.width, 0, layout.width * sizeof(uint16_t));
+    }
+
+    return rowCount;
+}
+
+// Raw row that lands on image row y, -1 for rows with no source
+int RowDecoder::SourceRow(int y)
+{
+    for (int i=0; i<layout.fieldCount; i++)
+    {
+        const struct FieldLayout& field = layout.fields[i];
+        int offset = y - field.imageRow;
+        if (offset < 0 || offset % field.rowStep != 0)
+            continue;
+        int row = field.firstRow + offset / field.rowStep;
+        if (row <= field.lastRow)
+            return row;
+    }
+    return -1;
+}
+
+// Image row a raw row lands on, -1 for blanking
+int RowDecoder::ImageRow(int row, int* field)
+{
+    for (int i=0; i<layout.fieldCount; i++)
+    {
+        const struct FieldLayout& f = layout.fields[i];
+        if (row < f.firstRow || row > f.lastRow)
+            continue;
+        int y = f.imageRow + (row - f.firstRow) * f.rowStep;
+        *field = i;
+        return (y < layout.height) ? y : -1;
+    }
+    return -1;
+}
+
+void RowDecoder::Emit(unsigned int start, rowState state)
+{
+    if (rowStarts.size() >= RAW_FRAME_ROWS)
+        return;
+    int row = rowStarts.size();
+    rowStarts.push_back(start);
+    rowStates.push_back(state);
+    if (state == ROW_DAMAGED)
+        integrity.rowsRepaired++;
+
+    int field;
+    int y = (image != NULL) ? this->ImageRow(row, &field) : -1;
+    if (y < 0)
+        return;
+
+    uint16_t* dst = image + (size_t)y * layout.width;
+    if (start + RAW_ROW_BYTES > available)
+    {
+        memset(dst, 0, layout.width * sizeof(uint16_t)); // Cut off by the end of the frame
+        return;
+    }
+
+    // Bias from the black columns, then the light pixels in the same pass
+    const struct FieldLayout& f = layout.fields[field];
+    const unsigned char* src = data + start;
+    unsigned int bias = 0;
+    if (f.biasEnd > f.biasStart)
+    {
+        unsigned int sum = 0;
+        for (int x=f.biasStart; x<f.biasEnd; x++)
+            sum += src[x*2] | (src[x*2 + 1] << 8);
+        bias = (sum + (f.biasEnd - f.biasStart) / 2) / (f.biasEnd - f.biasStart);
+    }
+
+    uint16_t* out = dst;
+    unsigned int pixels = layout.width;
+    if (layout.columnBinning > 1)
+    {
+        pixels *= layout.columnBinning;
+        unbinned.resize(pixels);
+        out = &unbinned[0];
+    }
+
+    int pedestal = 0;
+    if (bias == 0 && layout.pedestal == 0)
+        decoder->DecodeRow(src + f.frontPorch * 2, out, pixels);
+    else
+    {
+        decoder->DecodeRow(src + f.frontPorch * 2, out, pixels, bias, layout.pedestal);
+        pedestal = layout.pedestal;
+    }
+
+    // 2x2 rows are summed on the sensor, the columns are added here with the pedestal kept once
+    if (layout.columnBinning > 1)
+    {
+        for (int x=0; x<layout.width; x++)
+        {
+            int sum = out[x*2] + out[x*2 + 1] - pedestal;
+            dst[x] = (sum < 0) ? 0 : (sum > 0xFFFF) ? 0xFFFF : sum;
+        }
+    }
+
+    // Damaged rows are counted once Finish has repaired them
+    if (statistics != NULL && state == ROW_OK)
+        statistics->AddRow(dst, y, field);
+}
+
+void RowDecoder::Repair(int row)
+{
+    int field;
+    int y = this->ImageRow(row, &field);
+    if (y < 0)
+        return;
+
+    // Two image rows away is the same colour in the Bayer pattern
+    int height = layout.height;
+    unsigned int width = layout.width;
+    const uint16_t* neighbours[2] = { NULL, NULL };
+    for (int i=0; i<2; i++)
+    {
+        int ny = (i == 0) ? y - 2 : y + 2;
+        if (ny < 0 || ny >= height)
+            continue;
+        int source = this->SourceRow(ny);
+        if (source >= 0 && source < (int)rowStarts.size() && rowStates[source] == ROW_OK)
+            neighbours[i] = image + (size_t)ny * width;
+    }
+
+    uint16_t* dst = image + (size_t)y * width;
+    if (neighbours[0] && neighbours[1])
+    {
+        for (unsigned int x=0; x<width; x++)
+            dst[x] = (uint16_t)((neighbours[0][x] + neighbours[1][x] + 1) >> 1);
+    }
+    else if (neighbours[0] || neighbours[1])
+        memcpy(dst, neighbours[0] ? neighbours[0] : neighbours[1], width * sizeof(uint16_t));
+}
+
+int RowDecoder::GetRowCount()
+{
+    return rowStarts.size();
+}
+
+const unsigned int* RowDecoder::GetRowStarts()
+{
+    return rowStarts.data();
+}
+
+struct FrameIntegrity RowDecoder::GetIntegrity()
+{
+    integrity.rowsFound = rowStarts.size();
+    return integrity;
+}
@@ -0,0 +1,170 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_RAWDECODER_H__
+#define __OPEN_SSPRO_RAWDECODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "framestats.h"
+
+// Raw download layout, every row starts with 9 zero pixels and holds 3110 little endian pixels
+#define RAW_ROW_BYTES    6220
+#define RAW_ROW_PIXELS   3110
+#define RAW_MARKER_BYTES 18
+#define RAW_FIELD_ROWS   1017 // Rows per field, a full 1x1 frame sends two fields back to back
+#define RAW_FRAME_ROWS   (RAW_FIELD_ROWS * 2)
+#define RAW_BLANKING_ROWS 5   // Rows per field around the light rows, 3 before and 2 after
+#define RAW_BLANKING_ROWS_BINNED 6 // Same for the 2x2 field, 3 before and 3 after
+
+// Light sensitive area from the datasheet, what LAYOUT_EFFECTIVE produces
+#define EFFECTIVE_WIDTH  3040
+#define EFFECTIVE_HEIGHT 2024
+
+namespace OpenSSPRO
+{
+    enum DecodeKernel
+    {
+        DECODE_SCALAR = 0,
+        DECODE_SSE2 = 1,
+        DECODE_AVX2 = 2,
+        DECODE_NEON = 3
+    };
+
+    enum LayoutMode
+    {
+        LAYOUT_EFFECTIVE = 0,  // 3040x2024 light pixels, fields interlaced, row bias subtracted
+        LAYOUT_INTERLACED = 1, // 3040x2028 as the original parseRawImage wrote it, no bias correction
+        LAYOUT_FULL = 2        // 3110x2034, both fields interlaced with the markers and black columns kept
+    };
+
+    // Part of the sensor to read out, in binned pixels of the LAYOUT_EFFECTIVE image. A zero width
+    // or height is the whole sensor
+    struct Subframe {
+        int x;
+        int y;
+        int width;
+        int height;
+        int binning; // 1, or 2 for the camera's 2x2 mono mode
+    };
+
+    // Where one field of the download lands in the image
+    struct FieldLayout {
+        int firstRow;   // Raw rows firstRow..lastRow hold image data, counted from the start of the frame
+        int lastRow;
+        int imageRow;   // Image row for firstRow
+        int rowStep;    // Image rows between consecutive raw rows, 2 when two fields are interlaced
+        int frontPorch; // Pixels skipped at the start of each row, including the marker
+        int biasStart;  // Black columns biasStart..biasEnd-1 give the row's bias level, none when equal
+        int biasEnd;
+    };
+
+    // Parameter table for the single pass decode, other readout modes only change the numbers
+    struct FrameLayout {
+        int width;
+        int height;
+        int rawRows;    // Rows the camera sends for this frame
+        int fieldCount;
+        struct FieldLayout fields[2];
+        int pedestal;   // Added back after the bias is removed so noise below it is not clipped
+        int columnBinning; // Light pixels summed into each image pixel across a row, 1 or 2
+    };
+
+    // Row sync results for one frame
+    struct FrameIntegrity {
+        unsigned int rowsFound;    // Rows placed in the image, including repaired ones
+        unsigned int rowsRepaired; // Short, long or misplaced rows, filled from the rows around them
+        unsigned int rowsMissing;  // Expected rows that never arrived, left at zero
+        unsigned int bytesDropped; // Bytes lost from damaged rows or the end of the frame
+        unsigned int bytesExtra;   // Bytes that did not fit any row
+        unsigned int resyncs;      // Times a marker was not where the stride put it
+    };
+
+    // Turns a raw download into contiguous 16 bit pixels
+    class RawDecoder
+    {
+    private:
+        DecodeKernel kernel;
+
+    public:
+        RawDecoder(); // Picks the fastest kernel this CPU supports
+
+        static DecodeKernel BestKernel();
+        static const char* KernelName(DecodeKernel kernel);
+        bool SetKernel(DecodeKernel kernel); // False if the CPU or build lacks it
+        DecodeKernel GetKernel();
+
+        static struct FrameLayout Layout(LayoutMode mode);
+        static struct FrameLayout Layout(LayoutMode mode, const struct Subframe& subframe); // Fitted first
+        static struct Subframe Fit(const struct Subframe& subframe); // Clamped to the sensor, even for 1x1 to keep the Bayer phase
+        static int BlankingRows(int binning); // Rows the camera adds to each field around the light rows
+
+        // Offsets of the row markers, rows are RAW_ROW_BYTES apart with a rescan when a marker goes missing
+        int FindRows(const unsigned char* data, unsigned int size, unsigned int* starts, int maxRows);
+        void DecodeRow(const unsigned char* src, uint16_t* dst, unsigned int pixels);
+        void DecodeRow(const unsigned char* src, uint16_t* dst, unsigned int pixels, uint16_t bias, uint16_t pedestal);
+
+        // Sync, de-interlace, bias and crop in one pass over the download. Missing rows are zeroed.
+        // Returns the number of rows found, stats are gathered in the same pass when given
+        int Decode(const unsigned char* data, unsigned int size, uint16_t* image, const struct FrameLayout& layout,
+                   struct FrameIntegrity* integrity = NULL, struct FrameStats* stats = NULL);
+    };
+
+    // Decodes rows while the download is still filling the frame buffer. Call Feed() each time more
+    // bytes land, a row is written to the image once the marker after it has arrived.
+    class RowDecoder
+    {
+    private:
+        enum rowState { ROW_OK, ROW_DAMAGED };
+
+        RawDecoder* decoder;
+        const unsigned char* data;
+        uint16_t* image;  // NULL to only find rows
+        struct FrameLayout layout;
+        int expectedRows; // 0 when unknown
+        std::vector<unsigned int> rowStarts;   // Both capped at RAW_FRAME_ROWS
+        std::vector<unsigned char> rowStates;
+        unsigned int available;
+        bool finishing;
+        unsigned int tailBytes; // Partial row at the end of the frame
+        struct FrameIntegrity integrity;
+        std::vector<uint16_t> unbinned; // One row before columns are summed
+        FrameStatistics* statistics; // NULL when not gathering
+
+        // Sync state. When synced, pos is a confirmed row start that has not been emitted yet.
+        // Otherwise previous is the last row start and the marker search resumes at scanFrom.
+        bool synced;
+        bool havePrevious;
+        unsigned int pos;
+        unsigned int previous;
+        unsigned int scanFrom;
+
+        int Search();
+        void ResolveGap(unsigned int start, unsigned int end, bool last);
+        void Emit(unsigned int start, rowState state);
+        void Repair(int row);
+        int SourceRow(int y);
+        int ImageRow(int row, int* field);
+
+    public:
+        RowDecoder(RawDecoder* decoder);
+
+        void SetStatistics(FrameStatistics* statistics); // Fed every image row from the next Begin, NULL for none
+
+        void Begin(const unsigned char* data, uint16_t* image, const struct FrameLayout* layout); // NULL layout only finds rows
+        int Feed(unsigned int available); // Bytes of data valid so far, returns the rows placed
+        int Finish(unsigned int size);    // Last Feed(), repairs damaged rows and zeroes missing ones
+
+        int GetRowCount();
+        const unsigned int* GetRowStarts();
+        struct FrameIntegrity GetIntegrity();
+    };
+}
+
+#endif /* __OPEN_SSPRO_RAWDECODER_H__ */
@@ -0,0 +1,472 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  replaytransport.cpp - Offline camera, replays USBPcap captures or simulates the
+                        protocol so the driver can run without hardware
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <libusb-1.0/libusb.h>
+
+#include "opensspro.h"
+#include "protocol.h"
+#include "replaytransport.h"
+#include "rawdecoder.h"
+
+#define PCAPNG_SECTION_HEADER   0x0A0D0D0A
+#define PCAPNG_INTERFACE        0x00000001
+#define PCAPNG_ENHANCED_PACKET  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPTION_TSRESOL   9
+#define LINKTYPE_USBPCAP        249
+
+#define USBPCAP_HEADER_LENGTH   27
+#define USBPCAP_INFO_PDO_TO_FDO 0x01 // Completion, carries the IN data
+#define USBPCAP_TRANSFER_BULK   0x03
+
+#define REPLAY_CHUNK_SIZE (256*1024) // Same as the default URB size
+#define SIM_BIAS          0x0128
+#define SIM_NOISE_MASK    0x003F
+
+using namespace OpenSSPRO;
+
+static unsigned int ReadU16(const unsigned char* data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static unsigned int ReadU32(const unsigned char* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24);
+}
+
+ReplayTransport::ReplayTransport()
+{
+    cursor = 0;
+    anchor = -1;
+    simulating = false;
+    speed = 1.0;
+    framePending = false;
+    frameRows = RAW_FIELD_ROWS;
+    fields = 2;
+    exposing = false;
+    noise = 1;
+    unplugged = false;
+    replugAt = 0;
+}
+
+bool ReplayTransport::Load(const char* fileName)
+{
+    DEBUG("Loading USB capture %s...", fileName);
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL)
+    {
+        ERROR("Failed to open %s\n", fileName);
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    unsigned char chunk[65536];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data.insert(data.end(), chunk, chunk + count);
+    fclose(file);
+
+    exchanges.clear();
+    if (!this->Parse(data) || exchanges.empty())
+    {
+        ERROR("No camera traffic found in %s\n", fileName);
+        exchanges.clear();
+        return false;
+    }
+    cursor = 0;
+    anchor = -1;
+    DEBUG("Done (%d exchanges)\n", (int)exchanges.size());
+    return true;
+}
+
+bool ReplayTransport::Parse(const std::vector<unsigned char>& file)
+{
+    std::vector<double> resolutions; // Seconds per timestamp tick, per interface
+    double firstTime = -1.0;
+    exchange* current = NULL;
+
+    size_t offset = 0;
+    while (offset + 12 <= file.size())
+    {
+        const unsigned char* block = &file[offset];
+        unsigned int type = ReadU32(block);
+        unsigned int length = ReadU32(block + 4);
+        if (length < 12 || (length % 4) != 0 || offset + length > file.size())
+        {
+            ERROR("Corrupt pcapng block at offset %lu\n", (unsigned long)offset);
+            return false;
+        }
+        const unsigned char* body = block + 8;
+        unsigned int bodyLength = length - 12;
+        offset += length;
+
+        if (type == PCAPNG_SECTION_HEADER)
+        {
+            if (bodyLength < 4 || ReadU32(body) != PCAPNG_BYTE_ORDER_MAGIC)
+            {
+                ERROR("Only little endian pcapng files are supported\n");
+                return false;
+            }
+            resolutions.clear(); // Interface numbering restarts with every section
+        }
+        else if (type == PCAPNG_INTERFACE && bodyLength >= 8)
+        {
+            double resolution = 1e-6;
+            if (ReadU16(body) != LINKTYPE_USBPCAP)
+                resolution = -1.0; // Not USB, its packets get skipped
+            for (unsigned int i=8; resolution > 0.0 && i + 4 <= bodyLength; )
+            {
+                unsigned int code = ReadU16(body + i);
+                unsigned int size = ReadU16(body + i + 2);
+                if (code == 0)
+                    break;
+                if (code == PCAPNG_OPTION_TSRESOL && size >= 1)
+                {
+                    unsigned char value = body[i + 4];
+                    double base = (value & 0x80) ? 2.0 : 10.0;
+                    resolution = 1.0;
+                    for (int j=0; j<(value & 0x7F); j++)
+                        resolution /= base;
+                }
+                i += 4 + ((size + 3) & ~3);
+            }
+            resolutions.push_back(resolution);
+        }
+        else if (type == PCAPNG_ENHANCED_PACKET && bodyLength >= 20)
+        {
+            unsigned int interface = ReadU32(body);
+            if (interface >= resolutions.size() || resolutions[interface] < 0.0)
+                continue;
+            unsigned long long ticks = ((unsigned long long)ReadU32(body + 4) << 32) | ReadU32(body + 8);
+            unsigned int captured = ReadU32(body + 12);
+            if (captured + 20 > bodyLength || captured < USBPCAP_HEADER_LENGTH)
+                continue;
+            const unsigned char* packet = body + 20;
+
+            unsigned int headerLength = ReadU16(packet);
+            unsigned char info = packet[16];
+            unsigned char endpoint = packet[21];
+            unsigned char transfer = packet[22];
+            unsigned int dataLength = ReadU32(packet + 23);
+            if (transfer != USBPCAP_TRANSFER_BULK || headerLength > captured || dataLength == 0)
+                continue;
+            if (dataLength > captured - headerLength)
+                dataLength = captured - headerLength;
+            const unsigned char* payload = packet + headerLength;
+
+            double time = ticks * resolutions[interface];
+            if (firstTime < 0.0)
+                firstTime = time;
+
+            if (endpoint == USB_CMD_ENDPOINT && !(info & USBPCAP_INFO_PDO_TO_FDO))
+            {
+                if (dataLength != CMD_LENGTH || payload[0] != START_BYTE)
+                    continue;
+                exchange next;
+                next.time = time - firstTime;
+                memcpy(next.command, payload, CMD_LENGTH);
+                exchanges.push_back(next);
+                current = &exchanges.back();
+            }
+            else if (endpoint == USB_RX_ENDPOINT && (info & USBPCAP_INFO_PDO_TO_FDO) && current != NULL)
+            {
+                if (current->result.empty())
+                {
+                    if (dataLength == RESULT_LENGTH && payload[0] == START_BYTE)
+                        current->result.assign(payload, payload + dataLength);
+                }
+                else if (current->command[1] == USB_REQ_DOWNLOAD)
+                    current->frame.insert(current->frame.end(), payload, payload + dataLength);
+            }
+        }
+    }
+
+    return true;
+}
+
+void ReplayTransport::SetSpeed(double factor)
+{
+    speed = (factor > 0.0) ? factor : 1.0;
+}
+
+int ReplayTransport::GetExchangeCount()
+{
+    return exchanges.size();
+}
+
+double ReplayTransport::Elapsed(clock::time_point since)
+{
+    return std::chrono::duration<double>(clock::now() - since).count() * speed;
+}
+
+bool ReplayTransport::GetRecordedCommand(unsigned char cmd, unsigned char* command)
+{
+    for (size_t i=0; i<exchanges.size(); i++)
+    {
+        if (exchanges[i].command[1] == cmd)
+        {
+            memcpy(command, exchanges[i].command, CMD_LENGTH);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReplayTransport::GetSentCommand(unsigned char cmd, unsigned char* command)
+{
+    std::map<unsigned char, std::vector<unsigned char> >::iterator found = sentCommands.find(cmd);
+    if (found == sentCommands.end())
+        return false;
+    memcpy(command, found->second.data(), CMD_LENGTH);
+    return true;
+}
+
+bool ReplayTransport::Open()
+{
+    cursor = 0;
+    anchor = -1;
+    simulating = false;
+    anchorTime = clock::now();
+    results.clear();
+    sentCommands.clear();
+    framePending = false;
+    exposing = false;
+    return true;
+}
+
+void ReplayTransport::Close()
+{
+    results.clear();
+    pendingFrame.clear();
+    framePending = false;
+}
+
+void ReplayTransport::Unplug(int ms)
+{
+    replugAt = (clock::now() + std::chrono::microseconds((long long)(ms * 1000.0 / speed))).time_since_epoch().count();
+    unplugged = true;
+}
+
+bool ReplayTransport::IsAttached()
+{
+    return !unplugged;
+}
+
+bool ReplayTransport::Reconnect(int timeoutMs)
+{
+    if (unplugged)
+    {
+        clock::time_point replug = clock::time_point(clock::duration(replugAt.load()));
+        if (replug > clock::now() + std::chrono::milliseconds(timeoutMs))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return false;
+        }
+        std::this_thread::sleep_until(replug);
+        unplugged = false;
+    }
+    // A camera back from a power cycle has forgotten any exposure
+    exposing = false;
+    pendingFrame.clear();
+    return this->Open();
+}
+
+int ReplayTransport::Match(unsigned char cmd)
+{
+    for (int i=cursor; i<(int)exchanges.size(); i++)
+        if (exchanges[i].command[1] == cmd && !exchanges[i].result.empty())
+            return i;
+    return -1;
+}
+
+int ReplayTransport::MatchStatus()
+{
+    // Status answers come from the recording between the last matched command and the next one,
+    // picked by how much time has passed since that command was replayed
+    int first = (anchor < 0) ? 0 : anchor + 1;
+    int last = cursor;
+    while (last < (int)exchanges.size() && exchanges[last].command[1] == USB_REQ_STATUS)
+        last++;
+
+    double start = (anchor < 0) ? 0.0 : exchanges[anchor].time;
+    double now = start + this->Elapsed(anchorTime);
+
+    int found = -1;
+    for (int i=first; i<last; i++)
+    {
+        if (exchanges[i].command[1] != USB_REQ_STATUS || exchanges[i].result.empty())
+            continue;
+        if (found < 0 || exchanges[i].time <= now)
+            found = i;
+        if (exchanges[i].time > now)
+            break;
+    }
+    return found;
+}
+
+int ReplayTransport::Send(unsigned char* data, int length, int* sent, unsigned int)
+{
+    if (unplugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (length != CMD_LENGTH || data[0] != START_BYTE)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    *sent = length;
+
+    unsigned char cmd = data[1];
+    sentCommands[cmd].assign(data, data + length);
+    if (cmd == USB_REQ_SET_FRAME)
+        frameRows = (data[4] << 8) | data[5]; // Simulated downloads follow it even when the capture answered
+    // Recorded status would describe what the camera did next in the capture, not what the simulation
+    // was just asked to do, e.g. hide an exposure the capture never had
+    int index = -1;
+    if (cmd != USB_REQ_STATUS)
+        index = this->Match(cmd);
+    else if (!simulating)
+        index = this->MatchStatus();
+    if (cmd != USB_REQ_STATUS)
+        simulating = (index < 0);
+    if (index < 0)
+    {
+        this->Simulate(data);
+        return LIBUSB_SUCCESS;
+    }
+
+    exchange& recorded = exchanges[index];
+    if (cmd != USB_REQ_STATUS)
+    {
+        cursor = index + 1;
+        anchor = index;
+        anchorTime = clock::now();
+    }
+    results.push_back(recorded.result);
+
+    if (cmd == USB_REQ_DOWNLOAD)
+    {
+        pendingFrame = recorded.frame;
+        framePending = true;
+        exposing = false;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void ReplayTransport::Simulate(const unsigned char* command)
+{
+    unsigned char result[RESULT_LENGTH] = { START_BYTE, 0x00, command[1], 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    switch (command[1])
+    {
+        case USB_REQ_STATUS:
+            if (exposing)
+                result[4] = (clock::now() < exposureEnd) ? 0x01 : 0x02;
+            result[6] = 0xBE;
+            break;
+        case USB_REQ_CAPTURE:
+        {
+            // Bit 0 of the first byte selects 0.1 s units over milliseconds
+            unsigned int value = (command[3] << 8) | command[4];
+            double ms = (command[2] & 0x01) ? value * 100.0 : value;
+            fields = (command[5] == CAPTURE_FULL) ? 2 : 1; // One field alone for a short exposure, or 2x2
+            exposing = true;
+            exposureEnd = clock::now() + std::chrono::microseconds((long long)(ms * 1000.0 / speed));
+            result[4] = 0x01;
+            break;
+        }
+        case USB_REQ_DOWNLOAD:
+            if (exposing && clock::now() >= exposureEnd)
+            {
+                this->SimulateFrame();
+                result[4] = 0x01;
+            }
+            exposing = false;
+            break;
+        case USB_REQ_ABORT:
+            exposing = false;
+            break;
+        default:
+            break;
+    }
+
+    results.push_back(std::vector<unsigned char>(result, result + RESULT_LENGTH));
+}
+
+void ReplayTransport::SimulateFrame()
+{
+    // Both fields back to back for 1x1, otherwise the one field asked for
+    unsigned int rows = frameRows * fields;
+    pendingFrame.resize(rows * RAW_ROW_BYTES);
+    unsigned char* row = pendingFrame.data();
+    for (unsigned int r=0; r<rows; r++, row += RAW_ROW_BYTES)
+    {
+        memset(row, 0, RAW_MARKER_BYTES);
+        for (unsigned int i=RAW_MARKER_BYTES; i<RAW_ROW_BYTES; i += 2)
+        {
+            noise = noise * 1103515245 + 12345;
+            unsigned int pixel = SIM_BIAS + ((noise >> 16) & SIM_NOISE_MASK);
+            row[i] = pixel & 0xFF;
+            row[i + 1] = pixel >> 8;
+        }
+    }
+    framePending = true;
+}
+
+int ReplayTransport::Receive(unsigned char* data, int length, int* received, unsigned int)
+{
+    *received = 0;
+    if (unplugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (results.empty())
+        return LIBUSB_ERROR_TIMEOUT;
+
+    std::vector<unsigned char> result = results.front();
+    results.pop_front();
+    if ((int)result.size() > length)
+        return LIBUSB_ERROR_OVERFLOW;
+    memcpy(data, result.data(), result.size());
+    *received = result.size();
+    return LIBUSB_SUCCESS;
+}
+
+int ReplayTransport::ReceiveFrame(unsigned char* buffer, unsigned int capacity, unsigned int* received,
+                                  ReceiveProgress progress, void* context)
+{
+    *received = 0;
+    if (unplugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (!framePending)
+        return LIBUSB_ERROR_TIMEOUT;
+
+    unsigned int size = pendingFrame.size();
+    if (size > capacity)
+        size = capacity; // Same as the URB queue, data past the buffer is dropped
+    // Handed over in URB sized pieces so streaming consumers see the same pattern as over USB
+    for (unsigned int done=0; done<size; )
+    {
+        if (unplugged)
+        {
+            *received = done;
+            framePending = false;
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+        unsigned int length = size - done;
+        if (length > REPLAY_CHUNK_SIZE)
+            length = REPLAY_CHUNK_SIZE;
+        memcpy(buffer + done, pendingFrame.data() + done, length);
+        done += length;
+        if (progress)
+            progress(done, context);
+    }
+    *received = size;
+    framePending = false;
+    return LIBUSB_SUCCESS;
+}
@@ -0,0 +1,90 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_REPLAYTRANSPORT_H__
+#define __OPEN_SSPRO_REPLAYTRANSPORT_H__
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <atomic>
+
+#include "transport.h"
+
+namespace OpenSSPRO
+{
+    // Stands in for the camera, either replaying a USBPcap capture (usb-logs/*.pcapng) or simulating one.
+    // Commands that are not in the capture, or every command when nothing was loaded, get simulated answers.
+    class ReplayTransport : public Transport
+    {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct exchange {
+            double time;                       // Seconds since the first packet of the capture
+            unsigned char command[6];
+            std::vector<unsigned char> result; // Empty if the capture has no answer
+            std::vector<unsigned char> frame;  // Image data that followed a download
+        };
+
+        std::vector<exchange> exchanges;
+        int cursor;      // Next recorded exchange a non status command may match
+        int anchor;      // Last matched non status exchange, -1 before the first one
+        clock::time_point anchorTime;
+        bool simulating; // The last non status command had no recorded match, status comes from the simulation
+        double speed;
+
+        std::deque<std::vector<unsigned char> > results;
+        std::map<unsigned char, std::vector<unsigned char> > sentCommands; // Last command of each type
+        std::vector<unsigned char> pendingFrame;
+        bool framePending;
+
+        // Simulated camera state
+        unsigned int frameRows;   // Rows per field from the last SET_FRAME
+        unsigned int fields;      // Fields read out, 2 for a full 1x1 frame. Set by the capture command
+        bool exposing;
+        clock::time_point exposureEnd;
+        unsigned int noise;
+
+        // Simulated unplug, set from any thread
+        std::atomic<bool> unplugged;
+        std::atomic<long long> replugAt; // clock ticks since its epoch
+
+        bool Parse(const std::vector<unsigned char>& file);
+        int Match(unsigned char cmd);
+        int MatchStatus();
+        void Simulate(const unsigned char* command);
+        void SimulateFrame();
+        double Elapsed(clock::time_point since);
+
+    public:
+        ReplayTransport();
+
+        bool Load(const char* fileName); // USBPcap pcapng, false if it holds no camera traffic
+        void SetSpeed(double factor);    // Run recorded and simulated time this many times faster than real time
+        int GetExchangeCount();
+        void Unplug(int ms);             // Drops off the bus now and comes back after ms, in simulated time
+
+        // The 6 command bytes, false if there was none of the type. For checking what the driver sends
+        bool GetRecordedCommand(unsigned char cmd, unsigned char* command); // First one in the capture
+        bool GetSentCommand(unsigned char cmd, unsigned char* command);     // Last one sent since Open
+
+        bool Open();
+        void Close();
+
+        bool IsAttached();
+        bool Reconnect(int timeoutMs);
+
+        int Send(unsigned char* data, int length, int* sent, unsigned int timeout);
+        int Receive(unsigned char* data, int length, int* received, unsigned int timeout);
+        int ReceiveFrame(unsigned char* buffer, unsigned int capacity, unsigned int* received,
+                         ReceiveProgress progress, void* context);
+    };
+}
+
+#endif /* __OPEN_SSPRO_REPLAYTRANSPORT_H__ */
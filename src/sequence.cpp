@@ -0,0 +1,219 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  sequence.cpp - Back to back captures with download and processing overlapped
+                 with the next exposure
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "sequence.h"
+
+#define DEFAULT_QUEUE_DEPTH 1
+
+using namespace OpenSSPRO;
+
+Sequencer::Sequencer(SSPRO* camera)
+{
+    this->camera = camera;
+    frameCallback = NULL;
+    frameContext = NULL;
+    queueDepth = DEFAULT_QUEUE_DEPTH;
+    aborted = false;
+    producing = false;
+    wallTime = 0.0;
+    shutterTime = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &sequenceStart);
+}
+
+void Sequencer::SetFrameCallback(SequenceFrameCallback callback, void* context)
+{
+    frameCallback = callback;
+    frameContext = context;
+}
+
+void Sequencer::SetQueueDepth(int depth)
+{
+    queueDepth = (depth < 1) ? 1 : depth;
+}
+
+double Sequencer::Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - sequenceStart.tv_sec) + (now.tv_nsec - sequenceStart.tv_nsec) / 1e9;
+}
+
+bool Sequencer::Run(const std::vector<SequenceStep>& steps)
+{
+    std::vector<SequenceStep> frames; // One entry per exposure
+    for (size_t i=0; i<steps.size(); i++)
+        for (int j=0; j<steps[i].count; j++)
+            frames.push_back(steps[i]);
+    if (frames.empty())
+        return true;
+
+    // One frame downloading, queueDepth waiting and one being processed. With fewer, a slow
+    // callback would fail the download instead of holding the sequence back
+    int buffers = queueDepth + 2;
+    if (camera->GetFramePoolSize() < buffers && !camera->SetFramePoolSize(buffers))
+    {
+        ERROR("Sequence needs %d frame buffers\n", buffers);
+        return false;
+    }
+
+    DEBUG("Starting sequence of %lu frames...\n", (unsigned long)frames.size());
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        timings.clear();
+        producing = true;
+    }
+    aborted = false;
+    clock_gettime(CLOCK_MONOTONIC, &sequenceStart);
+    std::thread worker(&Sequencer::ProcessFrames, this);
+
+    camera->SetReadoutSpeed(frames[0].readout);
+    bool result = camera->StartCapture(frames[0].exposureMs);
+    double started = this->Now();
+    int attempts = 0;
+    if (!result)
+        result = this->Resume(frames[0], &attempts, &started);
+
+    for (size_t i=0; i<frames.size() && result; )
+    {
+        FrameTiming timing;
+        timing.index = i;
+        timing.exposureMs = frames[i].exposureMs;
+        timing.exposureStart = started;
+
+        if (aborted || !camera->WaitForFrame(camera->GetCaptureTimeout()))
+        {
+            if (this->Resume(frames[i], &attempts, &started))
+                continue;
+            result = false;
+            break;
+        }
+        timing.exposureEnd = this->Now();
+
+        Frame frame = camera->Download();
+        if (!frame.IsValid())
+        {
+            if (this->Resume(frames[i], &attempts, &started))
+                continue;
+            result = false;
+            break;
+        }
+        timing.downloadEnd = this->Now();
+        timing.processEnd = 0.0;
+        attempts = 0;
+
+        // Get the shutter open again before anything else touches this frame
+        if (i+1 < frames.size() && !aborted)
+        {
+            camera->SetReadoutSpeed(frames[i+1].readout);
+            bool capturing = camera->StartCapture(frames[i+1].exposureMs);
+            started = this->Now();
+            if (!capturing && !this->Resume(frames[i+1], &attempts, &started))
+                result = false; // Still hand this frame over
+        }
+
+        std::unique_lock<std::mutex> guard(queueLock);
+        while ((int)queue.size() >= queueDepth)
+            queueChanged.wait(guard); // Backpressure, processing is slower than exposing
+
+        timings.push_back(timing);
+        pendingFrame pending;
+        pending.frame = std::move(frame);
+        pending.timing = timings.size() - 1;
+        queue.push_back(std::move(pending));
+        queueChanged.notify_all();
+        i++;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        producing = false;
+    }
+    queueChanged.notify_all();
+    worker.join();
+
+    wallTime = this->Now();
+    shutterTime = 0.0;
+    for (size_t i=0; i<timings.size(); i++)
+    {
+        const FrameTiming& t = timings[i];
+        shutterTime += t.exposureMs / 1000.0;
+        DEBUG("Frame %d: exposed %.3f-%.3f s, downloaded %.3f s, processed %.3f s\n",
+              t.index, t.exposureStart, t.exposureEnd, t.downloadEnd, t.processEnd);
+    }
+    DEBUG("Sequence %s (%lu of %lu frames, duty cycle %.1f%%)\n", result ? "done" : "stopped",
+          (unsigned long)timings.size(), (unsigned long)frames.size(), this->GetDutyCycle() * 100.0);
+
+    return result;
+}
+
+void Sequencer::ProcessFrames()
+{
+    std::unique_lock<std::mutex> guard(queueLock);
+    while (true)
+    {
+        while (producing && queue.empty())
+            queueChanged.wait(guard);
+        if (queue.empty())
+            break;
+
+        pendingFrame pending = std::move(queue.front());
+        queue.pop_front();
+        queueChanged.notify_all();
+        FrameTiming timing = timings[pending.timing];
+        guard.unlock();
+
+        if (frameCallback)
+            frameCallback(pending.frame, &timing, frameContext);
+        pending.frame.Release();
+
+        guard.lock();
+        timings[pending.timing].processEnd = this->Now();
+    }
+}
+
+// The camera dropped off the bus, wait for it to come back and start this frame over
+bool Sequencer::Resume(const SequenceStep& frame, int* attempts, double* started)
+{
+    while (!aborted && camera->IsDeviceLost() && (*attempts)++ < SEQUENCE_RETRIES)
+    {
+        DEBUG("Camera lost, reconnecting (attempt %d of %d)\n", *attempts, SEQUENCE_RETRIES);
+        if (!camera->Reconnect())
+            return false;
+        camera->SetReadoutSpeed(frame.readout);
+        if (camera->StartCapture(frame.exposureMs))
+        {
+            *started = this->Now();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Sequencer::Abort()
+{
+    aborted = true;
+    camera->CancelCapture(); // Also ends the WaitForFrame the sequence is blocked in
+}
+
+std::vector<FrameTiming> Sequencer::GetTimings()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    return timings;
+}
+
+double Sequencer::GetDutyCycle()
+{
+    if (wallTime <= 0.0)
+        return 0.0;
+    return shutterTime / wallTime;
+}
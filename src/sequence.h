@@ -0,0 +1,88 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_SEQUENCE_H__
+#define __OPEN_SSPRO_SEQUENCE_H__
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#include "opensspro.h"
+
+#define SEQUENCE_RETRIES 3 // Reconnects in a row before a frame is given up on
+
+namespace OpenSSPRO
+{
+    struct SequenceStep {
+        int count;
+        int exposureMs;
+        ReadOutSpeed readout;
+    };
+
+    // Seconds since the start of the sequence
+    struct FrameTiming {
+        int index;
+        int exposureMs;
+        double exposureStart; // Capture command acknowledged
+        double exposureEnd;   // Camera reported the frame ready
+        double downloadEnd;
+        double processEnd;    // Frame callback returned
+    };
+
+    // Runs on the processing thread while the next frame is exposing, the frame goes back to the pool on return
+    typedef void (*SequenceFrameCallback)(Frame& frame, const FrameTiming* timing, void* context);
+
+    // Captures a list of exposures back to back. The next exposure starts as soon as
+    // the previous frame is downloaded, processing happens on its own thread meanwhile.
+    // If the camera drops off the bus the sequence waits for it and retakes the frame it lost.
+    class Sequencer
+    {
+    private:
+        struct pendingFrame {
+            Frame frame;
+            int timing; // Index into timings
+        };
+
+        SSPRO* camera;
+        SequenceFrameCallback frameCallback;
+        void* frameContext;
+        int queueDepth;
+        std::atomic<bool> aborted;
+
+        std::vector<FrameTiming> timings;
+        struct timespec sequenceStart;
+        double wallTime;
+        double shutterTime;
+
+        std::deque<pendingFrame> queue;
+        std::mutex queueLock; // Also guards timings
+        std::condition_variable queueChanged;
+        bool producing;
+
+        void ProcessFrames();
+        bool Resume(const SequenceStep& frame, int* attempts, double* started);
+        double Now();
+
+    public:
+        Sequencer(SSPRO* camera);
+
+        void SetFrameCallback(SequenceFrameCallback callback, void* context);
+        void SetQueueDepth(int depth); // Frames waiting for processing, Run grows the frame pool to depth+2 buffers
+
+        bool Run(const std::vector<SequenceStep>& steps); // Blocking call
+        void Abort();
+
+        std::vector<FrameTiming> GetTimings();
+        double GetDutyCycle(); // Shutter open time divided by wall time of the last run
+    };
+}
+
+#endif /* __OPEN_SSPRO_SEQUENCE_H__ */
@@ -0,0 +1,192 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  starfinder.cpp - Threshold and centroid star detection on a binned luminance
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+#include "starfinder.h"
+
+#define BAND_ROWS          16 // Luminance rows per task
+#define CENTROID_RADIUS    3  // Window around the peak, in luminance pixels
+#define BACKGROUND_STRIDE  7  // Every nth luminance pixel is sampled for the background
+#define MAD_TO_SIGMA       1.4826f
+#define MAX_ELONGATION     9.0f // Ratio of the second moments along the major and minor axes, 3:1 in width
+
+using namespace OpenSSPRO;
+
+static bool Brighter(const struct Star& a, const struct Star& b)
+{
+    return a.flux > b.flux;
+}
+
+StarFinder::StarFinder(ThreadPool* pool)
+{
+    ownsPool = (pool == NULL);
+    this->pool = ownsPool ? new ThreadPool() : pool;
+    binning = 2;
+    threshold = 5.0f;
+    maxStars = 50;
+    lumWidth = 0;
+    lumHeight = 0;
+    background = 0.0f;
+    noise = 0.0f;
+}
+
+StarFinder::~StarFinder()
+{
+    if (ownsPool)
+        delete pool;
+}
+
+void StarFinder::SetBinning(int cells)
+{
+    binning = (cells < 1) ? 1 : cells;
+}
+
+void StarFinder::SetThreshold(float sigma)
+{
+    threshold = sigma;
+}
+
+void StarFinder::SetMaxStars(int count)
+{
+    maxStars = (count < 1) ? 1 : count;
+}
+
+int StarFinder::GetScale()
+{
+    return binning * 2;
+}
+
+float StarFinder::GetBackground()
+{
+    return background;
+}
+
+float StarFinder::GetNoise()
+{
+    return noise;
+}
+
+// Every luminance pixel is the sum of its scale x scale block, whole colour cells so each holds R, G, G and B alike
+void StarFinder::Bin(const uint16_t* raw, int width, int first, int last)
+{
+    int scale = this->GetScale();
+    for (int y=first; y<last; y++)
+    {
+        uint32_t* out = &luminance[(size_t)y * lumWidth];
+        std::fill(out, out + lumWidth, 0);
+        for (int row=0; row<scale; row++)
+        {
+            const uint16_t* in = raw + (size_t)(y * scale + row) * width;
+            for (int x=0; x<lumWidth; x++)
+            {
+                uint32_t sum = 0;
+                for (int i=0; i<scale; i++)
+                    sum += in[x * scale + i];
+                out[x] += sum;
+            }
+        }
+    }
+}
+
+// Median and median absolute deviation of a sample, stars and hot pixels barely move either
+void StarFinder::MeasureBackground()
+{
+    std::vector<float> sample;
+    sample.reserve(luminance.size() / BACKGROUND_STRIDE + 1);
+    for (size_t i=0; i<luminance.size(); i+=BACKGROUND_STRIDE)
+        sample.push_back(luminance[i]);
+
+    size_t middle = sample.size() / 2;
+    std::nth_element(sample.begin(), sample.begin() + middle, sample.end());
+    background = sample[middle];
+    for (size_t i=0; i<sample.size(); i++)
+        sample[i] = fabsf(sample[i] - background);
+    std::nth_element(sample.begin(), sample.begin() + middle, sample.end());
+    noise = std::max(sample[middle] * MAD_TO_SIGMA, 1.0f);
+}
+
+bool StarFinder::Find(const uint16_t* raw, int width, int height, std::vector<struct Star>* stars)
+{
+    stars->clear();
+    int scale = this->GetScale();
+    lumWidth = width / scale;
+    lumHeight = height / scale;
+    if (raw == NULL || lumWidth < 1 || lumHeight < 1)
+        return false;
+
+    luminance.resize((size_t)lumWidth * lumHeight);
+    int bands = (lumHeight + BAND_ROWS - 1) / BAND_ROWS;
+    pool->Run(bands, [&](int band) {
+        int first = band * BAND_ROWS;
+        this->Bin(raw, width, first, std::min(first + BAND_ROWS, lumHeight));
+    });
+    this->MeasureBackground();
+
+    // Local maxima over the level, ties go to the first pixel so a flat top is found once
+    float level = background + threshold * noise;
+    const int r = CENTROID_RADIUS;
+    for (int y=r; y<lumHeight - r; y++)
+    {
+        const uint32_t* row = &luminance[(size_t)y * lumWidth];
+        for (int x=r; x<lumWidth - r; x++)
+        {
+            uint32_t value = row[x];
+            if (value <= level)
+                continue;
+
+            const uint32_t* up = row - lumWidth;
+            const uint32_t* down = row + lumWidth;
+            if (value <= up[x - 1] || value <= up[x] || value <= up[x + 1] || value <= row[x - 1] ||
+                value < row[x + 1] || value < down[x - 1] || value < down[x] || value < down[x + 1])
+                continue;
+
+            double sum = 0.0, sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumYY = 0.0, sumXY = 0.0;
+            for (int j=-r; j<=r; j++)
+            {
+                const uint32_t* window = row + j * lumWidth;
+                for (int i=-r; i<=r; i++)
+                {
+                    float weight = window[x + i] - background;
+                    if (weight <= 0.0f)
+                        continue;
+                    sum += weight;
+                    sumX += weight * i;
+                    sumY += weight * j;
+                    sumXX += weight * i * i;
+                    sumYY += weight * j * j;
+                    sumXY += weight * i * j;
+                }
+            }
+
+            // Satellite and plane trails break up into peaks along a line, stars are round
+            double cx = sumX / sum, cy = sumY / sum;
+            double xx = sumXX / sum - cx * cx, yy = sumYY / sum - cy * cy, xy = sumXY / sum - cx * cy;
+            double root = sqrt((xx - yy) * (xx - yy) / 4.0 + xy * xy);
+            double major = (xx + yy) / 2.0 + root;
+            double minor = (xx + yy) / 2.0 - root;
+            if (major > MAX_ELONGATION * std::max(minor, 0.01))
+                continue;
+
+            struct Star star;
+            star.x = (x + cx + 0.5f) * scale - 0.5f;
+            star.y = (y + cy + 0.5f) * scale - 0.5f;
+            star.flux = sum;
+            star.peak = value - background;
+            stars->push_back(star);
+        }
+    }
+
+    std::sort(stars->begin(), stars->end(), Brighter);
+    if ((int)stars->size() > maxStars)
+        stars->resize(maxStars);
+    return true;
+}
@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_STARFINDER_H__
+#define __OPEN_SSPRO_STARFINDER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "threadpool.h"
+
+namespace OpenSSPRO
+{
+    // Position in frame pixels, 0,0 is the centre of the top left pixel
+    struct Star {
+        float x;
+        float y;
+        float flux; // Sum above the background, in luminance units
+        float peak; // Brightest luminance pixel above the background
+    };
+
+    // Finds stars on a downsampled luminance of a Bayer frame. Each 2x2 colour cell is summed, then
+    // binned further, so the search touches a few hundred thousand values instead of the whole frame.
+    class StarFinder
+    {
+    private:
+        ThreadPool* pool;
+        bool ownsPool;
+        int binning;
+        float threshold;
+        int maxStars;
+        std::vector<uint32_t> luminance;
+        int lumWidth;
+        int lumHeight;
+        float background;
+        float noise;
+
+        void Bin(const uint16_t* raw, int width, int first, int last);
+        void MeasureBackground();
+
+    public:
+        StarFinder(ThreadPool* pool = NULL); // NULL uses a pool of its own, one thread per core
+        ~StarFinder();
+
+        void SetBinning(int cells);      // Colour cells per luminance pixel across, 2 by default (4x4 frame pixels)
+        void SetThreshold(float sigma);  // Detection level above the background in noise sigmas, 5 by default
+        void SetMaxStars(int count);     // Brightest ones kept, 50 by default
+        int GetScale();                  // Frame pixels per luminance pixel across
+
+        // Stars brightest first. False for frames smaller than one luminance pixel
+        bool Find(const uint16_t* raw, int width, int height, std::vector<struct Star>* stars);
+        float GetBackground(); // Of the last Find, in luminance units
+        float GetNoise();
+    };
+}
+
+#endif /* __OPEN_SSPRO_STARFINDER_H__ */
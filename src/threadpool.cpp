@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  threadpool.cpp - Worker threads for tiled frame processing
+*/
+
+#include "threadpool.h"
+
+using namespace OpenSSPRO;
+
+ThreadPool::ThreadPool(int threads)
+{
+    task = NULL;
+    next = 0;
+    count = 0;
+    remaining = 0;
+    stopping = false;
+
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    for (int i=1; i<threads; i++)
+        workers.push_back(std::thread(&ThreadPool::Worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    workReady.notify_all();
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+int ThreadPool::GetThreadCount()
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::Worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        workReady.wait(guard, [this] { return stopping || next < count; });
+        if (stopping)
+            return;
+
+        const std::function<void(int)>* current = task;
+        int index = next++;
+        guard.unlock();
+        (*current)(index);
+        guard.lock();
+        if (--remaining == 0)
+            allDone.notify_all();
+    }
+}
+
+void ThreadPool::Run(int tasks, const std::function<void(int)>& task)
+{
+    if (tasks <= 0)
+        return;
+
+    std::lock_guard<std::mutex> running(runLock);
+    std::unique_lock<std::mutex> guard(lock);
+    this->task = &task;
+    next = 0;
+    count = tasks;
+    remaining = tasks;
+    workReady.notify_all();
+
+    while (next < count)
+    {
+        int index = next++;
+        guard.unlock();
+        task(index);
+        guard.lock();
+        remaining--;
+    }
+    allDone.wait(guard, [this] { return remaining == 0; });
+
+    this->task = NULL;
+    next = 0;
+    count = 0;
+}
@@ -0,0 +1,45 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_THREADPOOL_H__
+#define __OPEN_SSPRO_THREADPOOL_H__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+namespace OpenSSPRO
+{
+    // Fixed set of worker threads for splitting one frame into tiles, the calling thread works too
+    class ThreadPool
+    {
+    private:
+        std::vector<std::thread> workers;
+        std::mutex runLock; // One Run() at a time
+        std::mutex lock;
+        std::condition_variable workReady;
+        std::condition_variable allDone;
+        const std::function<void(int)>* task;
+        int next;
+        int count;
+        int remaining;
+        bool stopping;
+
+        void Worker();
+
+    public:
+        ThreadPool(int threads = 0); // Including the caller, 0 for one per core
+        ~ThreadPool();
+
+        int GetThreadCount();
+        void Run(int tasks, const std::function<void(int)>& task); // Calls task(0..tasks-1), returns when all are done
+    };
+}
+
+#endif /* __OPEN_SSPRO_THREADPOOL_H__ */
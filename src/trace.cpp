@@ -0,0 +1,240 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  trace.cpp - Lock free timing records and latency histograms for the capture pipeline
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.h"
+
+using namespace OpenSSPRO;
+
+static const char* eventNames[TRACE_EVENT_COUNT] = {
+    "command", "exposure", "download", "first byte", "transfer", "decode", "measure", "calibrate", "save", "reconnect"
+};
+
+static std::atomic<int> threadCount(0);
+
+static int ThreadNumber()
+{
+    thread_local int number = ++threadCount;
+    return number;
+}
+
+Tracer::Tracer(int records)
+{
+    uint64_t size = 1;
+    while (size < (uint64_t)records)
+        size <<= 1;
+    ring = new slot[size];
+    mask = size - 1;
+    enabled = true;
+    origin = Now();
+    this->Reset();
+}
+
+Tracer::~Tracer()
+{
+    delete[] ring;
+}
+
+uint64_t Tracer::Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+const char* Tracer::GetName(TraceEvent event)
+{
+    return (event >= 0 && event < TRACE_EVENT_COUNT) ? eventNames[event] : "unknown";
+}
+
+void Tracer::SetEnabled(bool enabled)
+{
+    this->enabled = enabled;
+}
+
+bool Tracer::IsEnabled()
+{
+    return enabled;
+}
+
+// Not safe against writers running at the same time, call it between frames
+void Tracer::Reset()
+{
+    for (uint64_t i=0; i<=mask; i++)
+        ring[i].sequence.store(0, std::memory_order_relaxed);
+    head.store(0);
+    for (int event=0; event<TRACE_EVENT_COUNT; event++)
+    {
+        stats[event].count.store(0, std::memory_order_relaxed);
+        stats[event].total.store(0, std::memory_order_relaxed);
+        for (int i=0; i<TRACE_BUCKETS; i++)
+            stats[event].buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Tracer::Record(TraceEvent event, uint64_t start, uint64_t duration, uint64_t value)
+{
+    // Claim a slot, a writer lapped by the ring just overwrites the oldest record
+    uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+    slot& record = ring[index & mask];
+    record.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.start.store(start, std::memory_order_relaxed);
+    record.duration.store(duration, std::memory_order_relaxed);
+    record.value.store(value, std::memory_order_relaxed);
+    record.tag.store((ThreadNumber() << 8) | event, std::memory_order_relaxed);
+    record.sequence.store(index * 2 + 2, std::memory_order_release);
+
+    counters& counter = stats[event];
+    counter.count.fetch_add(1, std::memory_order_relaxed);
+    counter.total.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Tracer::Span(TraceEvent event, uint64_t start, uint64_t value)
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    uint64_t now = Now();
+    uint64_t duration = (now > start) ? now - start : 0;
+    this->Record(event, start, duration, value);
+
+    int bucket = 0;
+    for (uint64_t us = duration / 1000; us > 0 && bucket < TRACE_BUCKETS - 1; us >>= 1)
+        bucket++;
+    stats[event].buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Tracer::Instant(TraceEvent event, uint64_t value)
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+    this->Record(event, Now(), 0, value);
+}
+
+uint64_t Tracer::GetCount(TraceEvent event)
+{
+    return stats[event].count.load(std::memory_order_relaxed);
+}
+
+uint64_t Tracer::GetTotal(TraceEvent event)
+{
+    return stats[event].total.load(std::memory_order_relaxed);
+}
+
+void Tracer::GetHistogram(TraceEvent event, uint64_t* buckets)
+{
+    for (int i=0; i<TRACE_BUCKETS; i++)
+        buckets[i] = stats[event].buckets[i].load(std::memory_order_relaxed);
+}
+
+// Interpolated within the bucket it lands in, so good to a factor of 2 at worst
+double Tracer::GetPercentile(TraceEvent event, double percent)
+{
+    uint64_t buckets[TRACE_BUCKETS];
+    this->GetHistogram(event, buckets);
+    uint64_t count = 0;
+    for (int i=0; i<TRACE_BUCKETS; i++)
+        count += buckets[i];
+    if (count == 0)
+        return 0.0;
+
+    double wanted = count * percent / 100.0;
+    double seen = 0.0;
+    for (int i=0; i<TRACE_BUCKETS; i++)
+    {
+        if (buckets[i] > 0 && seen + buckets[i] >= wanted)
+        {
+            double low = (i == 0) ? 0.0 : (double)(1ull << (i - 1));
+            double high = (double)(1ull << i);
+            return low + (high - low) * (wanted - seen) / buckets[i];
+        }
+        seen += buckets[i];
+    }
+    return (double)(1ull << (TRACE_BUCKETS - 1));
+}
+
+int Tracer::Snapshot(std::vector<TraceRecord>& records)
+{
+    records.clear();
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t first = (end > mask + 1) ? end - (mask + 1) : 0;
+    for (uint64_t index=first; index<end; index++)
+    {
+        const slot& record = ring[index & mask];
+        uint64_t sequence = record.sequence.load(std::memory_order_acquire);
+        if (sequence != index * 2 + 2)
+            continue; // Still being written, or already overwritten
+
+        struct TraceRecord copy;
+        copy.start = record.start.load(std::memory_order_relaxed);
+        copy.duration = record.duration.load(std::memory_order_relaxed);
+        copy.value = record.value.load(std::memory_order_relaxed);
+        uint32_t tag = record.tag.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.sequence.load(std::memory_order_relaxed) != sequence)
+            continue; // Overwritten while it was copied
+        copy.thread = tag >> 8;
+        copy.event = (TraceEvent)(tag & 0xFF);
+        records.push_back(copy);
+    }
+    return records.size();
+}
+
+// Trace Event Format, spans as complete events and instants on their thread, times in us from construction
+bool Tracer::WriteChromeTrace(const char* fileName)
+{
+    std::vector<TraceRecord> records;
+    this->Snapshot(records);
+
+    FILE* file = fopen(fileName, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"OpenSSPRO\"}}");
+    for (size_t i=0; i<records.size(); i++)
+    {
+        const struct TraceRecord& record = records[i];
+        double start = (record.start >= origin) ? (record.start - origin) / 1000.0 : 0.0;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"sspro\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,",
+                GetName(record.event), record.thread, start);
+        if (record.event == TRACE_FIRST_BYTE)
+            fprintf(file, "\"ph\":\"i\",\"s\":\"t\",");
+        else
+            fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,", record.duration / 1000.0);
+        fprintf(file, "\"args\":{\"value\":%llu}}", (unsigned long long)record.value);
+    }
+    fprintf(file, "\n]}\n");
+
+    bool written = (ferror(file) == 0);
+    if (fclose(file) != 0)
+        written = false;
+    return written;
+}
+
+void Tracer::PrintSummary()
+{
+    printf("%-10s %8s %14s %10s %10s %10s\n", "Event", "Count", "Total", "p50 us", "p90 us", "p99 us");
+    for (int i=0; i<TRACE_EVENT_COUNT; i++)
+    {
+        TraceEvent event = (TraceEvent)i;
+        uint64_t count = this->GetCount(event);
+        if (count == 0)
+            continue;
+        printf("%-10s %8llu %14llu", GetName(event), (unsigned long long)count, (unsigned long long)this->GetTotal(event));
+        if (event == TRACE_FIRST_BYTE)
+            printf("\n");
+        else
+            printf(" %10.0f %10.0f %10.0f\n", this->GetPercentile(event, 50.0), this->GetPercentile(event, 90.0),
+                   this->GetPercentile(event, 99.0));
+    }
+}
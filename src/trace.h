@@ -0,0 +1,99 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_TRACE_H__
+#define __OPEN_SSPRO_TRACE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#define TRACE_DEFAULT_RECORDS 65536 // Ring size, a night of frames at a few hundred records each wraps, counters don't
+#define TRACE_BUCKETS         32    // Latency histogram buckets, bucket n holds durations below 2^n us
+
+namespace OpenSSPRO
+{
+    enum TraceEvent
+    {
+        TRACE_COMMAND = 0,    // Command sent until its result is read, value is the command
+        TRACE_EXPOSURE = 1,   // Capture command until the camera reports the frame ready, value is the exposure in ms
+        TRACE_DOWNLOAD = 2,   // Download command until the last byte, value is bytes received
+        TRACE_FIRST_BYTE = 3, // Instant, the first URB of a download completed. Value is ns since the download command
+        TRACE_TRANSFER = 4,   // One URB, from the previous completion to this one. Value is its bytes
+        TRACE_DECODE = 5,     // Row decoding, once per URB with its bytes as the value, and once for the tail
+        TRACE_MEASURE = 6,    // Frame statistics and star sample
+        TRACE_CALIBRATE = 7,  // Masters applied
+        TRACE_SAVE = 8,       // Frame written to disk, value is file bytes
+        TRACE_RECONNECT = 9,  // Reconnect until the camera is claimed and set up again
+        TRACE_EVENT_COUNT = 10
+    };
+
+    struct TraceRecord {
+        uint64_t start;    // CLOCK_MONOTONIC ns
+        uint64_t duration; // ns, 0 for instants
+        uint64_t value;
+        int thread;        // Small number per thread, in the order threads first record
+        TraceEvent event;
+    };
+
+    // Always on timing of the capture pipeline. Records go into a fixed ring that writers claim slots
+    // of with one atomic add, so recording never locks or allocates and a reader can copy the ring
+    // while the camera is running. Every event also keeps a count, a total of its values and a
+    // histogram of its durations, which survive the ring wrapping.
+    class Tracer
+    {
+    private:
+        struct slot {
+            std::atomic<uint64_t> sequence; // Odd while being written, 2 * (index + 1) once written
+            std::atomic<uint64_t> start;
+            std::atomic<uint64_t> duration;
+            std::atomic<uint64_t> value;
+            std::atomic<uint32_t> tag; // Event in the low byte, thread above
+        };
+
+        struct counters {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total;
+            std::atomic<uint64_t> buckets[TRACE_BUCKETS];
+        };
+
+        slot* ring;
+        uint64_t mask;
+        std::atomic<uint64_t> head; // Records ever claimed
+        std::atomic<bool> enabled;
+        counters stats[TRACE_EVENT_COUNT];
+        uint64_t origin; // Now() at construction, trace timestamps are relative to it
+
+        void Record(TraceEvent event, uint64_t start, uint64_t duration, uint64_t value);
+
+    public:
+        Tracer(int records = TRACE_DEFAULT_RECORDS); // Rounded up to a power of 2
+        ~Tracer();
+
+        static uint64_t Now(); // CLOCK_MONOTONIC ns
+        static const char* GetName(TraceEvent event);
+
+        void SetEnabled(bool enabled); // On by default, off makes every call a single load
+        bool IsEnabled();
+        void Reset();                  // Drops the records and zeroes the counters
+
+        // start from Now() when the span began, ends now
+        void Span(TraceEvent event, uint64_t start, uint64_t value = 0);
+        void Instant(TraceEvent event, uint64_t value = 0);
+
+        uint64_t GetCount(TraceEvent event);
+        uint64_t GetTotal(TraceEvent event);                  // Sum of the values, bytes for transfers
+        void GetHistogram(TraceEvent event, uint64_t* buckets); // TRACE_BUCKETS counts
+        double GetPercentile(TraceEvent event, double percent); // us, read off the histogram
+
+        int Snapshot(std::vector<TraceRecord>& records); // Records still in the ring, oldest first
+        bool WriteChromeTrace(const char* fileName);     // JSON for chrome://tracing and Perfetto
+        void PrintSummary();                             // Counts and latency percentiles per event
+    };
+}
+
+#endif /* __OPEN_SSPRO_TRACE_H__ */
@@ -0,0 +1,50 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_TRANSPORT_H__
+#define __OPEN_SSPRO_TRANSPORT_H__
+
+#include <stddef.h>
+
+namespace OpenSSPRO
+{
+    // Reports how many bytes of the frame buffer are filled, called on the thread inside ReceiveFrame
+    typedef void (*ReceiveProgress)(unsigned int received, void* context);
+
+    // Moves packets between SSPRO and a camera. Results use the libusb error codes.
+    class Transport
+    {
+    public:
+        virtual ~Transport() {}
+
+        virtual bool Open() = 0;
+        virtual void Close() = 0;
+
+        // Bulk packets on the command and response endpoints
+        virtual int Send(unsigned char* data, int length, int* sent, unsigned int timeout) = 0;
+        virtual int Receive(unsigned char* data, int length, int* received, unsigned int timeout) = 0;
+
+        // Image data, read into buffer until the camera ends the frame with a short packet.
+        // Progress is reported as the buffer fills, always from the start and in order.
+        virtual int ReceiveFrame(unsigned char* buffer, unsigned int capacity, unsigned int* received,
+                                 ReceiveProgress progress, void* context) = 0;
+
+        // IsAttached turns false once the camera is known to have dropped off the bus. Reconnect waits
+        // up to timeoutMs for the same camera to come back and claims it again
+        virtual bool IsAttached() { return true; }
+        virtual bool Reconnect(int) { return false; }
+
+        virtual void SetTransferQueue(int, int) {}
+
+        // Frame buffers the transport can receive into without a copy, e.g. USB device memory. NULL when it
+        // has none, the frame pool falls back to the heap. The transport must stay open until each is freed
+        virtual unsigned char* AllocateBuffer(unsigned int) { return NULL; }
+        virtual void FreeBuffer(unsigned char*, unsigned int) {}
+    };
+}
+
+#endif /* __OPEN_SSPRO_TRANSPORT_H__ */
@@ -0,0 +1,75 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  usbcontext.cpp - Shared libusb context and its event thread
+*/
+
+#include <stdio.h>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <libusb-1.0/libusb.h>
+
+#include "opensspro.h"
+#include "usbcontext.h"
+
+#define EVENT_TIMEOUT_MS 250 // Longest the event thread takes to notice it should stop
+
+using namespace OpenSSPRO;
+
+static std::mutex contextLock; // Guards everything below
+static libusb_context* context = NULL;
+static int references = 0;
+static std::thread eventThread;
+static std::atomic<bool> handlingEvents(false);
+
+libusb_context* UsbContext::Acquire()
+{
+    std::lock_guard<std::mutex> guard(contextLock);
+    if (references == 0)
+    {
+        DEBUG("Searching for USB root...");
+        int result = libusb_init(&context);
+        if (result < 0)
+        {
+            ERROR("Failed to init libusb, result = %d", result);
+            context = NULL;
+            return NULL;
+        }
+        DEBUG("Ready\n");
+
+        handlingEvents = true;
+        eventThread = std::thread(&UsbContext::HandleEvents);
+    }
+    references++;
+    return context;
+}
+
+void UsbContext::Release()
+{
+    std::lock_guard<std::mutex> guard(contextLock);
+    if (references == 0 || --references > 0)
+        return;
+
+    handlingEvents = false;
+    libusb_interrupt_event_handler(context);
+    eventThread.join();
+    libusb_exit(context);
+    context = NULL;
+}
+
+// Completion callbacks run here, they only move bookkeeping and resubmit so every camera stays fed
+void UsbContext::HandleEvents()
+{
+    libusb_context* usb = context; // Fixed for the thread's lifetime, Release joins before clearing it
+    while (handlingEvents)
+    {
+        struct timeval timeout = { 0, EVENT_TIMEOUT_MS * 1000 };
+        int result = libusb_handle_events_timeout_completed(usb, &timeout, NULL);
+        if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED)
+            ERROR("Failed to handle USB events, result = %d\n", result);
+    }
+}
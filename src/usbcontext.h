@@ -0,0 +1,29 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_USBCONTEXT_H__
+#define __OPEN_SSPRO_USBCONTEXT_H__
+
+typedef struct libusb_context libusb_context;
+
+namespace OpenSSPRO
+{
+    // The process wide libusb context and the one thread that handles its events. Each open
+    // UsbTransport holds a reference and the thread runs while any does. URBs of every camera
+    // complete on it, so one camera's download never waits on another's event handling.
+    class UsbContext
+    {
+    private:
+        static void HandleEvents();
+
+    public:
+        static libusb_context* Acquire(); // NULL if libusb failed to start
+        static void Release();            // The last one stops the event thread and closes libusb
+    };
+}
+
+#endif /* __OPEN_SSPRO_USBCONTEXT_H__ */
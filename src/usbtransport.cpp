@@ -0,0 +1,500 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+
+  usbtransport.cpp - libusb backend, bulk commands and the queued URB frame download
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <libusb-1.0/libusb.h>
+
+#include "opensspro.h"
+#include "protocol.h"
+#include "usbtransport.h"
+
+#define DEFAULT_TRANSFER_COUNT 8
+#define DEFAULT_TRANSFER_SIZE  (256*1024) // Must be a multiple of BUFFER_SIZE
+#define MAX_TRANSFER_COUNT     32
+#define MAX_PORT_DEPTH         7          // USB 3 allows hubs 7 deep
+#define RECONNECT_POLL_MS      500        // Bus rescan interval while waiting for a camera without hotplug
+
+using namespace OpenSSPRO;
+
+// Serial number and bus-port path of a Starshoot, false for any other device
+static bool Identify(libusb_device* device, char* serial, int serialSize, char* location, int locationSize)
+{
+    struct libusb_device_descriptor descriptor;
+    if (libusb_get_device_descriptor(device, &descriptor) < 0)
+        return false;
+    if (descriptor.idVendor != SSPRO_VENDOR_ID || descriptor.idProduct != SSPRO_PRODUCT_ID)
+        return false;
+
+    uint8_t ports[MAX_PORT_DEPTH];
+    int depth = libusb_get_port_numbers(device, ports, MAX_PORT_DEPTH);
+    int length = snprintf(location, locationSize, "%u", libusb_get_bus_number(device));
+    for (int i=0; i<depth && length < locationSize; i++)
+        length += snprintf(location + length, locationSize - length, "%c%u", (i == 0) ? '-' : '.', ports[i]);
+
+    serial[0] = 0;
+    libusb_device_handle* handle;
+    if (descriptor.iSerialNumber != 0 && libusb_open(device, &handle) == 0)
+    {
+        if (libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, (unsigned char*)serial, serialSize) < 0)
+            serial[0] = 0;
+        libusb_close(handle);
+    }
+    return true;
+}
+
+static int LIBUSB_CALL HotplugCallback(libusb_context*, libusb_device* device, libusb_hotplug_event event, void* context)
+{
+    ((UsbTransport*)context)->DeviceChanged(device, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    return 0; // Stay registered
+}
+
+UsbTransport::UsbTransport(const std::string& serial)
+{
+    this->serial = serial;
+    device = NULL;
+    claimed = false;
+    transferCount = DEFAULT_TRANSFER_COUNT;
+    transferSize = DEFAULT_TRANSFER_SIZE;
+    attached = false;
+    attachedDevice = NULL;
+    arrivals = 0;
+    hotplug = 0;
+    watching = false;
+
+    usb = UsbContext::Acquire();
+    if (usb && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        watching = (libusb_hotplug_register_callback(usb, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                                     LIBUSB_HOTPLUG_NO_FLAGS, SSPRO_VENDOR_ID, SSPRO_PRODUCT_ID,
+                                                     LIBUSB_HOTPLUG_MATCH_ANY, HotplugCallback, this, &hotplug) == LIBUSB_SUCCESS);
+}
+
+UsbTransport::~UsbTransport()
+{
+    this->Close();
+    if (watching)
+        libusb_hotplug_deregister_callback(usb, hotplug);
+    if (usb)
+        UsbContext::Release();
+}
+
+struct deviceInfo* UsbTransport::ListDevices()
+{
+    libusb_context* usb = UsbContext::Acquire();
+    if (usb == NULL)
+        return NULL;
+
+    struct deviceInfo* first = NULL;
+    struct deviceInfo** last = &first;
+    libusb_device** list;
+    ssize_t count = libusb_get_device_list(usb, &list);
+    for (ssize_t i=0; i<count; i++)
+    {
+        struct deviceInfo info;
+        if (!Identify(list[i], info.serialNum, sizeof(info.serialNum), info.location, sizeof(info.location)))
+            continue;
+        info.next = NULL;
+        *last = new deviceInfo(info);
+        last = &(*last)->next;
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+
+    UsbContext::Release();
+    return first;
+}
+
+void UsbTransport::FreeDevices(struct deviceInfo* devices)
+{
+    while (devices)
+    {
+        struct deviceInfo* next = devices->next;
+        delete devices;
+        devices = next;
+    }
+}
+
+bool UsbTransport::Open()
+{
+    if (usb == NULL)
+        return false;
+
+    DEBUG("Looking for camera %s...", serial.empty() ? "" : serial.c_str());
+    libusb_device** list;
+    ssize_t count = libusb_get_device_list(usb, &list);
+    std::string identity;
+    for (ssize_t i=0; i<count && this->device == NULL; i++)
+    {
+        char serialNum[256], location[32];
+        if (!Identify(list[i], serialNum, sizeof(serialNum), location, sizeof(location)))
+            continue;
+        if (!serial.empty() && serial != serialNum && serial != location)
+            continue;
+        if (libusb_open(list[i], &this->device) < 0)
+        {
+            this->device = NULL;
+            continue;
+        }
+        // One already claimed belongs to another SSPRO or process, sharing its endpoints would garble both.
+        // Without a serial to go on try the next, the one asked for by serial is not opened at all
+        if (!this->Claim())
+        {
+            if (!serial.empty())
+                ERROR("Failed to claim camera %s\n", serialNum[0] ? serialNum : location);
+            libusb_close(this->device);
+            this->device = NULL;
+            continue;
+        }
+        identity = serialNum[0] ? serialNum : location;
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+
+    if (this->device == NULL)
+    {
+        DEBUG("NOT found!\n");
+        return false;
+    }
+    DEBUG("Found %s\n", identity.c_str());
+
+    // A reconnect looks for this camera and no other
+    serial = identity;
+    std::lock_guard<std::mutex> guard(hotplugLock);
+    attachedDevice = libusb_get_device(this->device);
+    attached = true;
+    return true;
+}
+
+bool UsbTransport::Claim()
+{
+    DEBUG("Checking for kernel driver...");
+    int result;
+    if (libusb_kernel_driver_active(this->device, 0) == 1)
+    {
+        result = libusb_detach_kernel_driver(this->device, 0);
+        if (result < 0)
+            ERROR("Failed to detach kernel driver, result = %d", result);
+    }
+    DEBUG("Done\n");
+
+    DEBUG("Setting USB configuration...");
+    result = libusb_set_configuration(this->device, 1); // Only one configuration available
+    if (result < 0)
+        ERROR("Failed to set configuration, result = %d", result);
+    DEBUG("Done\n");
+
+    DEBUG("Claiming USB interface...");
+    result = libusb_claim_interface(this->device, 0); // Only one interface available
+    if (result < 0)
+    {
+        ERROR("Failed to claim interface, result = %d", result);
+        return false;
+    }
+    claimed = true;
+    DEBUG("Done\n");
+
+    return true;
+}
+
+void UsbTransport::Close()
+{
+    if (this->device)
+    {
+        if (claimed)
+            libusb_release_interface(this->device, 0);
+        libusb_close(this->device);
+    }
+    for (size_t i=0; i<retired.size(); i++)
+        libusb_close(retired[i]);
+    retired.clear();
+    this->device = NULL;
+    claimed = false;
+
+    std::lock_guard<std::mutex> guard(hotplugLock);
+    attachedDevice = NULL;
+    attached = false;
+}
+
+bool UsbTransport::IsAttached()
+{
+    return attached;
+}
+
+void UsbTransport::DeviceChanged(libusb_device* device, bool arrived)
+{
+    std::lock_guard<std::mutex> guard(hotplugLock);
+    if (arrived)
+    {
+        arrivals++;
+        hotplugChanged.notify_all();
+    }
+    else if (device == attachedDevice)
+    {
+        DEBUG("Camera %s left the bus\n", serial.c_str());
+        attached = false;
+    }
+}
+
+// Only a camera that is gone counts as detached, a single failed transfer is reported like any other
+// error. A stall is cleared here so the next transfer on the endpoint can go through
+void UsbTransport::Failed(int result, unsigned char endpoint)
+{
+    if (result == LIBUSB_ERROR_NO_DEVICE)
+        attached = false;
+    else if (result == LIBUSB_ERROR_PIPE)
+    {
+        int cleared = libusb_clear_halt(this->device, endpoint);
+        if (cleared == LIBUSB_ERROR_NO_DEVICE)
+            attached = false;
+        else if (cleared < 0)
+            ERROR("Failed to clear stall on endpoint 0x%02x, result = %d", endpoint, cleared);
+    }
+}
+
+bool UsbTransport::Reconnect(int timeoutMs)
+{
+    // The frame pool may hold device memory from this handle until it is freed, so the handle is
+    // kept open until Close and only the interface goes back now
+    if (this->device)
+    {
+        if (claimed)
+            libusb_release_interface(this->device, 0);
+        retired.push_back(this->device);
+        this->device = NULL;
+        claimed = false;
+    }
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    std::unique_lock<std::mutex> guard(hotplugLock);
+    attachedDevice = NULL;
+    attached = false;
+    while (true)
+    {
+        unsigned int seen = arrivals;
+        guard.unlock();
+        bool opened = this->Open();
+        guard.lock();
+        if (opened)
+            return true;
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return false;
+        // Hotplug wakes this as soon as a camera arrives, without it the bus is rescanned now and then
+        std::chrono::steady_clock::time_point wake = now + std::chrono::milliseconds(RECONNECT_POLL_MS);
+        hotplugChanged.wait_until(guard, (wake < deadline) ? wake : deadline, [&]{ return arrivals != seen; });
+    }
+}
+
+int UsbTransport::Send(unsigned char* data, int length, int* sent, unsigned int timeout)
+{
+    int result = libusb_bulk_transfer(this->device, USB_CMD_ENDPOINT, data, length, sent, timeout);
+    this->Failed(result, USB_CMD_ENDPOINT);
+    return result;
+}
+
+int UsbTransport::Receive(unsigned char* data, int length, int* received, unsigned int timeout)
+{
+    int result = libusb_bulk_transfer(this->device, USB_RX_ENDPOINT, data, length, received, timeout);
+    this->Failed(result, USB_RX_ENDPOINT);
+    return result;
+}
+
+// Shared between ReceiveFrame and the completion callback on the event thread, lock guards it
+struct downloadState
+{
+    libusb_transfer* transfers[MAX_TRANSFER_COUNT];
+    int transferCount;
+    unsigned char* buffer;
+    unsigned int capacity;
+    unsigned int submitted; // Bytes of the buffer handed to libusb so far
+    unsigned int received;  // Bytes of the frame received so far
+    int inFlight;
+    bool done;
+    int result;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+static void CancelDownload(struct downloadState* state, libusb_transfer* except)
+{
+    for (int i=0; i<state->transferCount; i++)
+        if (state->transfers[i] != except)
+            libusb_cancel_transfer(state->transfers[i]); // Idle transfers just return NOT_FOUND
+}
+
+// Runs on the event thread. Only resubmits and counts, progress and decoding happen back on
+// the thread inside ReceiveFrame so no camera holds up another's URBs
+static void LIBUSB_CALL DownloadCallback(libusb_transfer* transfer)
+{
+    struct downloadState* state = (struct downloadState*)transfer->user_data;
+    std::lock_guard<std::mutex> guard(state->lock);
+    state->inFlight--;
+    state->changed.notify_all();
+
+    if (state->done)
+        return; // Cancelled after the end of the frame, or after an error
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+        ERROR("Failed to download image, transfer status = %d", transfer->status);
+        if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+            state->result = LIBUSB_ERROR_NO_DEVICE;
+        else
+            state->result = (transfer->status == LIBUSB_TRANSFER_STALL) ? LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO;
+        state->done = true;
+        CancelDownload(state, transfer);
+        return;
+    }
+
+    // Transfers on one endpoint complete in submission order, so the data is contiguous
+    state->received = (transfer->buffer - state->buffer) + transfer->actual_length;
+
+    // A short packet marks the end of the frame, same as the old 1 KB loop
+    if (transfer->actual_length < transfer->length || state->submitted >= state->capacity)
+    {
+        state->done = true;
+        CancelDownload(state, transfer);
+        return;
+    }
+
+    // Reuse this URB for the next unclaimed region of the frame buffer
+    unsigned int length = state->capacity - state->submitted;
+    if (length > (unsigned int)transfer->length)
+        length = transfer->length;
+    transfer->buffer = state->buffer + state->submitted;
+    transfer->length = length;
+    int result = libusb_submit_transfer(transfer);
+    if (result < 0)
+    {
+        ERROR("Failed to resubmit transfer, result = %d", result);
+        state->result = result;
+        state->done = true;
+        CancelDownload(state, transfer);
+        return;
+    }
+    state->submitted += length;
+    state->inFlight++;
+}
+
+int UsbTransport::ReceiveFrame(unsigned char* buffer, unsigned int capacity, unsigned int* received,
+                               ReceiveProgress progress, void* context)
+{
+    struct downloadState state;
+    state.transferCount = 0;
+    state.buffer = buffer;
+    state.capacity = capacity;
+    state.submitted = 0;
+    state.received = 0;
+    state.inFlight = 0;
+    state.done = false;
+    state.result = LIBUSB_SUCCESS;
+
+    // Prime the queue, the callback keeps it full until the short packet arrives
+    std::unique_lock<std::mutex> guard(state.lock);
+    for (int i=0; i<transferCount && state.submitted < state.capacity; i++)
+    {
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (transfer == NULL)
+            break;
+        state.transfers[state.transferCount++] = transfer;
+
+        unsigned int length = state.capacity - state.submitted;
+        if (length > (unsigned int)transferSize)
+            length = transferSize;
+        libusb_fill_bulk_transfer(transfer, this->device, USB_RX_ENDPOINT, buffer + state.submitted, length,
+                                  DownloadCallback, &state, USB_DOWNLOAD_TIMEOUT);
+        int result = libusb_submit_transfer(transfer);
+        if (result < 0)
+        {
+            ERROR("Failed to submit transfer, result = %d", result);
+            state.result = result;
+            state.done = true;
+            CancelDownload(&state, NULL);
+            break;
+        }
+        state.submitted += length;
+        state.inFlight++;
+    }
+
+    // The event thread completes the URBs, progress is reported from here as the data arrives
+    unsigned int reported = 0;
+    while (state.inFlight > 0 || reported < state.received)
+    {
+        if (reported < state.received)
+        {
+            unsigned int filled = state.received;
+            guard.unlock();
+            if (progress)
+                progress(filled, context);
+            guard.lock();
+            reported = filled;
+            continue;
+        }
+        state.changed.wait(guard);
+    }
+    guard.unlock();
+
+    for (int i=0; i<state.transferCount; i++)
+        libusb_free_transfer(state.transfers[i]);
+
+    *received = state.received;
+    this->Failed(state.result, USB_RX_ENDPOINT);
+    if (state.result < 0)
+        return state.result;
+    if (state.transferCount == 0)
+        return LIBUSB_ERROR_NO_MEM;
+    return LIBUSB_SUCCESS;
+}
+
+void UsbTransport::SetTransferQueue(int count, int size)
+{
+    if (count < 1)
+        count = 1;
+    if (count > MAX_TRANSFER_COUNT)
+        count = MAX_TRANSFER_COUNT;
+
+    // Keep every URB a whole number of packets so only the last one can be short
+    size -= size % BUFFER_SIZE;
+    if (size < BUFFER_SIZE)
+        size = BUFFER_SIZE;
+
+    transferCount = count;
+    transferSize = size;
+}
+
+// Kernel mapped memory lets usbfs DMA into the buffer without bouncing through its own copy
+unsigned char* UsbTransport::AllocateBuffer(unsigned int size)
+{
+    if (this->device == NULL)
+        return NULL;
+    unsigned char* buffer = libusb_dev_mem_alloc(this->device, size);
+    if (buffer != NULL)
+    {
+        std::lock_guard<std::mutex> guard(bufferLock);
+        buffers[buffer] = this->device;
+    }
+    return buffer;
+}
+
+void UsbTransport::FreeBuffer(unsigned char* buffer, unsigned int size)
+{
+    std::lock_guard<std::mutex> guard(bufferLock);
+    std::map<unsigned char*, libusb_device_handle*>::iterator found = buffers.find(buffer);
+    if (found == buffers.end())
+    {
+        ERROR("Frame buffer %p did not come from this camera\n", buffer);
+        return;
+    }
+    libusb_dev_mem_free(found->second, buffer, size);
+    buffers.erase(found);
+}
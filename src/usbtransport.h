@@ -0,0 +1,79 @@
+/*
+  Copyright (c) 2016 Louis McCarthy
+  All rights reserved.
+
+  Licensed under MIT License, see LICENSE for full License text
+*/
+
+#ifndef __OPEN_SSPRO_USBTRANSPORT_H__
+#define __OPEN_SSPRO_USBTRANSPORT_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "transport.h"
+#include "usbcontext.h"
+
+typedef struct libusb_device_handle libusb_device_handle;
+
+namespace OpenSSPRO
+{
+    struct deviceInfo;
+    typedef struct libusb_device libusb_device;
+
+    // Talks to a real camera through libusb
+    class UsbTransport : public Transport
+    {
+    private:
+        libusb_context* usb;
+        libusb_device_handle* device;
+        std::string serial; // Camera to open, empty for the first free one. Pinned to the one opened
+        bool claimed;
+        int transferCount;
+        int transferSize;
+
+        // Hotplug events arrive on the event thread, hotplugLock guards what they touch
+        std::mutex hotplugLock;
+        std::condition_variable hotplugChanged;
+        std::atomic<bool> attached;
+        libusb_device* attachedDevice;
+        unsigned int arrivals;
+        int hotplug;   // libusb_hotplug_callback_handle
+        bool watching; // False where libusb has no hotplug support, Reconnect polls instead
+        std::vector<libusb_device_handle*> retired; // Handles the frame pool may still hold device memory from
+        std::mutex bufferLock; // Buffers are freed on whichever thread releases the last Frame
+        std::map<unsigned char*, libusb_device_handle*> buffers; // Device memory handed out, by the handle that mapped it
+
+        bool Claim();
+        void Failed(int result, unsigned char endpoint);
+
+    public:
+        UsbTransport(const std::string& serial = ""); // Serial number or bus-port location, see ListDevices
+        ~UsbTransport();
+
+        static struct deviceInfo* ListDevices(); // Every Starshoot on the bus, free with FreeDevices
+        static void FreeDevices(struct deviceInfo* devices);
+
+        bool Open();
+        void Close(); // Releases the interface so the camera is free for the next process
+
+        bool IsAttached();
+        bool Reconnect(int timeoutMs);
+        void DeviceChanged(libusb_device* device, bool arrived); // From the hotplug callback
+
+        int Send(unsigned char* data, int length, int* sent, unsigned int timeout);
+        int Receive(unsigned char* data, int length, int* received, unsigned int timeout);
+        int ReceiveFrame(unsigned char* buffer, unsigned int capacity, unsigned int* received,
+                         ReceiveProgress progress, void* context);
+
+        void SetTransferQueue(int count, int size); // Number and size (bytes) of URBs kept in flight during download
+        unsigned char* AllocateBuffer(unsigned int size);
+        void FreeBuffer(unsigned char* buffer, unsigned int size);
+    };
+}
+
+#endif /* __OPEN_SSPRO_USBTRANSPORT_H__ */